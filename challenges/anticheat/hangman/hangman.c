@@ -1,7 +1,7 @@
 /**
  * @file hangman.c
  * @brief a hangman game for 1 player
- * @detail uses doubling memory allocation to allow the computer to choose a random word
+ * @detail loads the dictionary in one block, indexed by word, to allow the computer to choose a random word
  *
  * @author Luke Rindels
  * @date April 6, 2017
@@ -171,40 +171,52 @@ void make_hangman(char *word, int guesses)
 
 /**
  * Opens and allocates space for the dictionary
- * 
+ *
+ * The file is read in one go and indexed in a single pass: every word stays
+ * where it is in the text (its newline becomes its terminator), the index
+ * holds its offset. The dictionary, its index and the text share a single
+ * allocation.
+ *
  * @return the dictionary
  */
 struct diction_t *file_open()
 {
-    int i = 0;
+    long size;
+    long i;
+    int start;
 
-    char buf[LEN];
     FILE *fp = fopen("dictionary.txt", "r");
-    struct diction_t *dictionary = malloc(sizeof(struct diction_t));
+    assert(fp);
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+
+    /* at most one word per 2 bytes (a letter and its newline), the rest is left untouched */
+    int max = size / 2 + 1;
+    struct diction_t *dictionary = malloc(sizeof(struct diction_t) + max * sizeof(int) + size + 1);
     assert(dictionary);
 
-    dictionary->nval = INIT;
-    dictionary->max = INIT;
-    dictionary->words = NULL;
-    /* uses doubling reallocation system */
-    while (fgets(buf, LEN, fp)) {
-        if (dictionary->words == NULL) {
-            dictionary->words = malloc(sizeof(char *));
-            assert(dictionary->words);
-        } else if (dictionary->nval > dictionary->max) {
-            dictionary->words = realloc(dictionary->words, GROW * dictionary->max *sizeof(char *));
-            assert(dictionary->words);
-            dictionary->max = GROW * dictionary->max;
-        }
-        dictionary->words[i] = malloc(sizeof(char) * LEN);
-        assert(dictionary->words[i]);
+    dictionary->nval = 0;
+    dictionary->max = max;
+    dictionary->offsets = (int *)(dictionary + 1);
+    dictionary->text = (char *)(dictionary->offsets + max);
+    size = fread(dictionary->text, 1, size, fp);
+    dictionary->text[size] = '\n';
+    fclose(fp);
 
-        strncpy(dictionary->words[i], strtok(buf, "\n"), LEN);
-        i++;
-        dictionary->nval++;
+    /* builds the index, skipping empty lines */
+    start = 0;
+    for (i = 0; i <= size; i++) {
+        char ch = dictionary->text[i];
+        if (ch != '\n' && ch != '\r') {
+            continue;
+        }
+        dictionary->text[i] = '\0';
+        if (i > start) {
+            dictionary->offsets[dictionary->nval++] = start;
+        }
+        start = i + 1;
     }
-    dictionary->nval--;
-    fclose(fp);
 
     return dictionary;
 }
@@ -216,12 +228,6 @@ struct diction_t *file_open()
  */
 void free_mem(struct diction_t *dictionary)
 {
-    int i;
-         
-    for (i = 0; i < dictionary->nval; i++) {
-        free(dictionary->words[i]);
-    }
-    free(dictionary->words);
     free(dictionary);
 }
 
@@ -234,7 +240,7 @@ void free_mem(struct diction_t *dictionary)
 char *get_word(struct diction_t *dictionary)
 {
     int r = random() % dictionary->nval;
-    return dictionary->words[r];
+    return dictionary->text + dictionary->offsets[r];
 }
 
 /**
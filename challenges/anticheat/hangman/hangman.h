@@ -9,12 +9,11 @@
 #ifndef HANG_H
 #define HANG_H
 struct diction_t {
-    int nval;
-    int max;
-    char **words;
+    int nval;     // number of words
+    int max;      // capacity of the index
+    int *offsets; // index: offset of each word in text
+    char *text;   // the whole file, one '\0' terminated word per line
 };
-
-enum {INIT = 1, GROW = 2};
 void make_hangman(char *word, int guesses);
 void free_mem(struct diction_t *dictionary);
 char *get_word(struct diction_t *dictionary);
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#ifndef __RINGBUF_WAKEUP_H
+#define __RINGBUF_WAKEUP_H
+
+// Batched wakeup of userspace for the BPF ring buffers of the challenges.
+//
+// Records are submitted with BPF_RB_NO_WAKEUP while fewer than
+// `wakeup_batch` of them wait in the buffer (BPF_RB_AVAIL_DATA: bytes
+// produced but not consumed yet), and with BPF_RB_FORCE_WAKEUP once that
+// many do, so userspace drains them in batches instead of once per event.
+// The records left at the end of a burst are the job of a one-shot
+// bpf_timer: armed by the first sleeping record, it wakes userspace up
+// `wakeup_interval_ms` later if anything is still waiting.
+// wakeup_batch <= 1: kernel default (notify when userspace has caught up).
+//
+// Include after the ring buffer map, named by RINGBUF_WAKEUP_MAP, and the
+// globals:
+//     const volatile int wakeup_batch;
+//     const volatile int wakeup_interval_ms;
+// bpf_timer needs a GPL compatible license, a 5.15+ kernel, and programs
+// that aren't kprobes or tracepoints (fentry/fexit, tp_btf, ...).
+
+#ifndef RINGBUF_WAKEUP_MAP
+#define RINGBUF_WAKEUP_MAP events
+#endif
+
+#define RINGBUF_HDR_SZ 8       // header of each record (BPF_RINGBUF_HDR_SZ)
+#define RINGBUF_WAKEUP_CLOCK 1 // CLOCK_MONOTONIC (a #define, not in vmlinux.h)
+
+// ****************************************
+// Flush timer of the records left asleep
+// ****************************************
+
+struct ringbuf_wakeup {
+    struct bpf_timer timer;
+    __u32 armed; // the timer is started and hasn't fired yet
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct ringbuf_wakeup);
+} ringbuf_wakeup_timer SEC(".maps");
+
+// timer callback: wake userspace up if records are still waiting. An empty
+// record discarded with BPF_RB_FORCE_WAKEUP notifies without sending anything
+static int ringbuf_wakeup_fire(void *map, __u32 *key, struct ringbuf_wakeup *wakeup)
+{
+    wakeup->armed = 0; // first: a record submitted from now on re-arms it
+
+    if (bpf_ringbuf_query(&RINGBUF_WAKEUP_MAP, BPF_RB_AVAIL_DATA) == 0)
+        return 0;
+    void *record = bpf_ringbuf_reserve(&RINGBUF_WAKEUP_MAP, RINGBUF_HDR_SZ, 0);
+    if (record)
+        bpf_ringbuf_discard(record, BPF_RB_FORCE_WAKEUP);
+    return 0; // else full: the record that filled it forced a wakeup
+}
+
+// start the timer unless it is already running
+static __always_inline void arm_wakeup_timer(void)
+{
+    __u32 key = 0;
+    struct ringbuf_wakeup *wakeup = bpf_map_lookup_elem(&ringbuf_wakeup_timer, &key);
+    if (!wakeup || wakeup->armed || __sync_val_compare_and_swap(&wakeup->armed, 0, 1) != 0)
+        return;
+
+    // init fails with -EBUSY after the first time, which is fine
+    bpf_timer_init(&wakeup->timer, &ringbuf_wakeup_timer, RINGBUF_WAKEUP_CLOCK);
+    if (bpf_timer_set_callback(&wakeup->timer, ringbuf_wakeup_fire) != 0 ||
+        bpf_timer_start(&wakeup->timer, (__u64)wakeup_interval_ms * 1000000, 0) != 0)
+        wakeup->armed = 0;
+}
+
+// ****************************************
+// Submission
+// ****************************************
+
+// flags for bpf_ringbuf_submit() of a reserved `record_size` bytes record
+static __always_inline __u64 wakeup_flags(__u64 record_size)
+{
+    if (wakeup_batch <= 1)
+        return 0;
+
+    // records are 8 bytes aligned in the buffer, the reserved one included
+    __u64 slot = (RINGBUF_HDR_SZ + record_size + 7) & ~7ULL;
+    if (bpf_ringbuf_query(&RINGBUF_WAKEUP_MAP, BPF_RB_AVAIL_DATA) >= (__u64)wakeup_batch * slot)
+        return BPF_RB_FORCE_WAKEUP;
+    return BPF_RB_NO_WAKEUP;
+}
+
+// bpf_ringbuf_submit() of a reserved `record_size` bytes record, with a
+// batched wakeup (see above)
+static __always_inline void ringbuf_submit_batched(void *record, __u64 record_size)
+{
+    __u64 flags = wakeup_flags(record_size);
+    bpf_ringbuf_submit(record, flags);
+    if (flags == BPF_RB_NO_WAKEUP)
+        arm_wakeup_timer();
+}
+
+#endif /* __RINGBUF_WAKEUP_H */
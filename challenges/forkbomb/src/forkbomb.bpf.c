@@ -2,158 +2,319 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
+#include "forkbomb.h"
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
-// Event structure for outputting to userspace
-struct event {
-    u32 pid;
-    u32 ppid;
-    char comm[16];
-    char ancestor_comm[16];
-    u64 time_delta_ns;
-    bool killed;
-};
+#ifndef EAGAIN
+#define EAGAIN 11
+#endif
+
+#define CLONE_THREAD 0x00010000
+#define NSEC_PER_SEC 1000000000ULL
+
+#define MAX_ANCESTORS 10 // max supported ancestor_separations
+
+// What to do with a fork over its lineage's budget (throttle_mode)
+#define THROTTLE_REPORT 0 // only send an event
+#define THROTTLE_KILL   1 // SIGKILL the forking process (and its new child)
+#define THROTTLE_DENY   2 // fail the fork with EAGAIN (lsm/task_alloc, needs the bpf LSM)
 
 // Global variables that can be configured from command line
-const volatile int ancestor_separations = 3;
-const volatile long time_separation_ns = 1000000000;
+const volatile int ancestor_separations = 3; // throttled: processes named as their ancestor that far up
+const volatile int fork_rate = 50;           // forks per second a lineage may sustain...
+const volatile int fork_burst = 100;         // ... with bursts of up to that many forks
+const volatile int throttle_mode = THROTTLE_KILL;
+
+// Ancestor of a process, as cached in its lineage
+struct ancestor {
+    u64 comm_hash;
+    u64 start_ns;
+};
+
+// Lineage of a process (map[pid]=lineage): its own name & start time, and
+// those of its ancestors (anc[0] is its parent). A child's lineage is its
+// parent's shifted by one, built at fork time, so that checking an ancestor
+// is a single lookup instead of a walk up real_parent. Ancestors' entries
+// outlive them, they are only needed by the processes alive.
+// Forks are charged to the bucket of `root`: the oldest ancestor of the
+// unbroken run of processes with the same name (a whole fork bomb shares it).
+struct lineage {
+    u64 comm_hash;
+    u64 start_ns;
+    u32 root;
+    struct ancestor anc[MAX_ANCESTORS];
+};
+
+// Token bucket of a lineage: refilled with fork_rate tokens per second up to
+// fork_burst, each fork takes one (so it limits forks over a sliding window
+// of fork_burst / fork_rate seconds). Tokens are counted in 1e-9 units.
+// Updates from several CPUs at once may race: a few forks more or less
+// get through, the rate enforced stays the same.
+struct bucket {
+    u64 tokens;
+    u64 last_ns;
+    u64 forks; // charged to the lineage so far
+};
 
-// Map to store process creation times
+// Lineage of the processes alive (removed when they exit); LRU so that a
+// full map drops the least recently used entries instead of ignoring new ones
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 65536);
+    __type(key, u32);
+    __type(value, struct lineage);
+} lineages SEC(".maps");
+
+// Fork budget of the lineages (map[root pid]=bucket)
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 16384);
+    __type(key, u32);
+    __type(value, struct bucket);
+} buckets SEC(".maps");
+
+// Children of a killed process: the kill comes after the fork (see
+// handle_fork), so they are killed as well as soon as they fork themselves
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __uint(max_entries, 8192);
     __type(key, u32);
-    __type(value, u64);
-} process_start_times SEC(".maps");
+    __type(value, u8);
+} doomed_pids SEC(".maps");
+
+// Events sent to userspace (forks over budget)
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 256 * 1024);
+} events SEC(".maps");
 
-// Helper function to get process name
-static inline void get_comm(struct task_struct *task, char *comm) {
-    bpf_probe_read_kernel_str(comm, 16, task->comm);
+// Helper function to hash a process name (FNV-1a)
+static inline u64 hash_comm(const char *comm) {
+    u64 hash = 14695981039346656037ULL;
+
+    #pragma unroll
+    for (int i = 0; i < TASK_COMM_LEN; i++) {
+        if (comm[i] == '\0')
+            break;
+        hash = (hash ^ (u8)comm[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Helper function to hash the name of a task
+static inline u64 task_comm_hash(struct task_struct *task) {
+    char comm[TASK_COMM_LEN] = {};
+
+    bpf_probe_read_kernel_str(comm, sizeof(comm), task->comm);
+    return hash_comm(comm);
 }
 
-// Function to find ancestor at specified generation depth
-static struct task_struct *find_ancestor(struct task_struct *task, int depth) {
+// Build the lineage of a process started before we were loaded, by walking
+// up real_parent (once per such process, the others inherit theirs)
+static void build_lineage(struct task_struct *task, struct lineage *lin) {
     struct task_struct *current_task = task;
     struct task_struct *parent;
 
+    lin->comm_hash = task_comm_hash(task);
+    lin->start_ns = BPF_CORE_READ(task, start_time);
+    lin->root = BPF_CORE_READ(task, tgid);
+
     // Limit loop iterations for BPF verifier
     #pragma unroll
-    for (int i = 0; i < 10; i++) {
-        if (i >= depth)
-            break;
-        
+    for (int i = 0; i < MAX_ANCESTORS; i++) {
         // Get parent task
         bpf_probe_read_kernel(&parent, sizeof(parent), &current_task->real_parent);
-        if (!parent)
-            return NULL;
-        
+        if (!parent || parent == current_task)
+            break;
+
+        lin->anc[i].comm_hash = task_comm_hash(parent);
+        lin->anc[i].start_ns = BPF_CORE_READ(parent, start_time);
         current_task = parent;
     }
-    
-    return current_task;
 }
 
-// Check if current process has same name as its ancestor
-static bool has_same_name_as_ancestor(struct task_struct *task, int depth) {
-    char current_comm[16] = {};
-    char ancestor_comm[16] = {};
-    struct task_struct *ancestor;
-    
-    // Get current process name
-    get_comm(task, current_comm);
-    
-    // Find ancestor
-    ancestor = find_ancestor(task, depth);
-    if (!ancestor)
+// Helper function to know if forks of a process are throttled: it has the
+// same name as its ancestor ancestor_separations generations up
+static inline bool is_throttled(struct lineage *lin) {
+    int depth = ancestor_separations;
+
+    if (depth < 1 || depth > MAX_ANCESTORS)
         return false;
-    
-    // Get ancestor process name
-    get_comm(ancestor, ancestor_comm);
-    
-    // Compare names
-    #pragma unroll
-    for (int i = 0; i < 16; i++) {
-        if (current_comm[i] != ancestor_comm[i])
-            return false;
-        if (current_comm[i] == '\0')
-            break;
+    return lin->anc[depth - 1].start_ns && lin->anc[depth - 1].comm_hash == lin->comm_hash;
+}
+
+// Take a token from the bucket of a lineage: false if it is empty
+static bool take_token(u32 root, u64 now, u64 *forks) {
+    u64 capacity = (u64)fork_burst * NSEC_PER_SEC;
+    struct bucket *b;
+    u64 elapsed;
+
+    b = bpf_map_lookup_elem(&buckets, &root);
+    if (!b) {
+        struct bucket init = { .tokens = capacity, .last_ns = now };
+        bpf_map_update_elem(&buckets, &root, &init, BPF_NOEXIST);
+        b = bpf_map_lookup_elem(&buckets, &root);
+        if (!b)
+            return true;
     }
-    
+
+    // 1. refill for the time elapsed since the last fork
+    elapsed = now > b->last_ns ? now - b->last_ns : 0;
+    if (fork_rate > 0) {
+        if (elapsed >= capacity / fork_rate)
+            b->tokens = capacity;
+        else if (b->tokens + elapsed * fork_rate < capacity)
+            b->tokens += elapsed * fork_rate;
+        else
+            b->tokens = capacity;
+    }
+    b->last_ns = now;
+
+    // 2. take one
+    *forks = ++b->forks;
+    if (b->tokens < NSEC_PER_SEC)
+        return false;
+    b->tokens -= NSEC_PER_SEC;
     return true;
 }
 
-// Hook clone system call entry
-SEC("tracepoint/syscalls/sys_enter_clone")
-int trace_clone_enter(struct trace_event_raw_sys_enter *ctx) {
+// Helper function to send an event to userspace (dropped if the ring buffer is full)
+static void report(u32 pid, u32 ppid, u32 root, u64 forks, bool killed, bool denied) {
+    struct event *e;
+
+    e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+    if (!e)
+        return;
+    e->pid = pid;
+    e->ppid = ppid;
+    e->lineage = root;
+    bpf_get_current_comm(e->comm, sizeof(e->comm));
+    e->lineage_forks = forks;
+    e->killed = killed;
+    e->denied = denied;
+    bpf_ringbuf_submit(e, 0);
+}
+
+// Hook process creation: fork, vfork, clone & clone3 all go through it,
+// in the context of the parent (the process calling the syscall)
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(handle_fork, struct task_struct *parent, struct task_struct *child) {
     u32 pid = bpf_get_current_pid_tgid() >> 32;
     u64 current_time = bpf_ktime_get_ns();
-    struct task_struct *current_task;
-    struct task_struct *ancestor;
-    u32 ancestor_pid;
-    u64 *ancestor_start_time_ptr;
-    u64 time_delta;
+    struct lineage *lin;
+    struct lineage child_lin = {};
+    u64 forks = 0;
     bool killed = false;
-    struct event e = {};
-    
-    // Store current time for this process
-    bpf_map_update_elem(&process_start_times, &pid, &current_time, BPF_ANY);
-    
-    // Get current process information
-    current_task = (struct task_struct *)bpf_get_current_task();
-    if (!current_task)
+
+    // New thread, not a new process: nothing to track
+    u32 child_pid = BPF_CORE_READ(child, tgid);
+    if (BPF_CORE_READ(child, pid) != child_pid)
         return 0;
-    
-    // Check if process has same name as ancestor
-    if (!has_same_name_as_ancestor(current_task, ancestor_separations))
+
+    // Child of a process we killed: goes too, along with its own child
+    if (bpf_map_lookup_elem(&doomed_pids, &pid)) {
+        u8 doomed = 1;
+        bpf_map_update_elem(&doomed_pids, &child_pid, &doomed, BPF_ANY);
+        bpf_send_signal(9); // SIGKILL
         return 0;
-    
-    // Find the ancestor process
-    ancestor = find_ancestor(current_task, ancestor_separations);
-    if (!ancestor)
+    }
+
+    // Get the lineage of the current process (built if it predates us)
+    lin = bpf_map_lookup_elem(&lineages, &pid);
+    if (!lin) {
+        build_lineage((struct task_struct *)bpf_get_current_task(), &child_lin);
+        bpf_map_update_elem(&lineages, &pid, &child_lin, BPF_NOEXIST);
+        lin = bpf_map_lookup_elem(&lineages, &pid);
+        if (!lin)
+            return 0;
+    }
+
+    // Cache the lineage of the new process: same name as its parent until it execs
+    child_lin.comm_hash = lin->comm_hash;
+    child_lin.start_ns = current_time;
+    child_lin.root = lin->root;
+    child_lin.anc[0].comm_hash = lin->comm_hash;
+    child_lin.anc[0].start_ns = lin->start_ns;
+    #pragma unroll
+    for (int i = 1; i < MAX_ANCESTORS; i++)
+        child_lin.anc[i] = lin->anc[i - 1];
+    bpf_map_update_elem(&lineages, &child_pid, &child_lin, BPF_ANY);
+
+    // Charge the fork to the lineage (done before the fork in deny mode, see deny_fork)
+    if (throttle_mode == THROTTLE_DENY || !is_throttled(lin))
         return 0;
-    
-    // Get ancestor's pid
-    ancestor_pid = BPF_CORE_READ(ancestor, tgid);
-    
-    // Get ancestor's start time
-    ancestor_start_time_ptr = bpf_map_lookup_elem(&process_start_times, &ancestor_pid);
-    if (!ancestor_start_time_ptr)
+    if (take_token(lin->root, current_time, &forks))
         return 0;
-    
-    // Calculate time difference between process creation times
-    if (current_time >= *ancestor_start_time_ptr) {
-        time_delta = current_time - *ancestor_start_time_ptr;
-    } else {
-        time_delta = *ancestor_start_time_ptr - current_time;
-    }
-    
-    // Kill process if it's spawning too quickly after its ancestor with same name
-    if (time_delta < time_separation_ns) {
+
+    // Over budget: kill the process spawning that fast
+    if (throttle_mode == THROTTLE_KILL) {
+        // the child already exists: mark it so that it dies with its first fork
+        u8 doomed = 1;
+        bpf_map_update_elem(&doomed_pids, &child_pid, &doomed, BPF_ANY);
+
         bpf_send_signal(9); // SIGKILL
         killed = true;
-        
-        // Log something basic when we kill a process
-        bpf_printk("Killed fork bomb process: pid=%d name=%s", pid, e.comm);
     }
-    
-    // Prepare event for user space
-    e.pid = pid;
-    e.ppid = BPF_CORE_READ(current_task, real_parent, tgid);
-    get_comm(current_task, e.comm);
-    get_comm(ancestor, e.ancestor_comm);
-    e.time_delta_ns = time_delta;
-    e.killed = killed;
-    
-    // Log event details
-    bpf_printk("Process: pid=%d name=%s, ancestor=%s, time_delta=%llu, killed=%d", 
-               pid, e.comm, e.ancestor_comm, time_delta, killed);
-    
+    report(pid, BPF_CORE_READ(parent, real_parent, tgid), lin->root, forks, killed, false);
+
     return 0;
 }
 
-// Hook clone system call exit
-SEC("tracepoint/syscalls/sys_exit_clone")
-int trace_clone_exit(struct trace_event_raw_sys_exit *ctx) {
+// Check process creation before it happens (throttle_mode == THROTTLE_DENY):
+// forks over budget fail with EAGAIN, as when out of pids
+SEC("lsm/task_alloc")
+int BPF_PROG(deny_fork, struct task_struct *task, unsigned long clone_flags) {
+    u32 pid = bpf_get_current_pid_tgid() >> 32;
+    struct task_struct *current_task;
+    struct lineage *lin;
+    u64 forks = 0;
+
+    if (throttle_mode != THROTTLE_DENY || (clone_flags & CLONE_THREAD))
+        return 0;
+
+    // no lineage yet: handle_fork builds it, the next forks are checked
+    lin = bpf_map_lookup_elem(&lineages, &pid);
+    if (!lin || !is_throttled(lin))
+        return 0;
+    if (take_token(lin->root, bpf_ktime_get_ns(), &forks))
+        return 0;
+
+    current_task = (struct task_struct *)bpf_get_current_task();
+    report(pid, BPF_CORE_READ(current_task, real_parent, tgid), lin->root, forks, false, true);
+    return -EAGAIN;
+}
+
+// Hook exec: the process may change name, its children inherit the new one
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(handle_exec, struct task_struct *task, pid_t old_pid, struct linux_binprm *bprm) {
+    u32 pid = bpf_get_current_pid_tgid() >> 32;
+    char comm[TASK_COMM_LEN] = {};
+    struct lineage *lin;
+    u64 comm_hash;
+
+    lin = bpf_map_lookup_elem(&lineages, &pid);
+    if (!lin)
+        return 0;
+
+    // a new name starts a new lineage
+    bpf_get_current_comm(comm, sizeof(comm));
+    comm_hash = hash_comm(comm);
+    if (comm_hash != lin->comm_hash) {
+        lin->comm_hash = comm_hash;
+        lin->root = pid;
+    }
     return 0;
-}
\ No newline at end of file
+}
+// Hook process exit: forget it (the hook runs for every thread, only
+// the main one ends the process)
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(handle_exit, struct task_struct *task) {
+    u32 pid = BPF_CORE_READ(task, tgid);
+    if (BPF_CORE_READ(task, pid) != pid)
+        return 0;
+
+    bpf_map_delete_elem(&lineages, &pid);
+    bpf_map_delete_elem(&doomed_pids, &pid);
+    return 0;
+}
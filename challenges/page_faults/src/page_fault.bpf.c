@@ -16,7 +16,7 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 /* Need to do 3 things:
  * 1. Probe to kernel-space handle_mm_fault() to detect page faults. When hook gets triggered -> update the `mapping` map defined below.
  * 2. Hook into `mapping` updates to check if a pid has `page_fault_count % log_step == 0`, meaning it is a multiple of `log_step`. If this is the case, go to 3.
- * 3. Trigger a perf buffer output in the console, using the `page_fault_event_out`struct defined below.
+ * 3. Trigger a ring buffer output in the console, using the `page_fault_event_out`struct defined below.
  */
 
 /* EDIT:
@@ -31,58 +31,227 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 const volatile int log_step = 50;
 
+// Per-CPU aggregation: every CPU counts the faults of a pid on its own and
+// folds them into the shared totals (where `log_step` is checked) once it
+// has `flush_step` of them, so most faults touch no shared cache line.
+// A multiple of log_step is thus reported up to flush_step faults per CPU
+// late; flush_step = 1 updates the totals on every fault (exact).
+const volatile int flush_step = 16;
+
+// Fault latency: time from handle_mm_fault() entry to return, as log2
+// histograms per pid (or per cgroup) in `hists`, which userspace samples
+// at intervals. Calibrate with `page_fault_gen N`: ~N faults for its pid,
+// almost all minor (a few us).
+const volatile bool latency_hist = true;
+const volatile bool hist_per_cgroup = false;
+
+// Userspace is woken up once `wakeup_batch` events wait in the ring
+// buffer, or `wakeup_interval_ms` after the first of them (see
+// ringbuf_wakeup.h)
+const volatile int wakeup_batch = 32;
+const volatile int wakeup_interval_ms = 100;
+
+// # of events lost because the ring buffer was full
+__u64 dropped_events = 0;
+
 
 // ****************************************
 // Data structures
 // ****************************************
 
+// Kernel constants (not in vmlinux.h as they are #defines)
+#define FAULT_FLAG_WRITE 0x01  // @ include/linux/mm_types.h (enum fault_flag)
+#define VM_GROWSDOWN     0x100 // @ include/linux/mm.h: stack vma
+#define VM_FAULT_MAJOR   0x004 // @ include/linux/mm_types.h (enum vm_fault_reason)
+
+// Fault counts of a pid
+struct fault_counts {
+    unsigned int pg_fault_count;    // all faults
+    unsigned int major_count;       // that needed I/O
+    unsigned int write_count;       // on a write access
+    unsigned int anon_count;        // in anonymous memory
+    unsigned int file_count;        // in a file mapping
+    unsigned int stack_count;       // in the stack
+};
+
 // Tuple to act as the values of the HASH map used to track fault counts for each pid
+// (totals: what every CPU has folded in so far)
 struct fault_tracking {
-    unsigned int pg_fault_count;     // Curr fault count
+    struct fault_counts counts;
     char comm[TASK_COMM_LEN];      // Process name
 };
 
-// The hash map to track the fault_count of a pid
-// map[pid]=(pg_fault_count, process name)
+// The hash map to track the fault totals of a pid
+// map[pid]=(fault counts, process name)
+// LRU: when full, the least recently flushed pids make room for new ones
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1024);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
     __type(key, __u32); // PID as keys
     __type(value, struct fault_tracking);   // custom `fault_tracking`struct as values
-   } mapping SEC(".maps");
+} mapping SEC(".maps");
+
+// Faults counted by each CPU and not folded into `mapping` yet
+// (userspace can also read exact counts by summing both maps)
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, __u32);
+    __type(value, struct fault_counts);
+} deltas SEC(".maps");
+
+// Fault latency histogram: slot i counts the faults handled in
+// [2^i, 2^(i+1)) ns, the last slot everything slower
+#define MAX_SLOTS 32
+
+struct hist {
+    __u32 slots[MAX_SLOTS];
+    char comm[TASK_COMM_LEN];   // process name (1st process seen, when keyed by cgroup)
+};
+
+// Entry timestamp of the fault each thread is handling
+// (by thread: the fault may sleep and resume on another CPU)
+// LRU: entries left behind by a missed kretprobe or a thread that died in
+// between make room for new faults instead of filling the map
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, __u64); // pid_tgid
+    __type(value, __u64);
+} fault_start SEC(".maps");
+
+// Latency histograms: map[pid or cgroup id]=(log2 ns slots, process name)
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, __u64);
+    __type(value, struct hist);
+} hists SEC(".maps");
 
-// The perf buffer to send notifs to userspace
+// The ring buffer to send notifs to userspace
+// (shared by all CPUs: events are written in place and arrive in order)
 struct {
-    __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-    __uint(key_size, sizeof(__u32));
-    __uint(value_size, sizeof(__u32));
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 256 * 1024); // bytes, a power of 2 multiple of the page size
 } events SEC(".maps");
 
+#define RINGBUF_WAKEUP_MAP events
+#include "../../common/ringbuf_wakeup.h"
+
 
 // ****************************************
 // Custom helpers
 // ****************************************
 
-int buffer_out(void *ctx, int pid)
+static __always_inline int buffer_out(void *ctx, int pid, struct fault_tracking *ft, unsigned int count)
 {
-    // retrieve data associated to given pid
-    struct fault_tracking *ft = bpf_map_lookup_elem(&mapping, &pid);
-    if (ft)
+    // reserve the out object (following `page_fault_event_out` structure) right in the ring buffer
+    struct page_fault_event_out *out_this = bpf_ringbuf_reserve(&events, sizeof(*out_this), 0);
+    if (!out_this)
     {
-        // create the out object following `page_fault_event_out` structure
-        struct page_fault_event_out out_this = {0};
-        out_this.pid = pid;
-        out_this.page_fault_count = ft->pg_fault_count;
+        // buffer full: userspace is lagging behind
+        __sync_fetch_and_add(&dropped_events, 1);
+        return -1;
+    }
+    out_this->pid = pid;
+    out_this->page_fault_count = count;
+    out_this->major_faults = ft->counts.major_count;
+    out_this->minor_faults = ft->counts.pg_fault_count - ft->counts.major_count;
+    out_this->write_faults = ft->counts.write_count;
+    out_this->anon_faults = ft->counts.anon_count;
+    out_this->file_faults = ft->counts.file_count;
+    out_this->stack_faults = ft->counts.stack_count;
 
-        bpf_probe_read_str(&out_this.comm, sizeof(out_this.comm), ft->comm);
+    // (whole array: reserved memory is not zeroed, `comm` is 0-padded in the map)
+    __builtin_memcpy(out_this->comm, ft->comm, sizeof(out_this->comm));
 
-        // output this
-        bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &out_this, sizeof(out_this));
-        return 0;
+    // output this
+    ringbuf_submit_batched(out_this, sizeof(*out_this));
+    return 0;
+}
+
+// floor(log2(v)), for the histogram slots
+static __always_inline __u32 log2_u64(__u64 v)
+{
+    __u32 r = 0;
+    if (v >> 32) { v >>= 32; r += 32; }
+    if (v >> 16) { v >>= 16; r += 16; }
+    if (v >> 8)  { v >>= 8;  r += 8; }
+    if (v >> 4)  { v >>= 4;  r += 4; }
+    if (v >> 2)  { v >>= 2;  r += 2; }
+    if (v >> 1)  { r += 1; }
+    return r;
+}
+
+// add one fault that took `ns` to the histogram of the current pid/cgroup
+static __always_inline void record_latency(__u32 pid, __u64 ns)
+{
+    __u64 key = hist_per_cgroup ? bpf_get_current_cgroup_id() : pid;
+    struct hist *h = bpf_map_lookup_elem(&hists, &key);
+    if (h == NULL) {
+        struct hist new_h = {0};
+        bpf_get_current_comm(&new_h.comm, sizeof(new_h.comm));
+        bpf_map_update_elem(&hists, &key, &new_h, BPF_NOEXIST);
+        h = bpf_map_lookup_elem(&hists, &key);
+        if (h == NULL)
+            return;
+    }
+
+    __u32 slot = ns ? log2_u64(ns) : 0;
+    if (slot >= MAX_SLOTS)
+        slot = MAX_SLOTS - 1;
+    __sync_fetch_and_add(&h->slots[slot], 1);
+}
+
+// get this CPU's counts for pid (created on its 1st fault)
+static __always_inline struct fault_counts *get_delta(__u32 pid)
+{
+    struct fault_counts *delta = bpf_map_lookup_elem(&deltas, &pid);
+    if (delta == NULL) {
+        struct fault_counts zero = {0};
+        bpf_map_update_elem(&deltas, &pid, &zero, BPF_NOEXIST);
+        delta = bpf_map_lookup_elem(&deltas, &pid);
     }
+    return delta;
+}
 
-    // failure
-    return -1;
+// fold this CPU's counts into the totals of pid, then report the multiple
+// of log_step they went past (if any)
+static __always_inline void flush_delta(void *ctx, __u32 pid, struct fault_counts *delta)
+{
+    struct fault_tracking *ft = bpf_map_lookup_elem(&mapping, &pid);
+    if (ft == NULL) {
+        // entry does not exist yet in the mapping, so:
+        // 1. init new `fault_tracking` tuple for the pid, with the process name
+        struct fault_tracking new_ft = {0};
+        bpf_get_current_comm(&new_ft.comm, sizeof(new_ft.comm));
+
+        // 2. add it (unless another CPU just did)
+        bpf_map_update_elem(&mapping, &pid, &new_ft, BPF_NOEXIST);
+        ft = bpf_map_lookup_elem(&mapping, &pid);
+        if (ft == NULL)
+            return;
+    }
+
+    // atomic adds: other CPUs may be flushing the same pid
+    unsigned int added = delta->pg_fault_count;
+    __sync_fetch_and_add(&ft->counts.pg_fault_count, added);
+    __sync_fetch_and_add(&ft->counts.major_count, delta->major_count);
+    __sync_fetch_and_add(&ft->counts.write_count, delta->write_count);
+    __sync_fetch_and_add(&ft->counts.anon_count, delta->anon_count);
+    __sync_fetch_and_add(&ft->counts.file_count, delta->file_count);
+    __sync_fetch_and_add(&ft->counts.stack_count, delta->stack_count);
+    __builtin_memset(delta, 0, sizeof(*delta));
+
+    // check if the new total went past a multiple of log_step
+    // (read back after the add: 2 CPUs flushing at once may both see the
+    // other's faults, at worst a multiple is reported twice)
+    unsigned int step = log_step > 0 ? log_step : 1;
+    unsigned int total = ft->counts.pg_fault_count;
+    if (added > 0 && total / step != (total - added) / step)
+    {
+        buffer_out(ctx, pid, ft, total - total % step);
+    }
 }
 
 
@@ -91,45 +260,69 @@ int buffer_out(void *ctx, int pid)
 // ****************************************
 
 // @ https://github.com/torvalds/linux/blob/v6.8/mm/memory.c#L5438
-SEC("kprobe/handle_mm_fault")
-int BPF_KPROBE(handle_mm_fault, struct vm_area_struct *vma, unsigned long address,
-               unsigned int flags, struct pt_regs *regs)
+// (fentry/fexit rather than kprobes: the verifier refuses bpf_timer, used by
+// ringbuf_wakeup.h, in kprobe and tracepoint programs)
+SEC("fentry/handle_mm_fault")
+int BPF_PROG(handle_mm_fault, struct vm_area_struct *vma, unsigned long address,
+             unsigned int flags, struct pt_regs *regs)
 {
     // get current pid (shifted by 32 bits to exlude tgid)
-    pid_t pid;
-    pid = bpf_get_current_pid_tgid() >> 32;
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    __u32 pid;
+    pid = pid_tgid >> 32;
 
-    // find in `mapping` if pid entry already exists, else add it
-    struct fault_tracking *ft = bpf_map_lookup_elem(&mapping, &pid);
-    if (ft == NULL) {
-        // entry does not exist yet in the mapping, so:
-        // 1. init new `fault_tracking` tuple for the pid
-        struct fault_tracking new_ft = {0};
-        new_ft.pg_fault_count = 1;
+    // start timing the fault (see handle_mm_fault_exit)
+    if (latency_hist) {
+        __u64 now = bpf_ktime_get_ns();
+        bpf_map_update_elem(&fault_start, &pid_tgid, &now, BPF_ANY);
+    }
 
-        // 2. get process name and add it to the `fault_tracking` tuple
-        char comm[TASK_COMM_LEN];
-        bpf_get_current_comm(&comm, sizeof(comm));
-        bpf_probe_read_str(&new_ft.comm, sizeof(new_ft.comm), comm);
+    // count the fault on this CPU (no other CPU touches this entry)
+    struct fault_counts *delta = get_delta(pid);
+    if (delta == NULL)
+        return 0;
+    delta->pg_fault_count++;
 
-        // 3. update the mapping with the new entry
-        bpf_map_update_elem(&mapping, &pid, &new_ft, BPF_ANY);
+    // classify it from the access flags and the vma
+    if (flags & FAULT_FLAG_WRITE)
+        delta->write_count++;
+    if (BPF_CORE_READ(vma, vm_file) != NULL)
+        delta->file_count++;
+    else
+        delta->anon_count++;
+    if (BPF_CORE_READ(vma, vm_flags) & VM_GROWSDOWN)
+        delta->stack_count++;
 
-        // then we check if log_step == 1 because if it is, we already need to log in the console
-        if (log_step == 1)
-        {
-            buffer_out(ctx, pid);
-        }
-    } else {
-        // entry already exists -> increment fault count
-        ft->pg_fault_count++;
-
-        // check if new pg_fault_count is a multiple of log_step
-        if (ft->pg_fault_count % log_step == 0)
-        {
-            buffer_out(ctx, pid);
+    // enough of them: make them visible in the totals
+    if (delta->pg_fault_count >= flush_step)
+        flush_delta(ctx, pid, delta);
+
+    return 0;
+}
+
+// Fault handled: its latency, and whether it was major (VM_FAULT_MAJOR in
+// the result, only known now)
+SEC("fexit/handle_mm_fault")
+int BPF_PROG(handle_mm_fault_exit, struct vm_area_struct *vma, unsigned long address,
+             unsigned int flags, struct pt_regs *regs, unsigned int ret)
+{
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    __u32 pid = pid_tgid >> 32;
+
+    if (latency_hist) {
+        __u64 *start = bpf_map_lookup_elem(&fault_start, &pid_tgid);
+        if (start != NULL) {
+            __u64 ns = bpf_ktime_get_ns() - *start;
+            bpf_map_delete_elem(&fault_start, &pid_tgid);
+            record_latency(pid, ns);
         }
     }
-    
+
+    if (!(ret & VM_FAULT_MAJOR))
+        return 0;
+
+    struct fault_counts *delta = bpf_map_lookup_elem(&deltas, &pid);
+    if (delta != NULL)
+        delta->major_count++;
     return 0;
 }
@@ -4,11 +4,17 @@
 #define TASK_COMM_LEN 20
 
 
-// Struct sent to the perf buffer for printing
+// Struct sent to the ring buffer for printing
 struct page_fault_event_out {
     pid_t pid;
     char comm[TASK_COMM_LEN];
-    int page_fault_count;
+    int page_fault_count;   // multiple of log_step reached
+    int major_faults;       // breakdown of the faults so far
+    int minor_faults;
+    int write_faults;
+    int anon_faults;
+    int file_faults;
+    int stack_faults;
 };
 
 
@@ -1,26 +1,42 @@
 // SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
 #include <vmlinux.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
 #include "perf_example.h"
 
+// Userspace is woken up once `wakeup_batch` events wait in the ring
+// buffer, or `wakeup_interval_ms` after the first of them (see
+// ringbuf_wakeup.h)
+const volatile int wakeup_batch = 16;
+const volatile int wakeup_interval_ms = 100;
+
+__u64 dropped_events = 0; // ring buffer full
+
+// Ring buffer shared by all CPUs (events written in place, delivered in order)
 struct {
-    __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-    __uint(key_size, sizeof(u32));
-    __uint(value_size, sizeof(u32));
-} perf_map SEC(".maps");
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 64 * 1024);
+} events SEC(".maps");
+
+#define RINGBUF_WAKEUP_MAP events
+#include "../../common/ringbuf_wakeup.h"
 
-SEC("tracepoint/syscalls/sys_enter_execve")
-int tracepoint_syscalls_sys_enter_execve(struct trace_event_raw_sys_enter* ctx)
+// A new program runs (tp_btf rather than a tracepoint: the verifier refuses
+// bpf_timer, used by ringbuf_wakeup.h, in tracepoint programs)
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(sched_process_exec, struct task_struct *p, pid_t old_pid, struct linux_binprm *bprm)
 {
-    pid_t pid;
-    struct struct_to_give_to_perf struct_perf = {0};
+    struct struct_to_give_to_perf *struct_perf = bpf_ringbuf_reserve(&events, sizeof(*struct_perf), 0);
+    if (!struct_perf) {
+        __sync_fetch_and_add(&dropped_events, 1);
+        return 0;
+    }
 
-    struct_perf.pid = bpf_get_current_pid_tgid() >> 32;
-    char *message = "New process created";
+    struct_perf->pid = bpf_get_current_pid_tgid() >> 32;
+    __builtin_memcpy(struct_perf->message, "New process created", sizeof(struct_perf->message));
 
-    bpf_probe_read_str(&struct_perf.message, sizeof(struct_perf.message), message);
-    bpf_perf_event_output(ctx, &perf_map, BPF_F_CURRENT_CPU, &struct_perf, sizeof(struct_perf));
+    ringbuf_submit_batched(struct_perf, sizeof(*struct_perf));
     return 0;
 }
 
@@ -12,27 +12,118 @@
 #define EPERM 1
 #endif
 
+#define MAX_RULES 4096 // per kind of rule
+
+// Rule actions
+#define RULE_DENY  0
+#define RULE_ALLOW 1 // exception to a less specific deny rule
+
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
+// Install the deny rule for "malicious" (the challenge) when loaded
+const volatile bool default_rule = true;
+
+// Policy rules, updatable from userspace while loaded, e.g.
+//   bpftool map update name comm_rules key <16 bytes of the name> value <24 zero bytes>
+// A file open is matched against the rule on its file (inode_rules), on the
+// cgroup of the process (cgroup_rules) and on its name (comm_rules), in that
+// order: the first rule found decides and counts the open. Each check is a
+// single map lookup, whatever the # of rules.
+struct rule {
+    __u32 action;  // RULE_DENY or RULE_ALLOW
+    __u32 pad;
+    __u64 denied;  // opens denied/allowed by this rule (reset when it is updated)
+    __u64 allowed;
+};
+
+// Key of comm_rules: process name, zero padded
+struct comm_key {
+    char comm[TASK_COMM_LEN];
+};
+
+// Key of inode_rules: file (device in the kernel encoding: major << 20 | minor)
+struct inode_key {
+    __u64 ino;
+    __u32 dev;
+    __u32 pad;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_RULES);
+    __type(key, struct inode_key);
+    __type(value, struct rule);
+} inode_rules SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_RULES);
+    __type(key, __u64); // cgroup id (inode # of the cgroup directory)
+    __type(value, struct rule);
+} cgroup_rules SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_RULES);
+    __type(key, struct comm_key);
+    __type(value, struct rule);
+} comm_rules SEC(".maps");
+
+bool installed = false;
+
+// Helper function to install the default rule, once
+static void install_default_rule(void)
+{
+    struct comm_key key = { .comm = "malicious" };
+    struct rule deny = { .action = RULE_DENY };
+
+    installed = true;
+    bpf_map_update_elem(&comm_rules, &key, &deny, BPF_NOEXIST);
+}
+
+// Helper function to apply a rule: count the open & return the verdict
+static int apply_rule(struct rule *rule)
+{
+    if (rule->action == RULE_ALLOW) {
+        __sync_fetch_and_add(&rule->allowed, 1);
+        return 0;
+    }
+    __sync_fetch_and_add(&rule->denied, 1);
+    return -EPERM; // Op not permitted
+}
+
 SEC("lsm/file_open")
 int BPF_PROG(lsm_file_open, struct file *file)
 {
-    // get curr process name to see if 'malicious'
-    char comm[TASK_COMM_LEN];
+    struct inode_key ino_key = {};
+    struct comm_key comm_key = {};
+    __u64 cgroup_id;
+    struct rule *rule;
 
-    // @ https://github.com/torvalds/linux/blob/v6.8/include/uapi/linux/bpf.h#L2012
-    int ret = bpf_get_current_comm(comm, TASK_COMM_LEN);
+    if (default_rule && !installed)
+        install_default_rule();
 
-    // check if bpf_get_current_comm failed
-    if (ret < 0) {
-        return 0;   // hesitation to return the -EPERM as additional safeguard but might block certain legit fopen calls
-    }
+    // rule on the file opened
+    ino_key.ino = BPF_CORE_READ(file, f_inode, i_ino);
+    ino_key.dev = BPF_CORE_READ(file, f_inode, i_sb, s_dev);
+    rule = bpf_map_lookup_elem(&inode_rules, &ino_key);
+    if (rule)
+        return apply_rule(rule);
 
-    // it didn't fail so now, compare with 'malicious' str
-    // @ https://github.com/torvalds/linux/blob/v6.8/include/uapi/linux/bpf.h#L5273
-    if (bpf_strncmp(comm, sizeof(comm), "malicious") == 0) {
-        return -EPERM; // Op not permitted
+    // rule on the cgroup of the process
+    cgroup_id = bpf_get_current_cgroup_id();
+    rule = bpf_map_lookup_elem(&cgroup_rules, &cgroup_id);
+    if (rule)
+        return apply_rule(rule);
+
+    // rule on the process name
+    // @ https://github.com/torvalds/linux/blob/v6.8/include/uapi/linux/bpf.h#L2012
+    if (bpf_get_current_comm(comm_key.comm, TASK_COMM_LEN) < 0) {
+        return 0;   // hesitation to return the -EPERM as additional safeguard but might block certain legit fopen calls
     }
+    rule = bpf_map_lookup_elem(&comm_rules, &comm_key);
+    if (rule)
+        return apply_rule(rule);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,825 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "include/fs.h"
+#include "include/vdisk.h"
+#include "include/error.h"
+
+/*
+ * fs_bench: microbenchmarks and trace replay for the file system
+ *
+ * Usage: fs_bench [options]
+ *   -i <image>     disk image to use (created/overwritten, default bench_disk.img)
+ *   -m <MB>        image size in MB (default 64); format/mount are also timed
+ *                  on the smaller powers of 2 down to 1 MB
+ *   -n <files>     files for the create/delete test (default 1000)
+ *   -f <MB>        file size for the throughput tests (default 16)
+ *   -o <ops>       max ops per random read/write test (default 20000)
+ *   -S <seed>      seed of the random offsets (default 1)
+ *   -c <blocks>    cache capacity in blocks (0 disables caching)
+ *   -a <blocks>    readahead window in blocks (0 disables)
+ *   -A <blocks>    append buffer in blocks (0 disables)
+ *   -M / -D        mmap / O_DIRECT backend
+ *   -B <bytes>     block size, -I <bytes> inode size
+ *   -e             extents, -j <blocks> journal size
+ *   -t <trace>     replay a trace instead of running the suite
+ *   -R <trace>     record every operation run into a trace (to replay later)
+ *
+ * Trace format: one operation per line, `#` starts a comment
+ *   create <file>                 <file> is a trace-local id (0, 1, ...)
+ *   delete <file>
+ *   write <file> <offset> <len>
+ *   read <file> <offset> <len>
+ *   sync
+ * Comparing 2 builds/configs = running the same trace (or suite) on both.
+ */
+
+#define BENCH_MAX_SIZES 8
+
+// Latency samples & totals of one kind of operation
+typedef struct
+{
+    const char *name;
+    uint64_t *samples; // ns per op
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t total_ns;
+} op_stats_t;
+
+// Benchmark configuration (see usage above)
+typedef struct
+{
+    const char *image;
+    uint32_t image_mb;
+    uint32_t files;
+    uint32_t file_mb;
+    uint32_t max_ops;
+    uint32_t seed;
+    const char *trace;
+    const char *record;
+    fs_options_t mount_opts;
+    fs_format_options_t format_opts;
+} bench_config_t;
+
+static FILE *record_file = NULL;
+static uint64_t rng_state = 1;
+
+// Helper function to get a monotonic timestamp in ns
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Helper function to draw a random number (xorshift, reproducible w/ -S)
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/****************************************************************/
+/* Statistics                                                   */
+/****************************************************************/
+
+static void stats_init(op_stats_t *stats, const char *name)
+{
+    memset(stats, 0, sizeof(op_stats_t));
+    stats->name = name;
+}
+
+static void stats_free(op_stats_t *stats)
+{
+    free(stats->samples);
+    stats->samples = NULL;
+}
+
+static void stats_add(op_stats_t *stats, uint64_t ns, int result)
+{
+    if (stats->count == stats->capacity)
+    {
+        size_t capacity = (stats->capacity == 0) ? 1024 : stats->capacity * 2;
+        uint64_t *samples = (uint64_t *)realloc(stats->samples, capacity * sizeof(uint64_t));
+        if (samples == NULL)
+        {
+            return; // keep what we have
+        }
+        stats->samples = samples;
+        stats->capacity = capacity;
+    }
+    stats->samples[stats->count++] = ns;
+    stats->total_ns += ns;
+    if (result < 0)
+    {
+        stats->errors++;
+    }
+    else
+    {
+        stats->bytes += (uint64_t)result;
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper function to get the p-th percentile of the samples (sorted)
+static double percentile_us(const op_stats_t *stats, double p)
+{
+    if (stats->count == 0)
+    {
+        return 0.0;
+    }
+    size_t index = (size_t)(p / 100.0 * (stats->count - 1) + 0.5);
+    return stats->samples[index] / 1000.0;
+}
+
+static void print_stats_header(void)
+{
+    printf("%-22s %8s %11s %9s %9s %9s %9s %9s %6s\n",
+           "operation", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us", "errors");
+}
+
+// `elapsed_ns` is the wall time of the whole test (it may include a final
+// sync), 0 to use the sum of the op latencies
+static void print_stats(op_stats_t *stats, uint64_t elapsed_ns)
+{
+    if (stats->count == 0)
+    {
+        return;
+    }
+    qsort(stats->samples, stats->count, sizeof(uint64_t), compare_u64);
+    double seconds = (elapsed_ns ? elapsed_ns : stats->total_ns) / 1e9;
+    printf("%-22s %8zu %11.0f %9.2f %9.1f %9.1f %9.1f %9.1f %6llu\n",
+           stats->name, stats->count, seconds > 0 ? stats->count / seconds : 0.0,
+           seconds > 0 ? stats->bytes / seconds / (1024.0 * 1024.0) : 0.0,
+           percentile_us(stats, 50), percentile_us(stats, 90), percentile_us(stats, 99),
+           stats->samples[stats->count - 1] / 1000.0, (unsigned long long)stats->errors);
+}
+
+/****************************************************************/
+/* Timed operations (recorded with -R)                          */
+/****************************************************************/
+
+static int timed_create(FS *fs, op_stats_t *stats, int file_id)
+{
+    uint64_t start = now_ns();
+    int inode_num = fs_create(fs);
+    stats_add(stats, now_ns() - start, inode_num < 0 ? inode_num : 0);
+    if (record_file != NULL)
+    {
+        fprintf(record_file, "create %d\n", file_id);
+    }
+    return inode_num;
+}
+
+static int timed_delete(FS *fs, op_stats_t *stats, int file_id, int inode_num)
+{
+    uint64_t start = now_ns();
+    int result = fs_delete(fs, inode_num);
+    stats_add(stats, now_ns() - start, result);
+    if (record_file != NULL)
+    {
+        fprintf(record_file, "delete %d\n", file_id);
+    }
+    return result;
+}
+
+static int timed_io(FS *fs, op_stats_t *stats, bool is_write, int file_id, int inode_num,
+                    uint8_t *data, int len, int64_t offset)
+{
+    uint64_t start = now_ns();
+    int result = is_write ? fs_write(fs, inode_num, data, len, offset) : fs_read(fs, inode_num, data, len, offset);
+    stats_add(stats, now_ns() - start, result);
+    if (record_file != NULL)
+    {
+        fprintf(record_file, "%s %d %lld %d\n", is_write ? "write" : "read", file_id, (long long)offset, len);
+    }
+    return result;
+}
+
+static int timed_sync(FS *fs, op_stats_t *stats)
+{
+    uint64_t start = now_ns();
+    int result = fs_sync(fs);
+    if (stats != NULL)
+    {
+        stats_add(stats, now_ns() - start, result);
+    }
+    if (record_file != NULL)
+    {
+        fprintf(record_file, "sync\n");
+    }
+    return result;
+}
+
+/****************************************************************/
+/* Setup                                                        */
+/****************************************************************/
+
+// Helper function to create a zeroed (sparse) image of `mb` MB
+static int make_image(const char *path, uint32_t mb)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    int result = 0;
+    if (fseek(file, (long)mb * 1024 * 1024 - 1, SEEK_SET) != 0 || fputc(0, file) == EOF)
+    {
+        result = -1;
+    }
+    if (fclose(file) != 0)
+    {
+        result = -1;
+    }
+    return result;
+}
+
+// Helper function to get a freshly formatted & mounted image
+static int fresh_fs(const bench_config_t *config, uint32_t inodes, FS **fsp)
+{
+    if (make_image(config->image, config->image_mb) != 0)
+    {
+        fprintf(stderr, "cannot create %s\n", config->image);
+        return -1;
+    }
+    int result = fs_format((char *)config->image, inodes, &config->format_opts);
+    if (result != 0)
+    {
+        fprintf(stderr, "format failed with error code: %d\n", result);
+        return result;
+    }
+    result = fs_open((char *)config->image, &config->mount_opts, fsp);
+    if (result != 0)
+    {
+        fprintf(stderr, "mount failed with error code: %d\n", result);
+    }
+    return result;
+}
+
+static void fill_pattern(uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = (uint8_t)(i * 7 + (i >> 12));
+    }
+}
+
+/****************************************************************/
+/* Benchmarks                                                   */
+/****************************************************************/
+
+// Format & mount time against the image size
+static int bench_format_mount(const bench_config_t *config)
+{
+    printf("\n===== FORMAT / MOUNT =====\n");
+    printf("%-10s %12s %12s %12s\n", "image MB", "format ms", "mount ms", "unmount ms");
+
+    uint32_t sizes[BENCH_MAX_SIZES];
+    int num_sizes = 0;
+    for (uint32_t mb = config->image_mb; mb >= 1 && num_sizes < BENCH_MAX_SIZES; mb /= 2)
+    {
+        sizes[num_sizes++] = mb;
+    }
+
+    for (int i = num_sizes - 1; i >= 0; i--)
+    {
+        if (make_image(config->image, sizes[i]) != 0)
+        {
+            fprintf(stderr, "cannot create %s\n", config->image);
+            return -1;
+        }
+        uint32_t inodes = sizes[i] * 32; // ~1 inode per 32 KB
+        uint64_t start = now_ns();
+        int result = fs_format((char *)config->image, inodes, &config->format_opts);
+        uint64_t formatted = now_ns();
+        if (result != 0)
+        {
+            printf("%-10u format failed with error code: %d\n", sizes[i], result);
+            continue;
+        }
+
+        FS *fs;
+        result = fs_open((char *)config->image, &config->mount_opts, &fs);
+        uint64_t mounted = now_ns();
+        if (result != 0)
+        {
+            printf("%-10u mount failed with error code: %d\n", sizes[i], result);
+            continue;
+        }
+        fs_close(fs);
+        uint64_t unmounted = now_ns();
+
+        printf("%-10u %12.3f %12.3f %12.3f\n", sizes[i], (formatted - start) / 1e6,
+               (mounted - formatted) / 1e6, (unmounted - mounted) / 1e6);
+    }
+    return 0;
+}
+
+// Create & delete rate (empty files, then files of 1 block)
+static int bench_create_delete(const bench_config_t *config)
+{
+    printf("\n===== CREATE / DELETE (%u files) =====\n", config->files);
+    FS *fs;
+    if (fresh_fs(config, config->files, &fs) != 0)
+    {
+        return -1;
+    }
+
+    int *inodes = (int *)malloc(config->files * sizeof(int));
+    uint8_t *block = (uint8_t *)malloc(config->format_opts.block_size);
+    if (inodes == NULL || block == NULL)
+    {
+        free(inodes);
+        free(block);
+        fs_close(fs);
+        return -1;
+    }
+    fill_pattern(block, config->format_opts.block_size);
+
+    op_stats_t create_stats, write_stats, delete_stats;
+    print_stats_header();
+    for (int round = 0; round < 2; round++)
+    {
+        bool with_data = (round == 1);
+        stats_init(&create_stats, with_data ? "create" : "create (empty)");
+        stats_init(&write_stats, "write 1 block");
+        stats_init(&delete_stats, with_data ? "delete" : "delete (empty)");
+
+        for (uint32_t i = 0; i < config->files; i++)
+        {
+            inodes[i] = timed_create(fs, &create_stats, i);
+            if (with_data && inodes[i] >= 0)
+            {
+                timed_io(fs, &write_stats, true, i, inodes[i], block, config->format_opts.block_size, 0);
+            }
+        }
+        timed_sync(fs, NULL);
+        for (uint32_t i = 0; i < config->files; i++)
+        {
+            if (inodes[i] >= 0)
+            {
+                timed_delete(fs, &delete_stats, i, inodes[i]);
+            }
+        }
+        timed_sync(fs, NULL);
+
+        print_stats(&create_stats, 0);
+        print_stats(&write_stats, 0);
+        print_stats(&delete_stats, 0);
+        stats_free(&create_stats);
+        stats_free(&write_stats);
+        stats_free(&delete_stats);
+    }
+
+    free(inodes);
+    free(block);
+    return fs_close(fs);
+}
+
+// Sequential & random read/write at one request size
+// -> reads are done after a remount, so they start from a cold cache
+static int bench_throughput(const bench_config_t *config, int request_size)
+{
+    int64_t file_size = (int64_t)config->file_mb * 1024 * 1024;
+    int64_t num_requests = file_size / request_size;
+    int64_t random_ops = (num_requests < config->max_ops) ? num_requests : config->max_ops;
+    uint8_t *buffer = (uint8_t *)malloc(request_size);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    fill_pattern(buffer, request_size);
+
+    FS *fs;
+    if (fresh_fs(config, 16, &fs) != 0)
+    {
+        free(buffer);
+        return -1;
+    }
+    op_stats_t setup_stats;
+    stats_init(&setup_stats, "setup");
+    int inode_num = timed_create(fs, &setup_stats, 0);
+    if (inode_num < 0)
+    {
+        stats_free(&setup_stats);
+        free(buffer);
+        fs_close(fs);
+        return inode_num;
+    }
+
+    char names[4][32];
+    snprintf(names[0], sizeof(names[0]), "seq write %d", request_size);
+    snprintf(names[1], sizeof(names[1]), "seq read %d", request_size);
+    snprintf(names[2], sizeof(names[2]), "rand write %d", request_size);
+    snprintf(names[3], sizeof(names[3]), "rand read %d", request_size);
+    op_stats_t stats[4];
+    uint64_t elapsed[4];
+    for (int i = 0; i < 4; i++)
+    {
+        stats_init(&stats[i], names[i]);
+    }
+
+    // 1. Sequential write (the final sync is part of it)
+    uint64_t start = now_ns();
+    for (int64_t i = 0; i < num_requests; i++)
+    {
+        if (timed_io(fs, &stats[0], true, 0, inode_num, buffer, request_size, i * request_size) < 0)
+        {
+            break;
+        }
+    }
+    timed_sync(fs, NULL);
+    elapsed[0] = now_ns() - start;
+
+    // 2. Sequential read from a cold cache
+    fs_close(fs);
+    if (fs_open((char *)config->image, &config->mount_opts, &fs) != 0)
+    {
+        stats_free(&setup_stats);
+        free(buffer);
+        return -1;
+    }
+    start = now_ns();
+    for (int64_t i = 0; i < num_requests; i++)
+    {
+        timed_io(fs, &stats[1], false, 0, inode_num, buffer, request_size, i * request_size);
+    }
+    elapsed[1] = now_ns() - start;
+
+    // 3. Random overwrites (aligned to the request size), then sync
+    start = now_ns();
+    for (int64_t i = 0; i < random_ops; i++)
+    {
+        int64_t offset = (int64_t)(next_random() % num_requests) * request_size;
+        timed_io(fs, &stats[2], true, 0, inode_num, buffer, request_size, offset);
+    }
+    timed_sync(fs, NULL);
+    elapsed[2] = now_ns() - start;
+
+    // 4. Random reads from a cold cache
+    fs_close(fs);
+    if (fs_open((char *)config->image, &config->mount_opts, &fs) != 0)
+    {
+        stats_free(&setup_stats);
+        free(buffer);
+        return -1;
+    }
+    start = now_ns();
+    for (int64_t i = 0; i < random_ops; i++)
+    {
+        int64_t offset = (int64_t)(next_random() % num_requests) * request_size;
+        timed_io(fs, &stats[3], false, 0, inode_num, buffer, request_size, offset);
+    }
+    elapsed[3] = now_ns() - start;
+
+    for (int i = 0; i < 4; i++)
+    {
+        print_stats(&stats[i], elapsed[i]);
+        stats_free(&stats[i]);
+    }
+
+    timed_delete(fs, &setup_stats, 0, inode_num);
+    stats_free(&setup_stats);
+    free(buffer);
+    return fs_close(fs);
+}
+
+static int run_suite(const bench_config_t *config)
+{
+    static const int request_sizes[] = {512, 4096, 65536, 1048576};
+
+    if (bench_format_mount(config) != 0)
+    {
+        return 1;
+    }
+    if (bench_create_delete(config) != 0)
+    {
+        return 1;
+    }
+
+    printf("\n===== THROUGHPUT (%u MB file) =====\n", config->file_mb);
+    print_stats_header();
+    for (size_t i = 0; i < sizeof(request_sizes) / sizeof(request_sizes[0]); i++)
+    {
+        if (bench_throughput(config, request_sizes[i]) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/****************************************************************/
+/* Trace replay                                                 */
+/****************************************************************/
+
+// Helper function to look up (/grow the table of) a trace file id
+static int *trace_file(int **files, int *num_files, int file_id)
+{
+    if (file_id < 0)
+    {
+        return NULL;
+    }
+    if (file_id >= *num_files)
+    {
+        int count = (file_id + 1 > *num_files * 2) ? file_id + 1 : *num_files * 2;
+        int *grown = (int *)realloc(*files, count * sizeof(int));
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        for (int i = *num_files; i < count; i++)
+        {
+            grown[i] = -1; // not created
+        }
+        *files = grown;
+        *num_files = count;
+    }
+    return &(*files)[file_id];
+}
+
+static int replay_trace(const bench_config_t *config)
+{
+    FILE *trace = fopen(config->trace, "r");
+    if (trace == NULL)
+    {
+        fprintf(stderr, "cannot open trace %s\n", config->trace);
+        return 1;
+    }
+
+    // 1. Count the files the trace creates, to size the inode table
+    char line[256];
+    uint32_t creates = 0;
+    while (fgets(line, sizeof(line), trace) != NULL)
+    {
+        creates += (strncmp(line, "create", 6) == 0);
+    }
+    rewind(trace);
+
+    FS *fs;
+    if (fresh_fs(config, creates > 16 ? creates : 16, &fs) != 0)
+    {
+        fclose(trace);
+        return 1;
+    }
+
+    op_stats_t stats[5];
+    stats_init(&stats[0], "create");
+    stats_init(&stats[1], "delete");
+    stats_init(&stats[2], "write");
+    stats_init(&stats[3], "read");
+    stats_init(&stats[4], "sync");
+
+    // 2. Replay it, line by line
+    int *files = NULL;
+    int num_files = 0;
+    uint8_t *buffer = NULL;
+    int buffer_size = 0;
+    int line_num = 0;
+    int bad_lines = 0;
+    uint64_t start = now_ns();
+    while (fgets(line, sizeof(line), trace) != NULL)
+    {
+        line_num++;
+        char op[16];
+        int file_id = -1;
+        long long offset = 0;
+        int len = 0;
+        int fields = sscanf(line, "%15s %d %lld %d", op, &file_id, &offset, &len);
+        if (fields <= 0 || op[0] == '#')
+        {
+            continue; // blank line/comment
+        }
+
+        if (strcmp(op, "sync") == 0)
+        {
+            timed_sync(fs, &stats[4]);
+            continue;
+        }
+        int *inode_num = (fields >= 2) ? trace_file(&files, &num_files, file_id) : NULL;
+        if (inode_num == NULL)
+        {
+            fprintf(stderr, "%s:%d: bad line: %s", config->trace, line_num, line);
+            bad_lines++;
+            continue;
+        }
+
+        if (strcmp(op, "create") == 0)
+        {
+            *inode_num = timed_create(fs, &stats[0], file_id);
+        }
+        else if (strcmp(op, "delete") == 0)
+        {
+            timed_delete(fs, &stats[1], file_id, *inode_num);
+            *inode_num = -1;
+        }
+        else if ((strcmp(op, "write") == 0 || strcmp(op, "read") == 0) && fields == 4 && len >= 0)
+        {
+            if (len > buffer_size)
+            {
+                uint8_t *grown = (uint8_t *)realloc(buffer, len);
+                if (grown == NULL)
+                {
+                    fprintf(stderr, "%s:%d: no memory for %d bytes\n", config->trace, line_num, len);
+                    bad_lines++;
+                    continue;
+                }
+                buffer = grown;
+                buffer_size = len;
+                fill_pattern(buffer, len);
+            }
+            bool is_write = (op[0] == 'w');
+            timed_io(fs, &stats[is_write ? 2 : 3], is_write, file_id, *inode_num, buffer, len, offset);
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: bad line: %s", config->trace, line_num, line);
+            bad_lines++;
+        }
+    }
+    uint64_t replay_ns = now_ns() - start;
+    int result = fs_close(fs);
+    uint64_t total_ns = now_ns() - start;
+
+    // 3. Report
+    printf("\n===== TRACE %s =====\n", config->trace);
+    print_stats_header();
+    for (int i = 0; i < 5; i++)
+    {
+        print_stats(&stats[i], 0);
+        stats_free(&stats[i]);
+    }
+    printf("replay: %.3f ms, with unmount: %.3f ms, bad lines: %d\n", replay_ns / 1e6, total_ns / 1e6, bad_lines);
+
+    free(files);
+    free(buffer);
+    fclose(trace);
+    return (result != 0 || bad_lines > 0) ? 1 : 0;
+}
+
+/****************************************************************/
+/* Command line                                                 */
+/****************************************************************/
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-i image] [-m MB] [-n files] [-f MB] [-o ops] [-S seed]\n"
+            "          [-c blocks] [-a blocks] [-A blocks] [-M | -D]\n"
+            "          [-B bytes] [-I bytes] [-e] [-j blocks] [-t trace] [-R trace]\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    bench_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.image = "bench_disk.img";
+    config.image_mb = 64;
+    config.files = 1000;
+    config.file_mb = 16;
+    config.max_ops = 20000;
+    config.seed = 1;
+    fs_default_options(&config.mount_opts);
+    fs_default_format_options(&config.format_opts);
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-M") == 0)
+        {
+            config.mount_opts.backend = VDISK_BACKEND_MMAP;
+            takes_value = false;
+        }
+        else if (strcmp(arg, "-D") == 0)
+        {
+            config.mount_opts.backend = VDISK_BACKEND_DIRECT;
+            takes_value = false;
+        }
+        else if (strcmp(arg, "-e") == 0)
+        {
+            config.format_opts.extents = true;
+            takes_value = false;
+        }
+        else if (value == NULL)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else if (strcmp(arg, "-i") == 0)
+        {
+            config.image = value;
+        }
+        else if (strcmp(arg, "-m") == 0)
+        {
+            config.image_mb = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-n") == 0)
+        {
+            config.files = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-f") == 0)
+        {
+            config.file_mb = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-o") == 0)
+        {
+            config.max_ops = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-S") == 0)
+        {
+            config.seed = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-c") == 0)
+        {
+            config.mount_opts.cache_blocks = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-a") == 0)
+        {
+            config.mount_opts.readahead_blocks = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-A") == 0)
+        {
+            config.mount_opts.append_blocks = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-B") == 0)
+        {
+            config.format_opts.block_size = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-I") == 0)
+        {
+            config.format_opts.inode_size = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-j") == 0)
+        {
+            config.format_opts.journal_blocks = (uint32_t)atoi(value);
+        }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            config.trace = value;
+        }
+        else if (strcmp(arg, "-R") == 0)
+        {
+            config.record = value;
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        if (takes_value)
+        {
+            i++;
+        }
+    }
+    if (config.image_mb == 0 || config.files == 0 || config.file_mb == 0 || config.file_mb >= config.image_mb)
+    {
+        fprintf(stderr, "the image (-m) must be larger than the test file (-f), both non-zero\n");
+        return 2;
+    }
+    rng_state = config.seed ? config.seed : 1;
+
+    if (config.record != NULL)
+    {
+        record_file = fopen(config.record, "w");
+        if (record_file == NULL)
+        {
+            fprintf(stderr, "cannot create trace %s\n", config.record);
+            return 1;
+        }
+        fprintf(record_file, "# recorded by fs_bench\n");
+    }
+
+    printf("File System Benchmark\n");
+    printf("=====================\n");
+    printf("image %s: %u MB, block %u B, inode %u B, %s, journal %u blocks\n",
+           config.image, config.image_mb, config.format_opts.block_size, config.format_opts.inode_size,
+           config.format_opts.extents ? "extents" : "block pointers", config.format_opts.journal_blocks);
+    printf("cache %u blocks, readahead %u, append buffer %u, backend %d\n",
+           config.mount_opts.cache_blocks, config.mount_opts.readahead_blocks,
+           config.mount_opts.append_blocks, config.mount_opts.backend);
+
+    int result = (config.trace != NULL) ? replay_trace(&config) : run_suite(&config);
+
+    if (record_file != NULL)
+    {
+        fclose(record_file);
+    }
+    return result;
+}
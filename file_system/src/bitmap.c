@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "include/bitmap.h"
+#include "include/error.h"
+
+#define BITS_PER_WORD 64
+#define ALL_ONES UINT64_MAX
+
+
+/*************************/
+/* Forward declarations  */
+/*************************/
+
+static void mark_summary(BITMAP *bm, uint32_t word);
+
+
+/*************************/
+/* Core functions        */
+/*************************/
+
+int bitmap_init(BITMAP *bm, uint32_t num_bits)
+{
+    memset(bm, 0, sizeof(BITMAP));
+    bm->num_bits = num_bits;
+    bm->num_free = num_bits;
+    bm->num_words = (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    bm->num_summary_words = (bm->num_words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    bm->words = (uint64_t *)calloc(bm->num_words ? bm->num_words : 1, sizeof(uint64_t));
+    bm->summary = (uint64_t *)calloc(bm->num_summary_words ? bm->num_summary_words : 1, sizeof(uint64_t));
+    if (bm->words == NULL || bm->summary == NULL)
+    {
+        bitmap_destroy(bm);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    // Bits past the end of the map are permanently "used"
+    uint32_t tail_bits = num_bits % BITS_PER_WORD;
+    if (tail_bits != 0)
+    {
+        bm->words[bm->num_words - 1] = ALL_ONES << tail_bits;
+    }
+    uint32_t tail_words = bm->num_words % BITS_PER_WORD;
+    if (tail_words != 0)
+    {
+        bm->summary[bm->num_summary_words - 1] = ALL_ONES << tail_words;
+    }
+
+    return 0;
+}
+
+void bitmap_destroy(BITMAP *bm)
+{
+    free(bm->words);
+    free(bm->summary);
+    memset(bm, 0, sizeof(BITMAP));
+}
+
+void bitmap_set(BITMAP *bm, uint32_t bit)
+{
+    if (bit >= bm->num_bits)
+    {
+        return;
+    }
+
+    uint32_t word = bit / BITS_PER_WORD;
+    uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+    if (bm->words[word] & mask)
+    {
+        return; // already used
+    }
+
+    bm->words[word] |= mask;
+    bm->num_free--;
+    mark_summary(bm, word);
+}
+
+void bitmap_clear(BITMAP *bm, uint32_t bit)
+{
+    if (bit >= bm->num_bits)
+    {
+        return;
+    }
+
+    uint32_t word = bit / BITS_PER_WORD;
+    uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+    if (!(bm->words[word] & mask))
+    {
+        return; // already free
+    }
+
+    bm->words[word] &= ~mask;
+    bm->num_free++;
+    mark_summary(bm, word);
+}
+
+// Rebuild the summary level and free count after `words` was filled in
+// directly (e.g. loaded from disk)
+void bitmap_refresh(BITMAP *bm)
+{
+    uint32_t tail_bits = bm->num_bits % BITS_PER_WORD;
+    if (tail_bits != 0)
+    {
+        bm->words[bm->num_words - 1] |= ALL_ONES << tail_bits;
+    }
+
+    uint64_t num_used = 0;
+    for (uint32_t i = 0; i < bm->num_words; i++)
+    {
+        num_used += __builtin_popcountll(bm->words[i]);
+        mark_summary(bm, i);
+    }
+    bm->num_free = (uint32_t)((uint64_t)bm->num_words * BITS_PER_WORD - num_used);
+}
+
+bool bitmap_test(const BITMAP *bm, uint32_t bit)
+{
+    if (bit >= bm->num_bits)
+    {
+        return true;
+    }
+    return (bm->words[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+// Next-fit search for a free bit, starting at the hint and wrapping around.
+// The bit is NOT marked as used. Returns -1 if the map is full.
+int64_t bitmap_find_free(BITMAP *bm)
+{
+    if (bm->num_free == 0)
+    {
+        return -1;
+    }
+
+    uint32_t hint = (bm->hint < bm->num_bits) ? bm->hint : 0;
+    uint32_t start_word = hint / BITS_PER_WORD;
+
+    // 1. Rest of the word the hint points into
+    uint64_t word = bm->words[start_word] | ((1ULL << (hint % BITS_PER_WORD)) - 1);
+    if (word != ALL_ONES)
+    {
+        uint32_t bit = start_word * BITS_PER_WORD + __builtin_ctzll(~word);
+        bm->hint = bit + 1;
+        return bit;
+    }
+
+    // 2. Summary level: first word that is not full after the start word
+    //    (one extra pass over the first summary word to cover the wrap-around)
+    uint32_t next_word = start_word + 1;
+    uint32_t summary_idx = 0;
+    uint64_t skip_mask = 0;
+    if (next_word < bm->num_words)
+    {
+        summary_idx = next_word / BITS_PER_WORD;
+        skip_mask = (1ULL << (next_word % BITS_PER_WORD)) - 1;
+    }
+
+    for (uint32_t i = 0; i <= bm->num_summary_words; i++)
+    {
+        uint64_t full = bm->summary[summary_idx] | skip_mask;
+        skip_mask = 0;
+        if (full != ALL_ONES)
+        {
+            uint32_t word_idx = summary_idx * BITS_PER_WORD + __builtin_ctzll(~full);
+            uint32_t bit = word_idx * BITS_PER_WORD + __builtin_ctzll(~bm->words[word_idx]);
+            bm->hint = bit + 1;
+            return bit;
+        }
+        summary_idx = (summary_idx + 1) % bm->num_summary_words;
+    }
+
+    return -1; // not reached while num_free is accurate
+}
+
+// Mark up to `max_len` free bits as used, starting at `start` and stopping at
+// the first used one. The next-fit search then resumes right after the run.
+// Returns the # of bits claimed (0 if `start` itself is used).
+uint32_t bitmap_claim_run(BITMAP *bm, uint32_t start, uint32_t max_len)
+{
+    uint32_t length = 0;
+    while (length < max_len && !bitmap_test(bm, start + length))
+    {
+        bitmap_set(bm, start + length);
+        length++;
+    }
+
+    if (length > 0)
+    {
+        bm->hint = start + length;
+    }
+    return length;
+}
+
+
+/*************************/
+/* Helper functions      */
+/*************************/
+
+// Keep the summary bit of `word` in line with its content
+static void mark_summary(BITMAP *bm, uint32_t word)
+{
+    uint64_t mask = 1ULL << (word % BITS_PER_WORD);
+    if (bm->words[word] == ALL_ONES)
+    {
+        bm->summary[word / BITS_PER_WORD] |= mask;
+    }
+    else
+    {
+        bm->summary[word / BITS_PER_WORD] &= ~mask;
+    }
+}
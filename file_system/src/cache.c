@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "include/cache.h"
+#include "include/vdisk.h"
+#include "include/error.h"
+
+
+/*************************/
+/* Forward declarations  */
+/*************************/
+
+static int32_t lookup(CACHE *cache, uint32_t sector);
+static void hash_insert(CACHE *cache, int32_t idx);
+static void hash_remove(CACHE *cache, int32_t idx);
+static void lru_unlink(CACHE *cache, int32_t idx);
+static void lru_push_front(CACHE *cache, int32_t idx);
+static void lru_push_back(CACHE *cache, int32_t idx);
+static int32_t get_slot(CACHE *cache);
+static int32_t fetch(CACHE *cache, uint32_t sector);
+static int check_sector(CACHE *cache, uint32_t sector);
+static int compare_runs(const void *a, const void *b);
+static int flush_locked(CACHE *cache);
+
+
+/*************************/
+/* Core functions        */
+/*************************/
+
+int cache_on(CACHE *cache, DISK *diskp, uint32_t capacity)
+{
+    memset(cache, 0, sizeof(CACHE));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->disk = diskp;
+    cache->block_size = diskp->sector_size;
+    cache->capacity = capacity;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+
+    // A capacity of 0 turns the cache into a plain pass-through
+    if (capacity == 0)
+    {
+        return 0;
+    }
+
+    // Hash table size: smallest power of 2 >= capacity
+    uint32_t num_buckets = 1;
+    while (num_buckets < capacity)
+    {
+        num_buckets <<= 1;
+    }
+    cache->bucket_mask = num_buckets - 1;
+
+    cache->entries = (cache_entry_t *)calloc(capacity, sizeof(cache_entry_t));
+    cache->data = (uint8_t *)vdisk_alloc_buffer((size_t)capacity * cache->block_size); // direct I/O ready
+    cache->buckets = (int32_t *)malloc(num_buckets * sizeof(int32_t));
+    if (cache->entries == NULL || cache->data == NULL || cache->buckets == NULL)
+    {
+        cache_off(cache);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    for (uint32_t i = 0; i < num_buckets; i++)
+    {
+        cache->buckets[i] = -1;
+    }
+
+    return 0;
+}
+
+int cache_read(CACHE *cache, uint32_t sector, uint8_t *buffer)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (cache->capacity == 0)
+    {
+        cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return vdisk_read(cache->disk, sector, buffer);
+    }
+
+    int32_t idx = fetch(cache, sector);
+    if (idx >= 0)
+    {
+        memcpy(buffer, cache->data + (size_t)idx * cache->block_size, cache->block_size);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return (idx < 0) ? idx : 0;
+}
+
+int cache_write(CACHE *cache, uint32_t sector, uint8_t *buffer)
+{
+    if (cache->capacity == 0)
+    {
+        return vdisk_write(cache->disk, sector, buffer);
+    }
+
+    // Writes are deferred, so catch bad sectors now rather than at write-back
+    int result = check_sector(cache, sector);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    int32_t idx = lookup(cache, sector);
+    if (idx >= 0)
+    {
+        cache->stats.hits++;
+        lru_unlink(cache, idx);
+    }
+    else
+    {
+        // Whole-block write: no need to read the old content
+        cache->stats.misses++;
+        idx = get_slot(cache);
+        if (idx < 0)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return idx;
+        }
+        cache->entries[idx].sector = sector;
+        cache->entries[idx].valid = true;
+        hash_insert(cache, idx);
+    }
+
+    memcpy(cache->data + (size_t)idx * cache->block_size, buffer, cache->block_size);
+    cache->entries[idx].dirty = true;
+    lru_push_front(cache, idx);
+
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+// Reads `count` contiguous blocks. Cached blocks are served from memory and
+// the gaps between them are read with one ranged call each. Blocks fetched
+// this way are NOT inserted so that big transfers don't flush the cache.
+// NB: the gaps are read without holding the lock (so that threads reading
+// different files don't wait on each other's I/O); the caller must make sure
+// nobody writes these blocks in the meantime (fs.c: inode locks)
+int cache_read_range(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    if (cache->capacity == 0)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.misses += count;
+        pthread_mutex_unlock(&cache->lock);
+        return vdisk_read_range(cache->disk, sector, count, buffer);
+    }
+
+    // 1. Copy out the cached blocks, note the runs of misses
+    vdisk_run_t stack_runs[CACHE_MAX_PREFETCH];
+    vdisk_run_t *runs = stack_runs;
+    if (count / 2 + 1 > CACHE_MAX_PREFETCH)
+    {
+        runs = (vdisk_run_t *)malloc((count / 2 + 1) * sizeof(vdisk_run_t));
+        if (runs == NULL)
+        {
+            return E_OUT_OF_SPACE; // see error.h
+        }
+    }
+
+    int num_runs = cache_read_hits(cache, sector, count, buffer, runs);
+
+    // 2. Read the runs of misses, one ranged call each
+    int result = vdisk_readv(cache->disk, runs, num_runs);
+
+    if (runs != stack_runs)
+    {
+        free(runs);
+    }
+    return result;
+}
+
+// Writes `count` contiguous blocks straight to the disk in a single call,
+// refreshing the copies of those that happen to be cached.
+// -> copies are refreshed first: a concurrent eviction then writes back the
+//    new content, never stale data over what we are about to write
+int cache_write_range(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    cache_update(cache, sector, count, buffer);
+    return vdisk_write_range(cache->disk, sector, count, buffer);
+}
+
+// Copies the cached blocks of a range into `buffer` and lists the runs that
+// are not cached in `misses` (room for count / 2 + 1 runs), without reading
+// them -> returns the # of runs, the caller moves them (see cache_read_range)
+int cache_read_hits(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer, vdisk_run_t *misses)
+{
+    if (cache->capacity == 0)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.misses += count;
+        pthread_mutex_unlock(&cache->lock);
+        misses[0].sector = sector;
+        misses[0].count = count;
+        misses[0].buffer = buffer;
+        return (count > 0) ? 1 : 0;
+    }
+
+    int num_runs = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int32_t idx = lookup(cache, sector + i);
+        if (idx >= 0)
+        {
+            cache->stats.hits++;
+            memcpy(buffer + (size_t)i * cache->block_size,
+                   cache->data + (size_t)idx * cache->block_size, cache->block_size);
+            continue;
+        }
+
+        cache->stats.misses++;
+        if (num_runs > 0 && misses[num_runs - 1].sector + misses[num_runs - 1].count == sector + i)
+        {
+            misses[num_runs - 1].count++; // extend the run of misses
+            continue;
+        }
+        misses[num_runs].sector = sector + i;
+        misses[num_runs].count = 1;
+        misses[num_runs].buffer = buffer + (size_t)i * cache->block_size;
+        num_runs++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return num_runs;
+}
+
+// Refreshes the cached copies of a range about to be written to the disk
+// behind the cache's back (dirty flags unchanged, nothing is written)
+void cache_update(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    if (cache->capacity == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int32_t idx = lookup(cache, sector + i);
+        if (idx >= 0)
+        {
+            memcpy(cache->data + (size_t)idx * cache->block_size,
+                   buffer + (size_t)i * cache->block_size, cache->block_size);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Zero-copy read access: pointer to the block's bytes, only valid until the
+// next cache call. Returns NULL when that's not possible (pass-through cache
+// over a non-mapped disk, or I/O error); callers then fall back to cache_read.
+// -> a mapped disk's pointers stay valid, so those are handed out even to
+//    threads; cache slots are not (another thread could recycle them)
+const uint8_t *cache_peek(CACHE *cache, uint32_t sector)
+{
+    if (cache->capacity == 0)
+    {
+        const uint8_t *ptr = vdisk_sector_ptr(cache->disk, sector);
+        if (ptr != NULL)
+        {
+            pthread_mutex_lock(&cache->lock);
+            cache->stats.hits++;
+            pthread_mutex_unlock(&cache->lock);
+        }
+        return ptr;
+    }
+    if (cache->shared)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int32_t idx = fetch(cache, sector);
+    pthread_mutex_unlock(&cache->lock);
+    if (idx < 0)
+    {
+        return NULL;
+    }
+
+    return cache->data + (size_t)idx * cache->block_size;
+}
+
+// Pulls `count` contiguous blocks into the cache ahead of use (readahead).
+// Blocks already cached are left alone, the missing ones are read with a
+// single scatter/gather call. No-op for a pass-through cache.
+int cache_prefetch(CACHE *cache, uint32_t sector, uint32_t count)
+{
+    // Never let a prefetch take over more than a quarter of the cache
+    uint32_t limit = cache->capacity / 4;
+    if (limit > CACHE_MAX_PREFETCH)
+    {
+        limit = CACHE_MAX_PREFETCH;
+    }
+    if (count > limit)
+    {
+        count = limit;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // 1. Grab a slot for every block that is not cached yet
+    //    (kept out of the hash table until their content is in)
+    pthread_mutex_lock(&cache->lock);
+    vdisk_run_t runs[CACHE_MAX_PREFETCH];
+    int32_t slots[CACHE_MAX_PREFETCH];
+    int num_missing = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (lookup(cache, sector + i) >= 0)
+        {
+            continue;
+        }
+
+        int32_t idx = get_slot(cache);
+        if (idx < 0)
+        {
+            break; // prefetch what we have so far
+        }
+        lru_push_front(cache, idx);
+
+        runs[num_missing].sector = sector + i;
+        runs[num_missing].count = 1;
+        runs[num_missing].buffer = cache->data + (size_t)idx * cache->block_size;
+        slots[num_missing] = idx;
+        num_missing++;
+    }
+
+    // 2. Read them in; contiguous runs share a single seek
+    int result = vdisk_readv(cache->disk, runs, num_missing);
+    for (int i = 0; i < num_missing; i++)
+    {
+        int32_t idx = slots[i];
+        if (result != 0)
+        {
+            // slot stays invalid -> first one to be reused
+            lru_unlink(cache, idx);
+            lru_push_back(cache, idx);
+            continue;
+        }
+
+        cache->entries[idx].sector = runs[i].sector;
+        cache->entries[idx].valid = true;
+        cache->entries[idx].dirty = false;
+        hash_insert(cache, idx);
+        cache->stats.prefetches++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+void cache_get_stats(CACHE *cache, cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_reset_stats(CACHE *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    memset(&cache->stats, 0, sizeof(cache_stats_t));
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Write every dirty block back to the disk (without syncing it)
+// -> blocks are written in sector order so that adjacent ones share a seek
+int cache_flush(CACHE *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    int result = flush_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+int cache_sync(CACHE *cache)
+{
+    int result = cache_flush(cache);
+    int sync_result = vdisk_sync(cache->disk);
+    return (result != 0) ? result : sync_result;
+}
+
+// NB: dirty blocks are dropped, call cache_sync() first to keep them
+void cache_off(CACHE *cache)
+{
+    free(cache->entries);
+    vdisk_free_buffer(cache->data);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->data = NULL;
+    cache->buckets = NULL;
+    cache->capacity = 0;
+    cache->used = 0;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
+/*************************/
+/* Helper functions      */
+/*************************/
+
+// cache_flush() body, with the lock held
+static int flush_locked(CACHE *cache)
+{
+    if (cache->used == 0)
+    {
+        return 0;
+    }
+
+    vdisk_run_t *runs = (vdisk_run_t *)malloc(cache->used * sizeof(vdisk_run_t));
+    if (runs == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    // 1. Turn the dirty entries into a scatter/gather list sorted by sector #
+    int num_dirty = 0;
+    for (uint32_t i = 0; i < cache->used; i++)
+    {
+        if (cache->entries[i].valid && cache->entries[i].dirty)
+        {
+            runs[num_dirty].sector = cache->entries[i].sector;
+            runs[num_dirty].count = 1;
+            runs[num_dirty].buffer = cache->data + (size_t)i * cache->block_size;
+            num_dirty++;
+        }
+    }
+    qsort(runs, num_dirty, sizeof(vdisk_run_t), compare_runs);
+
+    // 2. Write them back; on failure fall back to one at a time so that
+    //    we flush as much as we can and report the first error
+    int first_error = vdisk_writev(cache->disk, runs, num_dirty);
+    for (int i = 0; i < num_dirty; i++)
+    {
+        if (first_error != 0 && vdisk_write(cache->disk, runs[i].sector, runs[i].buffer) != 0)
+        {
+            continue;
+        }
+        uint32_t idx = (runs[i].buffer - cache->data) / cache->block_size;
+        cache->entries[idx].dirty = false;
+        cache->stats.writebacks++;
+    }
+
+    free(runs);
+    return first_error;
+}
+
+static inline uint32_t hash_sector(CACHE *cache, uint32_t sector)
+{
+    return (sector * 2654435761u) & cache->bucket_mask; // Knuth multiplicative hash
+}
+
+static int32_t lookup(CACHE *cache, uint32_t sector)
+{
+    int32_t idx = cache->buckets[hash_sector(cache, sector)];
+    while (idx >= 0)
+    {
+        if (cache->entries[idx].sector == sector)
+        {
+            return idx;
+        }
+        idx = cache->entries[idx].hash_next;
+    }
+    return -1;
+}
+
+static void hash_insert(CACHE *cache, int32_t idx)
+{
+    uint32_t bucket = hash_sector(cache, cache->entries[idx].sector);
+    cache->entries[idx].hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+}
+
+static void hash_remove(CACHE *cache, int32_t idx)
+{
+    int32_t *link = &cache->buckets[hash_sector(cache, cache->entries[idx].sector)];
+    while (*link >= 0)
+    {
+        if (*link == idx)
+        {
+            *link = cache->entries[idx].hash_next;
+            return;
+        }
+        link = &cache->entries[*link].hash_next;
+    }
+}
+
+static void lru_unlink(CACHE *cache, int32_t idx)
+{
+    cache_entry_t *entry = &cache->entries[idx];
+
+    if (entry->lru_prev >= 0)
+    {
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    }
+    else
+    {
+        cache->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next >= 0)
+    {
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = -1;
+    entry->lru_next = -1;
+}
+
+static void lru_push_front(CACHE *cache, int32_t idx)
+{
+    cache_entry_t *entry = &cache->entries[idx];
+    entry->lru_prev = -1;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head >= 0)
+    {
+        cache->entries[cache->lru_head].lru_prev = idx;
+    }
+    cache->lru_head = idx;
+    if (cache->lru_tail < 0)
+    {
+        cache->lru_tail = idx;
+    }
+}
+
+static void lru_push_back(CACHE *cache, int32_t idx)
+{
+    cache_entry_t *entry = &cache->entries[idx];
+    entry->lru_next = -1;
+    entry->lru_prev = cache->lru_tail;
+    if (cache->lru_tail >= 0)
+    {
+        cache->entries[cache->lru_tail].lru_next = idx;
+    }
+    cache->lru_tail = idx;
+    if (cache->lru_head < 0)
+    {
+        cache->lru_head = idx;
+    }
+}
+
+// Returns an entry idx detached from the hash table and the LRU list
+static int32_t get_slot(CACHE *cache)
+{
+    // 1. Still room left: hand out a fresh entry
+    if (cache->used < cache->capacity)
+    {
+        int32_t idx = cache->used++;
+        cache->entries[idx].valid = false;
+        cache->entries[idx].dirty = false;
+        cache->entries[idx].hash_next = -1;
+        cache->entries[idx].lru_prev = -1;
+        cache->entries[idx].lru_next = -1;
+        return idx;
+    }
+
+    // 2. Full: recycle the least recently used entry
+    int32_t idx = cache->lru_tail;
+    cache_entry_t *victim = &cache->entries[idx];
+
+    if (victim->valid && victim->dirty)
+    {
+        int result = vdisk_write(cache->disk, victim->sector, cache->data + (size_t)idx * cache->block_size);
+        if (result != 0)
+        {
+            return result; // victim stays cached & dirty
+        }
+        cache->stats.writebacks++;
+    }
+
+    lru_unlink(cache, idx);
+    if (victim->valid)
+    {
+        hash_remove(cache, idx);
+        cache->stats.evictions++;
+    }
+    victim->valid = false;
+    victim->dirty = false;
+    victim->hash_next = -1;
+
+    return idx;
+}
+
+// Returns the idx of the entry holding `sector`, reading it in on a miss
+static int32_t fetch(CACHE *cache, uint32_t sector)
+{
+    // 1. Hit: refresh the entry
+    int32_t idx = lookup(cache, sector);
+    if (idx >= 0)
+    {
+        cache->stats.hits++;
+        lru_unlink(cache, idx);
+        lru_push_front(cache, idx);
+        return idx;
+    }
+
+    // 2. Miss: grab a slot (possibly evicting) and fill it from the disk
+    cache->stats.misses++;
+    idx = get_slot(cache);
+    if (idx < 0)
+    {
+        return idx; // err code from the write-back of the victim
+    }
+
+    int result = vdisk_read(cache->disk, sector, cache->data + (size_t)idx * cache->block_size);
+    if (result != 0)
+    {
+        // slot stays invalid -> first one to be reused
+        lru_push_back(cache, idx);
+        return result;
+    }
+
+    cache->entries[idx].sector = sector;
+    cache->entries[idx].valid = true;
+    cache->entries[idx].dirty = false;
+    hash_insert(cache, idx);
+    lru_push_front(cache, idx);
+
+    return idx;
+}
+
+static int check_sector(CACHE *cache, uint32_t sector)
+{
+    if (cache->disk->fp == NULL)
+    {
+        return vdisk_ENODISK;
+    }
+    if (sector >= cache->disk->size_in_sectors)
+    {
+        return vdisk_EEXCEED;
+    }
+    return 0;
+}
+
+static int compare_runs(const void *a, const void *b)
+{
+    uint32_t sector_a = ((const vdisk_run_t *)a)->sector;
+    uint32_t sector_b = ((const vdisk_run_t *)b)->sector;
+    return (sector_a > sector_b) - (sector_a < sector_b);
+}
@@ -3,59 +3,257 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 #include "include/fs.h"
+#include "include/fs_layout.h"
 #include "include/vdisk.h"
+#include "include/cache.h"
+#include "include/bitmap.h"
 #include "include/error.h"
 
-#define BLOCK_SIZE 1024
-#define INODE_SIZE 32
-#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
-#define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
-#define MAGIC_NUMBER "\xf0\x55\x4c\x49\x45\x47\x45\x49\x4e\x46\x4f\x30\x39\x34\x30\x0f"
+#define READAHEAD_MIN 4 // first readahead window (blocks), doubled from there
+
+#define ALLOC_SHARD_MIN_BLOCKS 1024 // smallest slice of the disk given its own allocator lock
+#define ALLOC_MAX_SHARDS 64
 
 
 /*************************/
 /* Data structures       */
 /*************************/
 
-// Super block structure
+// Per-file read state (resident, one per inode)
+typedef struct
+{
+    uint32_t map_first;  // first file block # covered by map_block
+    uint32_t map_block;  // pointer block resolved last (0 if none)
+    uint32_t next_block; // file block # the last read ended in
+    uint32_t ra_next;    // first file block # not prefetched yet
+    uint32_t ra_window;  // curr readahead window (0 = not sequential)
+} file_cursor_t;
+
+
+// Per-file append buffer: bytes written past the on-disk size, not yet
+// given blocks (delayed allocation, see write())
 typedef struct
 {
-    uint8_t magic[16];         // Magic # for SSFS
-    uint32_t num_blocks;       // Total # of blocks
-    uint32_t num_inode_blocks; // Number of inode blocks
-    uint32_t block_size;       // Block size in bytes (1024)
-} superblock_t;
+    uint8_t *data;     // allocated on first use, append_capacity bytes
+    uint32_t length;   // # of buffered bytes, they start at inode.size
+    uint32_t reserved; // # of free blocks held for them (see reserve_append)
+} append_buffer_t;
 
 
-// Inode structure (32 bytes)
+// Block allocator shard: a slice of the block bitmap with its own lock so
+// that threads allocating at the same time don't all queue on one mutex
 typedef struct
 {
-    uint8_t valid;                  // 0 if free, 1 if allocated
-    uint32_t size;                  // File size in bytes
-    uint32_t direct_blocks[4];      // Direct block pointers
-    uint32_t indirect_block;        // Single indirect block pointer
-    uint32_t double_indirect_block; // Double indirect block pointer
-} inode_t;
+    pthread_mutex_t lock;
+    BITMAP map;           // bit i <-> block first_block + i
+    uint32_t first_block; // multiple of 64 -> shards split the bitmap on word boundaries
+} alloc_shard_t;
 
 
-// File system state
-static bool disk_mounted = false;
-static DISK disk; // Defined in vdisk.h
-static superblock_t superblock;
-static uint32_t *block_bitmap = NULL; // For tracking free blocks
-static char *mounted_disk = NULL;
+// Running journal transaction: latest copy of every metadata block changed
+// since the last commit (they only reach their home location once logged)
+typedef struct
+{
+    pthread_rwlock_t txn_lock; // held shared by updates, exclusively by a commit
+    pthread_mutex_t lock;      // everything below
+    uint32_t capacity;         // max # of blocks logged by one commit (0 = no journal)
+    uint32_t sequence;         // # of the next commit
+    uint32_t count;            // # of blocks in the transaction
+    uint32_t max_count;
+    uint32_t *blocks;          // home block # of each one
+    uint8_t *data;             // their contents, one block each
+    int32_t *index;            // hash: block # -> entry (-1 = none)
+    uint32_t index_mask;
+    uint32_t *freed;           // blocks freed by the transaction, reusable once committed
+    uint32_t num_freed;
+    uint32_t max_freed;
+    bool *bitmap_dirty;        // bitmap blocks the transaction changed
+    uint8_t *log;              // one commit as written to the journal
+} journal_t;
+
+
+// Asynchronous read/write in progress (see fs_read_async)
+struct fs_aio
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when the last I/O is done
+    vdisk_io_t *ios;     // block runs queued on the disk
+    uint32_t num_ios;
+    uint32_t max_ios;
+    uint32_t pending;    // # of ios not completed yet
+    int error;           // first I/O error
+    int result;          // # of bytes, as read()/write() returned it
+};
+
+
+// File system instance: one mounted image (see fs_open, mount() uses a
+// built-in default one)
+// Locking: mount/unmount hold `lock` exclusively, every other call holds it
+// shared plus the lock of the inode it works on (see enter_inode).
+// Lock order: lock -> inode lock -> journal.txn_lock -> inode_table_lock ->
+//             cursor_lock / shard lock -> journal.lock -> cache
+// A commit holds `lock` shared (or exclusively) and nothing else.
+struct fs
+{
+    pthread_rwlock_t lock;
+    bool disk_mounted;
+    DISK disk; // Defined in vdisk.h
+    CACHE cache; // Defined in cache.h
+    superblock_t superblock;
+    uint32_t block_size; // Geometry read from the superblock (see init_geometry)
+    uint32_t inode_size;
+    uint32_t inodes_per_block;
+    uint32_t pointers_per_block;
+    uint32_t bits_per_block;
+    uint32_t max_extents; // inline ones + a block of them
+    uint32_t inode_bytes; // # of bytes of an inode_t stored on disk
+    uint64_t max_file_size; // in bytes, w/in what the block map & the size field can hold
+    uint32_t inline_capacity; // max size of an inline file (0 = no inline data)
+    uint8_t *zero_block; // block of 0s (to init new blocks)
+    alloc_shard_t *shards; // For tracking free blocks (see alloc_init)
+    uint32_t num_shards;
+    uint32_t shard_blocks; // # of blocks per shard
+    uint64_t unreserved_blocks; // free blocks not held for an append buffer (atomic, see take_blocks)
+    uint8_t *inode_table; // Resident copy of the inode blocks (loaded at mount, see inode_at)
+    BITMAP inode_bitmap; // For tracking free inodes
+    file_cursor_t *cursors; // Mapping cursor & readahead state per inode
+    uint32_t readahead_max; // Max readahead window (0 = disabled)
+    append_buffer_t *appends; // Delayed appends per inode
+    uint32_t append_capacity; // Append buffer size in bytes (0 = disabled)
+    char *mounted_disk;
+    vdisk_id_t disk_id; // file behind mounted_disk (see claim_image)
+    pthread_rwlock_t *inode_locks; // one per inode
+    uint32_t num_inode_locks;
+    pthread_mutex_t inode_table_lock; // inode table blocks & inode_bitmap
+    pthread_mutex_t cursor_lock;      // cursors
+    journal_t journal; // Metadata write-ahead log (FS_FLAG_JOURNAL)
+    fs_stats_t stats; // Counters, updated with relaxed atomics (see count_op); disk & cache keep their own
+    FS *next; // in the list of mounted instances
+};
+
+// Instance behind the single-image API (mount(), read(), ...)
+static FS default_fs = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .inode_table_lock = PTHREAD_MUTEX_INITIALIZER,
+    .cursor_lock = PTHREAD_MUTEX_INITIALIZER,
+    .journal.txn_lock = PTHREAD_RWLOCK_INITIALIZER,
+    .journal.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Every mounted instance (and image being formatted), so that an image is
+// never mounted (or formatted) while another instance has it open
+static pthread_mutex_t mounted_lock = PTHREAD_MUTEX_INITIALIZER;
+static FS *mounted_list = NULL;
+
+static uint32_t next_home_shard = 0;
+static __thread uint32_t home_shard = UINT32_MAX; // where this thread allocates first
+static __thread uint32_t *home_reserve = NULL;    // blocks this thread allocates from first (see flush_append)
 
 
 /*************************/
 /* Forward declarations  */
 /*************************/
 
-static int read_inode(int inode_num, inode_t *inode, bool bypass_mount_check);
-static int write_inode(int inode_num, inode_t *inode);
-static void free_block(int block_num);
-static int find_free_block(void);
-static int get_block_for_offset(inode_t *inode, int offset, bool allocate);
+static int read_inode(FS *fs, int inode_num, inode_t *inode, bool bypass_mount_check);
+static int write_inode(FS *fs, int inode_num, inode_t *inode);
+static void free_block(FS *fs, int block_num);
+static int find_free_block(FS *fs);
+static int read_pointer(FS *fs, uint32_t block_num, uint32_t index, uint32_t *pointer);
+static int write_pointer(FS *fs, uint32_t block_num, uint32_t index, uint32_t pointer);
+static int get_block_for_offset(FS *fs, inode_t *inode, int64_t offset, bool allocate);
+static uint32_t first_data_block(FS *fs);
+static int write_superblock(FS *fs);
+static int load_bitmap(FS *fs);
+static int store_bitmap(FS *fs);
+static int scan_blocks(FS *fs);
+static int load_inodes(FS *fs);
+static void drop_inodes(FS *fs);
+static inode_t *inode_at(FS *fs, uint32_t inode_num);
+static int init_geometry(FS *fs);
+static void drop_geometry(FS *fs);
+static uint32_t contiguous_run(FS *fs, inode_t *inode, file_cursor_t *cursor, int block_num, int64_t offset, int bytes_left, bool allocate);
+static int cursor_block_for_offset(FS *fs, file_cursor_t *cursor, inode_t *inode, int64_t offset);
+static void readahead(FS *fs, file_cursor_t *cursor, inode_t *inode, uint32_t first_block, uint32_t last_block);
+static int write_data(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t *aio);
+static int flush_append(FS *fs, int inode_num, bool whole_blocks_only);
+static int flush_appends(FS *fs);
+static void drop_append(FS *fs, int inode_num);
+static bool uses_extents(FS *fs);
+static bool uses_large_files(FS *fs);
+static bool uses_inline_data(FS *fs);
+static void read_inline(FS *fs, int inode_num, const inode_t *inode, uint8_t *data, uint32_t len, uint32_t offset);
+static int write_inline(FS *fs, int inode_num, inode_t *inode, const uint8_t *data, uint32_t len, uint32_t offset);
+static int spill_inline(FS *fs, int inode_num, inode_t *inode);
+static uint64_t get_size(const inode_t *inode);
+static void set_size(inode_t *inode, uint64_t size);
+static int map_pointer(FS *fs, uint32_t block_num, uint32_t index, bool allocate, bool data);
+static int free_pointer_tree(FS *fs, uint32_t block_num, uint32_t depth);
+static int mark_pointer_tree(FS *fs, uint32_t block_num, uint32_t depth);
+static int find_free_run(FS *fs, uint32_t goal, uint32_t want, uint32_t *granted);
+static uint32_t take_blocks(FS *fs, uint32_t want, bool all_or_nothing);
+static void give_blocks(FS *fs, uint32_t count);
+static bool reserve_append(FS *fs, append_buffer_t *pending, uint64_t start, uint32_t length);
+static int read_extent(FS *fs, inode_t *inode, uint32_t index, extent_t *extent);
+static int write_extent(FS *fs, inode_t *inode, uint32_t index, const extent_t *extent);
+static int map_extent(FS *fs, inode_t *inode, uint32_t block_index, uint32_t *block_num, uint32_t *run_left);
+static int extent_append(FS *fs, inode_t *inode, uint32_t want, bool zero);
+static int extent_block_for_offset(FS *fs, inode_t *inode, int64_t offset, bool allocate);
+static int free_extents(FS *fs, inode_t *inode);
+static int load_extents(FS *fs, inode_t *inode, extent_t *list);
+static int store_extents(FS *fs, inode_t *inode, const extent_t *list, uint32_t count, uint32_t from);
+static int extent_append_hole(FS *fs, inode_t *inode, uint32_t block_index);
+static int extent_fill_hole(FS *fs, inode_t *inode, uint32_t block_index);
+static int mount_locked(FS *fs, char *disk_name, const fs_options_t *opts);
+static int mount_image(FS *fs, char *disk_name, const fs_options_t *opts);
+static int format_image(char *disk_name, int inodes, const fs_format_options_t *opts);
+static int unmount_locked(FS *fs);
+static int create_locked(FS *fs);
+static int delete_locked(FS *fs, int inode_num);
+static int64_t stat_locked(FS *fs, int inode_num);
+static int read_locked(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t *aio);
+static int write_locked(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t *aio);
+static int write_journaled(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset);
+static int submit_async(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, bool write, fs_aio_t **reqp);
+static int aio_queue(fs_aio_t *aio, uint32_t block_num, uint32_t count, uint8_t *buffer, bool write);
+static int aio_queue_read(FS *fs, fs_aio_t *aio, uint32_t block_num, uint32_t count, uint8_t *buffer);
+static void aio_done(vdisk_io_t *io);
+static int enter_inode(FS *fs, int inode_num, bool exclusive);
+static uint64_t stats_clock(void);
+static void count_add(uint64_t *counter, uint64_t value);
+static void count_max(uint64_t *counter, uint64_t value);
+static int64_t count_op(FS *fs, int op, uint64_t start, int64_t result);
+static int claim_image(FS *fs, char *disk_name);
+static void release_image(FS *fs);
+static void leave_inode(FS *fs, int inode_num);
+static int alloc_init(FS *fs, uint32_t wanted_shards);
+static void alloc_destroy(FS *fs);
+static alloc_shard_t *shard_of(FS *fs, uint32_t block_num);
+static void block_set(FS *fs, uint32_t block_num);
+static int meta_read(FS *fs, uint32_t block_num, uint8_t *block);
+static int meta_write(FS *fs, uint32_t block_num, uint8_t *block);
+static bool uses_journal(FS *fs);
+static int journal_init(FS *fs);
+static void journal_destroy(FS *fs);
+static int journal_recover(FS *fs);
+static void journal_begin(FS *fs);
+static void journal_end(FS *fs);
+static int journal_commit(FS *fs);
+static void journal_commit_if_full(FS *fs);
+static int commit_locked(FS *fs);
+static int write_commit(FS *fs, uint32_t first, uint32_t count);
+static bool journal_lookup(FS *fs, uint32_t block_num, uint32_t offset, uint32_t length, uint8_t *buffer);
+static int journal_log(FS *fs, uint32_t block_num, const uint8_t *block);
+static bool journal_free(FS *fs, uint32_t block_num);
+static bool journal_reclaim(FS *fs);
+static void journal_bitmap_dirty(FS *fs, uint32_t block_num, uint32_t count);
+static int32_t *txn_entry(journal_t *journal, uint32_t block_num);
+static int txn_grow(FS *fs);
+static int read_commit(FS *fs, uint32_t slot, uint32_t *sequence);
+static void bitmap_block(FS *fs, uint32_t index, uint8_t *block);
+static uint32_t journal_checksum(const uint8_t *data, size_t length);
 
 
 /*************************/
@@ -74,12 +272,30 @@ static int get_block_for_offset(inode_t *inode, int offset, bool allocate);
  *      - bs=1024: Block Size - to be set at 1024 bytes as per the statement
  *      - count=100: Number of blocks to copy - copies exactly 100 blocks
  */
-int format(char *disk_name, int inodes)
+int fs_format(char *disk_name, int inodes, const fs_format_options_t *opts)
 {
-    // Precondition: Check if disk already mounted
-    if (disk_mounted)
+    // Precondition: Check if disk already mounted (by any instance), and
+    // keep it from being mounted until formatted
+    FS formatter;
+    memset(&formatter, 0, sizeof(FS));
+    int result = claim_image(&formatter, disk_name);
+    if (result != 0)
     {
-        return E_DISK_ALREADY_MOUNTED;
+        return result;
+    }
+    result = format_image(disk_name, inodes, opts);
+    release_image(&formatter);
+    return result;
+}
+
+// Helper function to format an image claimed by fs_format()
+static int format_image(char *disk_name, int inodes, const fs_format_options_t *opts)
+{
+    fs_format_options_t defaults;
+    if (opts == NULL)
+    {
+        fs_default_format_options(&defaults);
+        opts = &defaults;
     }
 
     // Precondition: Adjust inodes to be at least 1
@@ -88,16 +304,38 @@ int format(char *disk_name, int inodes)
         inodes = 1;
     }
 
-    // Open disk image file
+    // Precondition: Block size a power of 2 w/in the supported range, and
+    // a whole # of inodes (themselves a power of 2) per block
+    uint32_t block_size = opts->block_size;
+    uint32_t inode_size = opts->inode_size;
+    if (opts->large_files && inode_size < LARGE_INODE_SIZE)
+    {
+        inode_size = LARGE_INODE_SIZE; // room for the large-file fields
+    }
+    if (block_size < FS_MIN_BLOCK_SIZE || block_size > FS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 ||
+        inode_size < INODE_SIZE || inode_size > block_size || (inode_size & (inode_size - 1)) != 0)
+    {
+        return E_INVALID_GEOMETRY;
+    }
+    uint32_t inodes_per_block = block_size / inode_size;
+    uint32_t bits_per_block = block_size * 8;
+
+    // Open disk image file, addressed in blocks of the chosen size
     DISK format_disk;
     int result = vdisk_on(disk_name, &format_disk);
     if (result != 0)
     {
         return result;
     }
+    result = vdisk_set_sector_size(&format_disk, block_size);
+    if (result != 0)
+    {
+        vdisk_off(&format_disk);
+        return result;
+    }
 
     // Get required # of inode blocks (ceiling division)
-    int num_inode_blocks = (inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    int num_inode_blocks = (inodes + inodes_per_block - 1) / inodes_per_block;
     if (num_inode_blocks <= 0)
     {
         num_inode_blocks = 1;
@@ -106,23 +344,60 @@ int format(char *disk_name, int inodes)
     // Calculate total # of blocks available on disk
     uint32_t total_blocks = format_disk.size_in_sectors;
 
+    // Get required # of allocation bitmap blocks (1 bit per block)
+    uint32_t num_bitmap_blocks = (total_blocks + bits_per_block - 1) / bits_per_block;
+
+    // Journal (optional): right after the bitmap, split in 2 slots, each
+    // holding at most one commit of up to JOURNAL_ENTRIES(block_size) blocks
+    uint32_t num_journal_blocks = opts->journal_blocks;
+    if (num_journal_blocks > 0 && num_journal_blocks < JOURNAL_MIN_BLOCKS)
+    {
+        num_journal_blocks = JOURNAL_MIN_BLOCKS;
+    }
+    if (num_journal_blocks > 2 * (JOURNAL_ENTRIES(block_size) + 2))
+    {
+        num_journal_blocks = 2 * (JOURNAL_ENTRIES(block_size) + 2);
+    }
+
     // Ensure enough space for at least one data block
     //  +1 to account for the superblock!
-    if ((uint32_t)num_inode_blocks + 1 >= total_blocks)
+    uint32_t num_reserved = 1 + (uint32_t)num_inode_blocks + num_bitmap_blocks + num_journal_blocks;
+    if (num_reserved >= total_blocks)
     {
         vdisk_off(&format_disk);
-        return E_OUT_OF_SPACE; // can't fit inode b + superb + (>=1) one data b
+        return E_OUT_OF_SPACE; // can't fit superb + inode b + bitmap b + journal + (>=1) one data b
     }
 
     // Init superblock
     superblock_t sb;
+    memset(&sb, 0, sizeof(superblock_t));
     memcpy(sb.magic, MAGIC_NUMBER, 16);
     sb.num_blocks = total_blocks;
     sb.num_inode_blocks = num_inode_blocks;
-    sb.block_size = BLOCK_SIZE;
+    sb.block_size = block_size;
+    sb.bitmap_start = 1 + num_inode_blocks; // right after the inode blocks
+    sb.num_bitmap_blocks = num_bitmap_blocks;
+    sb.state = FS_STATE_CLEAN;
+    sb.inode_size = inode_size;
+    sb.flags = opts->extents ? FS_FLAG_EXTENTS : 0;
+    if (opts->large_files)
+    {
+        sb.flags |= FS_FLAG_LARGE_FILES;
+    }
+    if (opts->inline_data)
+    {
+        sb.flags |= FS_FLAG_INLINE_DATA;
+    }
+    if (num_journal_blocks > 0)
+    {
+        sb.flags |= FS_FLAG_JOURNAL;
+        sb.journal_start = sb.bitmap_start + num_bitmap_blocks;
+        sb.num_journal_blocks = num_journal_blocks;
+    }
 
     // Write superblock to block 0
-    uint8_t block_buffer[BLOCK_SIZE] = {0};
+    uint8_t block_buffer[block_size];
+    memset(block_buffer, 0, block_size);
     memcpy(block_buffer, &sb, sizeof(superblock_t));
     result = vdisk_write(&format_disk, 0, block_buffer);
     if (result != 0)
@@ -132,7 +407,7 @@ int format(char *disk_name, int inodes)
     }
 
     // Init inode blocks (starting at block idx 1)
-    memset(block_buffer, 0, BLOCK_SIZE); // zero-out buffer
+    memset(block_buffer, 0, block_size); // zero-out buffer
     for (int i = 1; i <= num_inode_blocks; i++)
     {
         result = vdisk_write(&format_disk, i, block_buffer);
@@ -143,6 +418,40 @@ int format(char *disk_name, int inodes)
         }
     }
 
+    // Init journal: no commit in either slot (wipes whatever an older
+    // format left there)
+    memset(block_buffer, 0, block_size);
+    for (uint32_t slot = 0; slot < 2 && num_journal_blocks > 0; slot++)
+    {
+        result = vdisk_write(&format_disk, sb.journal_start + slot * (num_journal_blocks / 2), block_buffer);
+        if (result != 0)
+        {
+            vdisk_off(&format_disk);
+            return result;
+        }
+    }
+
+    // Init allocation bitmap: superblock, inode, bitmap & journal blocks are used
+    for (uint32_t i = 0; i < num_bitmap_blocks; i++)
+    {
+        memset(block_buffer, 0, block_size);
+        for (uint32_t bit = 0; bit < bits_per_block; bit++)
+        {
+            if (i * bits_per_block + bit >= num_reserved)
+            {
+                break;
+            }
+            block_buffer[bit / 8] |= 1 << (bit % 8);
+        }
+
+        result = vdisk_write(&format_disk, sb.bitmap_start + i, block_buffer);
+        if (result != 0)
+        {
+            vdisk_off(&format_disk);
+            return result;
+        }
+    }
+
     // Sync to ensure all changes are written to disk
     result = vdisk_sync(&format_disk);
     if (result != 0)
@@ -156,275 +465,425 @@ int format(char *disk_name, int inodes)
     return 0;
 }
 
-int mount(char *disk_name)
+void fs_default_format_options(fs_format_options_t *opts)
+{
+    memset(opts, 0, sizeof(fs_format_options_t));
+    opts->extents = false;
+    opts->journal_blocks = 0;
+    opts->block_size = FS_DEFAULT_BLOCK_SIZE;
+    opts->inode_size = FS_DEFAULT_INODE_SIZE;
+    opts->large_files = false;
+    opts->inline_data = false;
+}
+
+int fs_open(char *disk_name, const fs_options_t *opts, FS **fsp)
 {
-    // 1. Check if disk already mounted
-    if (disk_mounted)
+    FS *fs = (FS *)calloc(1, sizeof(FS));
+    if (fs == NULL)
     {
-        return E_DISK_ALREADY_MOUNTED;
+        return E_OUT_OF_SPACE; // see error.h
     }
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->inode_table_lock, NULL);
+    pthread_mutex_init(&fs->cursor_lock, NULL);
+    pthread_rwlock_init(&fs->journal.txn_lock, NULL);
+    pthread_mutex_init(&fs->journal.lock, NULL);
 
-    // 2. Open disk image file
-    int result = vdisk_on(disk_name, &disk);
+    int result = mount_locked(fs, disk_name, opts);
     if (result != 0)
     {
+        pthread_rwlock_destroy(&fs->lock);
+        pthread_mutex_destroy(&fs->inode_table_lock);
+        pthread_mutex_destroy(&fs->cursor_lock);
+        pthread_rwlock_destroy(&fs->journal.txn_lock);
+        pthread_mutex_destroy(&fs->journal.lock);
+        free(fs);
         return result;
     }
 
-    // 3. Read superblock (Block 0) and copy its data
-    uint8_t block_buffer[BLOCK_SIZE];
-    result = vdisk_read(&disk, 0, block_buffer);
+    *fsp = fs;
+    return 0;
+}
+
+static int mount_locked(FS *fs, char *disk_name, const fs_options_t *opts)
+{
+    // 1. Check if disk already mounted (here or by another instance), and
+    //    list the instance right away so that no other one can take it
+    //    (or format it) meanwhile
+    if (fs->disk_mounted)
+    {
+        return E_DISK_ALREADY_MOUNTED;
+    }
+    int result = claim_image(fs, disk_name);
     if (result != 0)
     {
-        vdisk_off(&disk);
         return result;
     }
 
-    memcpy(&superblock, block_buffer, sizeof(superblock_t));
-
-    // 4. Verify the magic #
-    if (memcmp(superblock.magic, MAGIC_NUMBER, 16) != 0)
+    result = mount_image(fs, disk_name, opts);
+    if (result != 0)
     {
-        vdisk_off(&disk);
-        return E_CORRUPT_DISK;
+        release_image(fs);
     }
+    return result;
+}
 
-    // 5. Allocate mem for the block bitmap
-    block_bitmap = (uint32_t *)calloc(superblock.num_blocks, sizeof(uint32_t));
-    if (block_bitmap == NULL)
+// Helper function to mount an image claimed by mount_locked()
+static int mount_image(FS *fs, char *disk_name, const fs_options_t *opts)
+{
+    fs_options_t defaults;
+    if (opts == NULL)
     {
-        vdisk_off(&disk);
-        return E_OUT_OF_SPACE;  // see error.h
+        fs_default_options(&defaults);
+        opts = &defaults;
     }
+    memset(&fs->stats, 0, sizeof(fs_stats_t)); // counted from mount on
 
-    // 6. Init block bitmap - mark superblock and inode blocks as used
-    block_bitmap[0] = 1;
-    for (uint32_t i = 1; i <= superblock.num_inode_blocks; i++)
+    // 2. Open disk image file
+    int result = vdisk_open(disk_name, &fs->disk, opts->backend);
+    if (result != 0)
     {
-        block_bitmap[i] = 1;
+        return result;
     }
 
-    // Scan all inodes to mark data blocks as used if allocated
-    for (uint32_t i = 0; i < superblock.num_inode_blocks * INODES_PER_BLOCK; i++)
+    // 3. Read superblock (start of Block 0) and copy its data
+    //    -> the disk is still addressed in default-sized sectors
+    uint8_t sector[fs->disk.sector_size];
+    result = vdisk_read(&fs->disk, 0, sector);
+    if (result != 0)
     {
-        inode_t inode;
-        int result = read_inode(i, &inode, true);
-        if (result != 0)
-        {
-            free(block_bitmap);
-            block_bitmap = NULL;
-            vdisk_off(&disk);
-            return result;
-        }
-
-        if (inode.valid)
-        {
-            // Mark direct blocks
-            for (int j = 0; j < 4; j++)
-            {
-                if (inode.direct_blocks[j] != 0)
-                {
-                    block_bitmap[inode.direct_blocks[j]] = 1;
-                }
-            }
+        vdisk_off(&fs->disk);
+        return result;
+    }
 
-            // Mark indirect block
-            if (inode.indirect_block != 0)
-            {
-                block_bitmap[inode.indirect_block] = 1;
+    memcpy(&fs->superblock, sector, sizeof(superblock_t));
 
-                uint8_t indirect_block[BLOCK_SIZE];
-                result = vdisk_read(&disk, inode.indirect_block, indirect_block);
-                if (result != 0)
-                {
-                    free(block_bitmap);
-                    block_bitmap = NULL;
-                    vdisk_off(&disk);
-                    return result;
-                }
+    // 4. Verify the magic #, then switch to the block size it was formatted with
+    if (memcmp(fs->superblock.magic, MAGIC_NUMBER, 16) != 0)
+    {
+        vdisk_off(&fs->disk);
+        return E_CORRUPT_DISK;
+    }
+    result = init_geometry(fs);
+    if (result != 0)
+    {
+        vdisk_off(&fs->disk);
+        return result;
+    }
 
-                // Set non-zero entries in indirect block as used
-                uint32_t *pointers = (uint32_t *)indirect_block;
-                for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++)
-                {
-                    if (pointers[k] != 0)
-                    {
-                        block_bitmap[pointers[k]] = 1;
-                    }
-                }
-            }
+    // 5. Put the block cache in front of the disk
+    //    (a mapped image already lives in memory -> pass-through cache)
+    uint32_t cache_blocks = (fs->disk.backend == VDISK_BACKEND_MMAP) ? 0 : opts->cache_blocks;
+    fs->readahead_max = opts->readahead_blocks;
+    fs->append_capacity = opts->append_blocks * fs->block_size;
+    result = cache_on(&fs->cache, &fs->disk, cache_blocks);
+    if (result != 0)
+    {
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
+        return result;
+    }
+    fs->cache.shared = (opts->threads > 1); // blocks may change under a cache_peek pointer
+    result = vdisk_aio_on(&fs->disk, opts->io_depth, opts->io_engine);
+    if (result != 0)
+    {
+        cache_off(&fs->cache);
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
+        return result;
+    }
 
-            // Mark double indirect block
-            if (inode.double_indirect_block != 0)
-            {
-                block_bitmap[inode.double_indirect_block] = 1;
+    // 6. Journal: replay the last commit if the fs was not cleanly unmounted
+    //    -> brings every metadata block back to a consistent state
+    result = journal_init(fs);
+    if (result == 0)
+    {
+        result = journal_recover(fs);
+    }
+    if (result != 0)
+    {
+        journal_destroy(fs);
+        cache_off(&fs->cache);
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
+        return result;
+    }
 
-                uint8_t double_indirect_block[BLOCK_SIZE];
-                result = vdisk_read(&disk, inode.double_indirect_block, double_indirect_block);
-                if (result != 0)
-                {
-                    free(block_bitmap);
-                    block_bitmap = NULL;
-                    vdisk_off(&disk);
-                    return result;
-                }
+    // 7. Load the inode table and index the free inodes
+    result = load_inodes(fs);
+    if (result != 0)
+    {
+        journal_destroy(fs);
+        cache_off(&fs->cache);
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
+        return result;
+    }
 
-                // Process pointer in the double indirect block
-                uint32_t *indirect_pointers = (uint32_t *)double_indirect_block;
-                for (uint32_t j = 0; j < POINTERS_PER_BLOCK; j++)
-                {
-                    if (indirect_pointers[j] != 0)
-                    {
-                        // Mark indir block as used
-                        block_bitmap[indirect_pointers[j]] = 1;
+    // 8. Build the block bitmap: load the on-disk copy if the fs was cleanly
+    //    unmounted (or journaled: replayed along with the rest), otherwise
+    //    (or for images without one) rebuild it by walking every inode
+    //    -> recovery path after an unclean shutdown
+    result = alloc_init(fs, opts->threads);
+    if (result != 0)
+    {
+        drop_inodes(fs);
+        journal_destroy(fs);
+        cache_off(&fs->cache);
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
+        return result;
+    }
 
-                        uint8_t curr_indirect_block[BLOCK_SIZE];
-                        result = vdisk_read(&disk, indirect_pointers[j], curr_indirect_block);
-                        if (result != 0)
-                        {
-                            free(block_bitmap);
-                            block_bitmap = NULL;
-                            vdisk_off(&disk);
-                            return result;
-                        }
+    if (fs->superblock.bitmap_start != 0 && (fs->superblock.state == FS_STATE_CLEAN || uses_journal(fs)))
+    {
+        result = load_bitmap(fs);
+    }
+    else
+    {
+        result = scan_blocks(fs);
+    }
+    if (result != 0)
+    {
+        alloc_destroy(fs);
+        drop_inodes(fs);
+        journal_destroy(fs);
+        cache_off(&fs->cache);
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
+        return result;
+    }
+    fs->unreserved_blocks = 0;
+    for (uint32_t i = 0; i < fs->num_shards; i++)
+    {
+        fs->unreserved_blocks += fs->shards[i].map.num_free;
+    }
 
-                        // Set non-zero entries in this indirect block
-                        uint32_t *data_pointers = (uint32_t *)curr_indirect_block;
-                        for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++)
-                        {
-                            if (data_pointers[k] != 0)
-                            {
-                                block_bitmap[data_pointers[k]] = 1;
-                            }
-                        }
-                    }
-                }
-            }
+    // 9. Flag the fs as in use until unmount() writes the bitmap back
+    if (fs->superblock.bitmap_start != 0)
+    {
+        fs->superblock.state = FS_STATE_DIRTY;
+        result = write_superblock(fs);
+        if (result == 0)
+        {
+            result = uses_journal(fs) ? journal_commit(fs) : cache_sync(&fs->cache);
+        }
+        if (result != 0)
+        {
+            alloc_destroy(fs);
+            drop_inodes(fs);
+            journal_destroy(fs);
+            cache_off(&fs->cache);
+            drop_geometry(fs);
+            vdisk_off(&fs->disk);
+            return result;
         }
     }
 
-    // 7. Store disk name
+    // 10. Store disk name
     int name_length = strlen(disk_name) + 1;
-    mounted_disk = (char *)malloc(name_length);
-    if (mounted_disk == NULL)
+    fs->mounted_disk = (char *)malloc(name_length);
+    if (fs->mounted_disk == NULL)
     {
-        free(block_bitmap);
-        block_bitmap = NULL;
-        vdisk_off(&disk);
+        alloc_destroy(fs);
+        drop_inodes(fs);
+        journal_destroy(fs);
+        cache_off(&fs->cache);
+        drop_geometry(fs);
+        vdisk_off(&fs->disk);
         return E_OUT_OF_SPACE; // see error.h
     }
-    strcpy(mounted_disk, disk_name);
+    strcpy(fs->mounted_disk, disk_name);
 
-    // 8. Set disk_mounted flag
-    disk_mounted = true;
+    // 11. Set disk_mounted flag (the instance is listed already)
+    fs->disk_mounted = true;
 
     return 0; // Success
 }
 
-int unmount(void)
+void fs_default_options(fs_options_t *opts)
+{
+    memset(opts, 0, sizeof(fs_options_t));
+    opts->cache_blocks = CACHE_DEFAULT_BLOCKS;
+    opts->backend = VDISK_BACKEND_STDIO;
+    opts->readahead_blocks = FS_DEFAULT_READAHEAD;
+    opts->append_blocks = FS_DEFAULT_APPEND_BUFFER;
+    opts->threads = 1;
+    opts->io_depth = 0;
+    opts->io_engine = VDISK_AIO_AUTO;
+}
+
+int fs_close(FS *fs)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+    int result = unmount_locked(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    pthread_rwlock_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->inode_table_lock);
+    pthread_mutex_destroy(&fs->cursor_lock);
+    pthread_rwlock_destroy(&fs->journal.txn_lock);
+    pthread_mutex_destroy(&fs->journal.lock);
+    free(fs);
+    return result;
+}
+
+static int unmount_locked(FS *fs)
 {
     // 1. Check if disk is currently mounted
-    if (!disk_mounted)
+    if (!fs->disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
-    // 2. Sync any pending changes to disk
-    int result = vdisk_sync(&disk);
+    // 2. Let the async requests in flight land, give blocks to the buffered appends
+    vdisk_aio_off(&fs->disk);
+    int result = flush_appends(fs);
+
+    // 3. Persist the block bitmap, and once it (and all the data) is safely
+    //    on disk, flag the fs as cleanly unmounted
+    //    -> journaled: the bitmap blocks changed are logged by the last commit
+    if (result == 0 && uses_journal(fs))
+    {
+        fs->superblock.state = FS_STATE_CLEAN;
+        result = write_superblock(fs);
+        if (result == 0)
+        {
+            result = journal_commit(fs);
+        }
+    }
+    else if (result == 0 && fs->superblock.bitmap_start != 0)
+    {
+        result = store_bitmap(fs);
+        if (result == 0)
+        {
+            result = cache_sync(&fs->cache);
+        }
+        if (result == 0)
+        {
+            fs->superblock.state = FS_STATE_CLEAN;
+            result = write_superblock(fs);
+        }
+    }
+
+    // 4. Write back cached blocks and sync any pending changes to disk
+    int sync_result = cache_sync(&fs->cache);
+    if (result == 0)
+    {
+        result = sync_result;
+    }
     // we actually don't check the result here
     // because we want to clean up even if sync fails
     // -> will check in the final return
 
-    // 3. Free memory allocated for block bitmap
-    if (block_bitmap != NULL)
-    {
-        free(block_bitmap);
-        block_bitmap = NULL;
-    }
+    // 5. Free memory allocated for block bitmap, inode table & journal
+    alloc_destroy(fs);
+    drop_inodes(fs);
+    journal_destroy(fs);
 
-    // 4. Free memory allocated for mounted disk name
-    if (mounted_disk != NULL)
+    // 6. Take the instance off the list, free memory allocated for mounted disk name
+    release_image(fs);
+    if (fs->mounted_disk != NULL)
     {
-        free(mounted_disk);
-        mounted_disk = NULL;
+        free(fs->mounted_disk);
+        fs->mounted_disk = NULL;
     }
 
-    // 5. Close virtual disk and reset flag
-    vdisk_off(&disk);
-    disk_mounted = false;
+    // 7. Drop the cache, close virtual disk and reset flag
+    cache_off(&fs->cache);
+    drop_geometry(fs);
+    vdisk_off(&fs->disk);
+    fs->disk_mounted = false;
 
-    // Return 0 for success or err code from vdisk_sync if it failed
+    // Return 0 for success or err code from the flush/bitmap write-back/cache_sync
     return (result == 0) ? 0 : result;
 }
 
-int create(void)
+int fs_create(FS *fs)
+{
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs->lock);
+    int result = create_locked(fs);
+    journal_commit_if_full(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return (int)count_op(fs, FS_OP_CREATE, start, result);
+}
+
+static int create_locked(FS *fs)
 {
     // 1. Check for disk mounted
-    if (!disk_mounted)
+    if (!fs->disk_mounted)
     {
         printf("Disk not mounted\n");
         return E_DISK_NOT_MOUNTED;
     }
 
-    // 2. Iterate through all inodes
-    int max_inodes = superblock.num_inode_blocks * INODES_PER_BLOCK;
-    for (int inode_num = 0; inode_num < max_inodes; inode_num++)
+    // 2. Take the lowest free inode from the index
+    //    -> reserved right away so that no other thread gets it too
+    pthread_mutex_lock(&fs->inode_table_lock);
+    int64_t inode_num = bitmap_find_free(&fs->inode_bitmap);
+    if (inode_num >= 0)
     {
-        // 3. Get curr inode
-        inode_t inode;
-        int result = read_inode(inode_num, &inode, false);
-        if (result != 0)
-        {
-            return result;
-        }
-
-        // 4. Check if inode is free (valid = 0)
-        if (inode.valid == 0)
-        {
-            // Init inode fields
-            inode.valid = 1; // mark as allocated
-            inode.size = 0;  // empty file
+        bitmap_set(&fs->inode_bitmap, (uint32_t)inode_num);
+    }
+    pthread_mutex_unlock(&fs->inode_table_lock);
+    if (inode_num < 0)
+    {
+        return E_OUT_OF_INODES; // no free inodes left
+    }
 
-            // Init all block pointers to 0
-            for (int i = 0; i < 4; i++)
-            {
-                inode.direct_blocks[i] = 0;
-            }
-            inode.indirect_block = 0;
-            inode.double_indirect_block = 0;
+    // 3. Init inode fields
+    inode_t inode;
+    memset(&inode, 0, sizeof(inode_t)); // all block pointers to 0
+    inode.valid = 1; // mark as allocated
+    inode.flags = uses_inline_data(fs) ? INODE_INLINE : 0; // no block until it outgrows the inode
+    set_size(&inode, 0); // empty file
+
+    // 4. Write inode back
+    pthread_rwlock_wrlock(&fs->inode_locks[inode_num]);
+    journal_begin(fs);
+    int result = write_inode(fs, (int)inode_num, &inode);
+    journal_end(fs);
+    pthread_rwlock_unlock(&fs->inode_locks[inode_num]);
+    if (result != 0)
+    {
+        return result;
+    }
 
-            // 5. Write inode back to disk
-            result = write_inode(inode_num, &inode);
-            if (result != 0)
-            {
-                return result;
-            }
+    return (int)inode_num;
+}
 
-            return inode_num;
-        }
+int fs_delete(FS *fs, int inode_num)
+{
+    uint64_t start = stats_clock();
+    int result = enter_inode(fs, inode_num, true);
+    if (result != 0)
+    {
+        return (int)count_op(fs, FS_OP_DELETE, start, result);
     }
-
-    // 7. If we get here -> no free inodes found
-    return E_OUT_OF_INODES;
+    journal_begin(fs);
+    result = delete_locked(fs, inode_num);
+    journal_end(fs);
+    leave_inode(fs, inode_num);
+    return (int)count_op(fs, FS_OP_DELETE, start, result);
 }
 
-int delete(int inode_num)
+static int delete_locked(FS *fs, int inode_num)
 {
     // 1. Check for disk mounted
-    if (!disk_mounted)
+    if (!fs->disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
     // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
     {
         return E_INVALID_INODE;
     }
 
     // 3. Read inode
     inode_t inode;
-    int result = read_inode(inode_num, &inode, false);
+    int result = read_inode(fs, inode_num, &inode, false);
     if (result != 0)
     {
         return result;
@@ -435,23 +894,42 @@ int delete(int inode_num)
     {
         return E_INVALID_INODE; // inode already free
     }
+    drop_append(fs, inode_num); // buffered appends never got blocks
+
+    // 5. Inline file: the data goes with the inode, and there is no block
+    //    map to free below
+    if (inode.flags & INODE_INLINE)
+    {
+        memset(inode.inline_data, 0, INLINE_DATA_BYTES);
+    }
+
+    // 6. Extent format: free all extents
+    //    -> also zeroes the block pointers below (they share the same bytes)
+    if (uses_extents(fs))
+    {
+        result = free_extents(fs, &inode);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
 
-    // 5. Free direct blocks
+    // 7. Free direct blocks
     for (int i = 0; i < 4; i++)
     {
         if (inode.direct_blocks[i] != 0)
         {
-            free_block(inode.direct_blocks[i]);
+            free_block(fs, inode.direct_blocks[i]);
             inode.direct_blocks[i] = 0;
         }
     }
 
-    // 6. Free indirect block and all blocks it points to
+    // 8. Free indirect block and all blocks it points to
     if (inode.indirect_block != 0)
     {
         // Read the indirect block
-        uint8_t indirect_block[BLOCK_SIZE];
-        result = vdisk_read(&disk, inode.indirect_block, indirect_block);
+        uint8_t indirect_block[fs->block_size];
+        result = meta_read(fs, inode.indirect_block, indirect_block);
         if (result != 0)
         {
             return result;
@@ -459,25 +937,25 @@ int delete(int inode_num)
 
         // Free all referenced data blocks
         uint32_t *pointers = (uint32_t *)indirect_block;
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        for (uint32_t i = 0; i < fs->pointers_per_block; i++)
         {
             if (pointers[i] != 0)
             {
-                free_block(pointers[i]);
+                free_block(fs, pointers[i]);
             }
         }
 
         // Free indirect block itself
-        free_block(inode.indirect_block);
+        free_block(fs, inode.indirect_block);
         inode.indirect_block = 0;
     }
 
-    // 7. Free double indirect block and all blocks it points to
+    // 9. Free double indirect block and all blocks it points to
     if (inode.double_indirect_block != 0)
     {
         // Read the double indirect block
-        uint8_t double_indirect_block[BLOCK_SIZE];
-        result = vdisk_read(&disk, inode.double_indirect_block, double_indirect_block);
+        uint8_t double_indirect_block[fs->block_size];
+        result = meta_read(fs, inode.double_indirect_block, double_indirect_block);
         if (result != 0)
         {
             return result;
@@ -485,13 +963,13 @@ int delete(int inode_num)
 
         // Process pointer in the double indirect block
         uint32_t *indirect_pointers = (uint32_t *)double_indirect_block;
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        for (uint32_t i = 0; i < fs->pointers_per_block; i++)
         {
             if (indirect_pointers[i] != 0)
             {
                 // Read this indirect block
-                uint8_t indirect_block[BLOCK_SIZE];
-                result = vdisk_read(&disk, indirect_pointers[i], indirect_block);
+                uint8_t indirect_block[fs->block_size];
+                result = meta_read(fs, indirect_pointers[i], indirect_block);
                 if (result != 0)
                 {
                     return result;
@@ -499,30 +977,42 @@ int delete(int inode_num)
 
                 // Free all referenced data blocks
                 uint32_t *data_pointers = (uint32_t *)indirect_block;
-                for (uint32_t j = 0; j < POINTERS_PER_BLOCK; j++)
+                for (uint32_t j = 0; j < fs->pointers_per_block; j++)
                 {
                     if (data_pointers[j] != 0)
                     {
-                        free_block(data_pointers[j]);
+                        free_block(fs, data_pointers[j]);
                     }
                 }
 
                 // Free indirect block itself
-                free_block(indirect_pointers[i]);
+                free_block(fs, indirect_pointers[i]);
             }
         }
 
         // Free double indirect block itself
-        free_block(inode.double_indirect_block);
+        free_block(fs, inode.double_indirect_block);
         inode.double_indirect_block = 0;
     }
 
-    // 8. Mark inode as free
-    inode.valid = 0;
-    inode.size = 0;
-
-    // 9. Write back to disk
-    result = write_inode(inode_num, &inode);
+    // 10. Free triple indirect block and the 2 levels of blocks below it
+    if (inode.triple_indirect_block != 0)
+    {
+        result = free_pointer_tree(fs, inode.triple_indirect_block, 3);
+        if (result != 0)
+        {
+            return result;
+        }
+        inode.triple_indirect_block = 0;
+    }
+
+    // 11. Mark inode as free
+    inode.valid = 0;
+    inode.flags = 0;
+    set_size(&inode, 0);
+
+    // 12. Write back to disk
+    result = write_inode(fs, inode_num, &inode);
     if (result != 0)
     {
         return result;
@@ -531,23 +1021,36 @@ int delete(int inode_num)
     return 0;
 }
 
-int stat(int inode_num)
+int64_t fs_stat(FS *fs, int inode_num)
+{
+    uint64_t start = stats_clock();
+    int result = enter_inode(fs, inode_num, false);
+    if (result != 0)
+    {
+        return count_op(fs, FS_OP_STAT, start, result);
+    }
+    int64_t size = stat_locked(fs, inode_num);
+    leave_inode(fs, inode_num);
+    return count_op(fs, FS_OP_STAT, start, size);
+}
+
+static int64_t stat_locked(FS *fs, int inode_num)
 {
     // 1. Check for disk mounted
-    if (!disk_mounted)
+    if (!fs->disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
     // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
     {
         return E_INVALID_INODE;
     }
 
     // 3. Read inode
     inode_t inode;
-    int result = read_inode(inode_num, &inode, false);
+    int result = read_inode(fs, inode_num, &inode, false);
     if (result != 0)
     {
         return result;
@@ -559,635 +1062,3533 @@ int stat(int inode_num)
         return E_INVALID_INODE;
     }
 
-    return inode.size;
+    // Buffered appends count towards the size
+    return (int64_t)(get_size(&inode) + fs->appends[inode_num].length);
 }
 
-int read(int inode_num, uint8_t *data, int len, int offset)
+int fs_sync(FS *fs)
 {
-    // 1. Check for disk  mounted
-    if (!disk_mounted)
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs->lock);
+    if (!fs->disk_mounted)
     {
-        return E_DISK_NOT_MOUNTED;
+        pthread_rwlock_unlock(&fs->lock);
+        return (int)count_op(fs, FS_OP_SYNC, start, E_DISK_NOT_MOUNTED);
     }
 
-    // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    // Give blocks to the buffered appends, commit the metadata they (and
+    // every other update) changed, then push everything to the disk
+    int result = flush_appends(fs);
+    int commit_result = journal_commit(fs);
+    int sync_result = cache_sync(&fs->cache);
+    pthread_rwlock_unlock(&fs->lock);
+    if (result == 0)
     {
-        return E_INVALID_INODE;
+        result = commit_result;
     }
+    return (int)count_op(fs, FS_OP_SYNC, start, (result != 0) ? result : sync_result);
+}
 
-    // 3. Read inode
-    inode_t inode;
-    int result = read_inode(inode_num, &inode, false);
-    if (result != 0)
+int fs_cache_stats(FS *fs, cache_stats_t *stats)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    if (!fs->disk_mounted)
     {
-        return result;
+        pthread_rwlock_unlock(&fs->lock);
+        return E_DISK_NOT_MOUNTED;
     }
 
-    // 4. Check if inode is allocated/valid)
-    if (inode.valid == 0)
+    cache_get_stats(&fs->cache, stats);
+    pthread_rwlock_unlock(&fs->lock);
+    return 0;
+}
+
+/*
+ * I/O & latency counters since mount (or the last fs_reset_stats)
+ * -> counting is a few relaxed atomic adds and a clock read per call, so
+ *    they're always on; a snapshot taken while other threads run may mix
+ *    counts from just before and just after any one call
+ */
+int fs_get_stats(FS *fs, fs_stats_t *stats)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    if (!fs->disk_mounted)
     {
-        return E_INVALID_INODE;
+        pthread_rwlock_unlock(&fs->lock);
+        return E_DISK_NOT_MOUNTED;
     }
 
-    // 5. Determine actual # of bytes to read
-    int bytes_to_read = 0;
-    if ((uint32_t)offset < inode.size)
+    uint64_t *from = (uint64_t *)&fs->stats;
+    uint64_t *to = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
     {
-        bytes_to_read = inode.size - offset;
-        if (bytes_to_read > len)
-        {
-            bytes_to_read = len;
-        }
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
     }
+    vdisk_get_stats(&fs->disk, &stats->disk);
+    cache_get_stats(&fs->cache, &stats->cache);
+    pthread_rwlock_unlock(&fs->lock);
+    return 0;
+}
 
-    // 6. If no bytes to read, return 0
-    if (bytes_to_read <= 0)
+int fs_reset_stats(FS *fs)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    if (!fs->disk_mounted)
     {
-        return 0;
+        pthread_rwlock_unlock(&fs->lock);
+        return E_DISK_NOT_MOUNTED;
     }
 
-    // 7. Init counter for total bytes read
-    int bytes_read = 0;
-    uint32_t current_offset = offset;
-
-    // 8. Read block by block
-    while (bytes_read < bytes_to_read)
+    uint64_t *counters = (uint64_t *)&fs->stats;
+    for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
     {
-        // Get curr block idx and offset w/in the block
-        // Then get physical block # for curr offset
-        int block_offset = current_offset % BLOCK_SIZE;
-        int block_num = get_block_for_offset(&inode, current_offset, false);
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+    vdisk_reset_stats(&fs->disk);
+    cache_reset_stats(&fs->cache);
+    pthread_rwlock_unlock(&fs->lock);
+    return 0;
+}
 
-        // If <=0, that means null pointer or error
-        if (block_num <= 0)
-        {
-            break;
-        }
+// Helper function to read the clock the latencies are measured with
+static uint64_t stats_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
 
-        // Read the block into temp buffer
-        uint8_t block[BLOCK_SIZE];
-        result = vdisk_read(&disk, block_num, block);
-        if (result != 0)
-        {
-            // but if some data has already been read, return the count
-            // else, return the error
-            return (bytes_read > 0) ? bytes_read : result;
-        }
+// Helper functions to update a counter from any thread
+static void count_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
 
-        // Calculate how many bytes to copy from this block
-        int bytes_to_copy = BLOCK_SIZE - block_offset;
-        if (bytes_to_copy > (bytes_to_read - bytes_read))
-        {
-            bytes_to_copy = bytes_to_read - bytes_read;
-        }
+static void count_max(uint64_t *counter, uint64_t value)
+{
+    uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(counter, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        // `current` was reloaded, try again
+    }
+}
 
-        // Copy data from block to user buffer
-        memcpy(data + bytes_read, block + block_offset, bytes_to_copy);
+// Helper function to count a call that started at `start` and returned
+// `result` (passed through, so it can wrap the return)
+static int64_t count_op(FS *fs, int op, uint64_t start, int64_t result)
+{
+    fs_op_stats_t *stats = &fs->stats.ops[op];
+    uint64_t ns = stats_clock() - start;
 
-        // Update counters
-        bytes_read += bytes_to_copy;
-        current_offset += bytes_to_copy;
+    // Bucket: 0 under 1 us, else 1 + floor(log2(us))
+    uint64_t us = ns / 1000;
+    uint32_t bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= FS_LATENCY_BUCKETS)
+    {
+        bucket = FS_LATENCY_BUCKETS - 1;
     }
 
-    return bytes_read;  // # of bytes actually read
+    count_add(&stats->count, 1);
+    count_add(&stats->total_ns, ns);
+    count_max(&stats->max_ns, ns);
+    count_add(&stats->latency[bucket], 1);
+    if (result < 0)
+    {
+        count_add(&stats->errors, 1);
+    }
+    else if (op == FS_OP_READ || op == FS_OP_WRITE)
+    {
+        count_add(&stats->bytes, (uint64_t)result);
+    }
+    return result;
 }
 
-int write(int inode_num, uint8_t *data, int len, int offset)
+int fs_read(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset)
 {
-    // 1. Check for disk mounted
-    if (!disk_mounted)
+    uint64_t start = stats_clock();
+    int result = enter_inode(fs, inode_num, false);
+    if (result != 0)
+    {
+        return (int)count_op(fs, FS_OP_READ, start, result);
+    }
+    result = read_locked(fs, inode_num, data, len, offset, NULL);
+    leave_inode(fs, inode_num);
+    return (int)count_op(fs, FS_OP_READ, start, result);
+}
+
+static int read_locked(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t *aio)
+{
+    // 1. Check for disk  mounted
+    if (!fs->disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
     // 2. Check if inode # is valid
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
     {
         return E_INVALID_INODE;
     }
 
-    // 3. Read the inode
+    // 3. Read inode
     inode_t inode;
-    int result = read_inode(inode_num, &inode, false);
+    int result = read_inode(fs, inode_num, &inode, false);
     if (result != 0)
     {
         return result;
     }
 
-    // 4. Check if inode is allocated/valid
+    // 4. Check if inode is allocated/valid)
     if (inode.valid == 0)
     {
         return E_INVALID_INODE;
     }
 
-    // 5. If offset beyond curr file size, fill the gap with 0s
-    if ((uint32_t)offset > inode.size)
+    // 5. Determine actual # of bytes to read
+    //    (the file goes on in the append buffer past inode.size)
+    append_buffer_t *pending = &fs->appends[inode_num];
+    uint64_t size = get_size(&inode);
+    uint64_t file_size = size + pending->length;
+    int bytes_to_read = 0;
+    if (len > 0 && offset >= 0 && (uint64_t)offset < file_size)
     {
-        int zero_fill_start = inode.size;
-        int zero_fill_end = offset;
-        uint8_t zeros[BLOCK_SIZE] = {0};
+        bytes_to_read = (file_size - offset < (uint64_t)len) ? (int)(file_size - offset) : len;
+    }
 
-        for (int curr_offset = zero_fill_start; curr_offset < zero_fill_end; )
-        {
-            int block_offset = curr_offset % BLOCK_SIZE;
-            int block_num = get_block_for_offset(&inode, curr_offset, true);
+    // 6. If no bytes to read, return 0
+    if (bytes_to_read <= 0)
+    {
+        return 0;
+    }
 
-            if (block_num <= 0)
-            {
-                // Error allocating block
-                // but potentially we've already modified the file
-                // <=> update inode size to reflect changes so far
-                inode.size = ((uint32_t)curr_offset > inode.size) ? (uint32_t)curr_offset : inode.size;
-                write_inode(inode_num, &inode);
-                return block_num; // err code
-            }
+    // 7. Prefetch what comes next if the file is being streamed
+    //    (readers share the inode: work on a copy of its cursor;
+    //    an async read is one batch already, no need to guess ahead)
+    file_cursor_t cursor_copy;
+    file_cursor_t *cursor = &cursor_copy;
+    pthread_mutex_lock(&fs->cursor_lock);
+    cursor_copy = fs->cursors[inode_num];
+    pthread_mutex_unlock(&fs->cursor_lock);
+    if (aio == NULL && !(inode.flags & INODE_INLINE))
+    {
+        readahead(fs, cursor, &inode, offset / fs->block_size, (offset + bytes_to_read - 1) / fs->block_size);
+    }
+
+    // 8. Init counter for total bytes read
+    int bytes_read = 0;
+    uint64_t current_offset = offset;
 
-            // Get how many bytes to fill in this block
-            int bytes_to_fill = BLOCK_SIZE - block_offset;
-            if (bytes_to_fill > (zero_fill_end - curr_offset))
+    // 9. Read block by block what is on disk
+    int disk_bytes = 0;
+    if ((uint64_t)offset < size)
+    {
+        disk_bytes = (size - offset < (uint64_t)bytes_to_read) ? (int)(size - offset) : bytes_to_read;
+    }
+    if (inode.flags & INODE_INLINE)
+    {
+        // Inline file: it's all in the inode
+        read_inline(fs, inode_num, &inode, data, disk_bytes, offset);
+        bytes_read = disk_bytes;
+        current_offset += disk_bytes;
+    }
+    while (bytes_read < disk_bytes)
+    {
+        // Get curr block idx and offset w/in the block
+        // Then get physical block # for curr offset
+        int block_offset = current_offset % fs->block_size;
+        int block_num = cursor_block_for_offset(fs, cursor, &inode, current_offset);
+
+        // If <0, that means error
+        if (block_num < 0)
+        {
+            return (bytes_read > 0) ? bytes_read : block_num;
+        }
+
+        // Null pointer w/in the file: hole, reads as 0s
+        if (block_num == 0)
+        {
+            int bytes_to_zero = fs->block_size - block_offset;
+            if (bytes_to_zero > (disk_bytes - bytes_read))
             {
-                bytes_to_fill = zero_fill_end - curr_offset;
+                bytes_to_zero = disk_bytes - bytes_read;
             }
+            memset(data + bytes_read, 0, bytes_to_zero);
+            bytes_read += bytes_to_zero;
+            current_offset += bytes_to_zero;
+            continue;
+        }
 
-            // If block not empty / we're not writing a full block,
-            // we need to read the existing block
-            uint8_t block[BLOCK_SIZE];
-            if (block_offset > 0 || bytes_to_fill < BLOCK_SIZE)
+        // Whole blocks: move the physically contiguous run starting here
+        // straight into the user buffer in a single call
+        uint32_t run_length = contiguous_run(fs, &inode, cursor, block_num, current_offset, disk_bytes - bytes_read, false);
+        if (run_length > 1)
+        {
+            if (aio != NULL)
             {
-                result = vdisk_read(&disk, block_num, block);
-                if (result != 0)
-                {
-                    // If read fails -> update inode and return the error
-                    inode.size = ((uint32_t)curr_offset > inode.size) ? (uint32_t)curr_offset : inode.size;
-                    write_inode(inode_num, &inode);
-                    return result;
-                }
+                result = aio_queue_read(fs, aio, block_num, run_length, data + bytes_read);
             }
             else
             {
-                // If writing a full block, just use our 0-buffer
-                memcpy(block, zeros, BLOCK_SIZE);
+                result = cache_read_range(&fs->cache, block_num, run_length, data + bytes_read);
             }
-
-            // Fill the appropriate portion of the block with 0s
-            memset(block + block_offset, 0, bytes_to_fill);
-
-            // Write block back to disk
-            result = vdisk_write(&disk, block_num, block);
             if (result != 0)
             {
-                // If write fails -> update inode and return the error
-                inode.size = ((uint32_t)curr_offset > inode.size) ? (uint32_t)curr_offset : inode.size;
-                write_inode(inode_num, &inode);
-                return result;
-            }
-
-            // Update offset
-            curr_offset += bytes_to_fill;
-        }
-
-        // Update inode size to new offset
-        inode.size = offset;
-    }
-
-    // 6. Write data from user buffer
-    int bytes_written = 0;
-    int current_offset = offset;
-
-    while (bytes_written < len)
-    {
-        // Get block idx and offset w/in the block
-        int block_offset = current_offset % BLOCK_SIZE;
-        int block_num = get_block_for_offset(&inode, current_offset, true); // pass allocate=true for potential new block
-
-        // If error getting/allocating the block
-        if (block_num <= 0)
-        {
-            // Update inode size to reflect changes so far
-            if ((uint32_t)current_offset > inode.size)
-            {
-                inode.size = current_offset;
-                write_inode(inode_num, &inode);
+                return (bytes_read > 0) ? bytes_read : result;
             }
-            return (bytes_written > 0) ? bytes_written : block_num;
-        }
-
-        // Get how many bytes to write to this block
-        int bytes_to_write = BLOCK_SIZE - block_offset;
-        if (bytes_to_write > (len - bytes_written))
-        {
-            bytes_to_write = len - bytes_written;
+            bytes_read += run_length * fs->block_size;
+            current_offset += run_length * fs->block_size;
+            continue;
         }
 
-        // If not writing a full block or starting from the beginning of a block,
-        // => then need to read the existing block to preserve data
-        uint8_t block[BLOCK_SIZE];
-        if (block_offset > 0 || bytes_to_write < BLOCK_SIZE)
+        // Access the block in place if possible, else read it into temp buffer
+        uint8_t block_copy[fs->block_size];
+        const uint8_t *block = cache_peek(&fs->cache, block_num);
+        if (block == NULL)
         {
-            result = vdisk_read(&disk, block_num, block);
+            result = cache_read(&fs->cache, block_num, block_copy);
             if (result != 0)
             {
-                // If some data was already written, update size and rtn count
-                if (bytes_written > 0)
-                {
-                    if ((uint32_t)current_offset > inode.size)
-                    {
-                        inode.size = current_offset;
-                        write_inode(inode_num, &inode);
-                    }
-                    return bytes_written;
-                }
-                return result;
+                // but if some data has already been read, return the count
+                // else, return the error
+                return (bytes_read > 0) ? bytes_read : result;
             }
+            block = block_copy;
         }
 
-        // Copy data from user buffer to block
-        memcpy(block + block_offset, data + bytes_written, bytes_to_write);
-
-        // Write block back to disk
-        result = vdisk_write(&disk, block_num, block);
-        if (result != 0)
+        // Calculate how many bytes to copy from this block
+        int bytes_to_copy = fs->block_size - block_offset;
+        if (bytes_to_copy > (disk_bytes - bytes_read))
         {
-            // If some data was already written, update size and rtn count
-            if (bytes_written > 0)
-            {
-                if ((uint32_t)current_offset > inode.size)
-                {
-                    inode.size = current_offset;
-                    write_inode(inode_num, &inode);
-                }
-                return bytes_written;
-            }
-            return result;
+            bytes_to_copy = disk_bytes - bytes_read;
         }
 
+        // Copy data from block to user buffer
+        memcpy(data + bytes_read, block + block_offset, bytes_to_copy);
+
         // Update counters
-        bytes_written += bytes_to_write;
-        current_offset += bytes_to_write;
+        bytes_read += bytes_to_copy;
+        current_offset += bytes_to_copy;
     }
 
-    // 7. Update inode size if the write extended the file
-    if ((uint32_t)current_offset > inode.size)
+    // 10. Then copy what is still in the append buffer
+    if (bytes_read == disk_bytes && bytes_read < bytes_to_read)
     {
-        inode.size = current_offset;
-        result = write_inode(inode_num, &inode);
-        if (result != 0)
-        {
-            // Even writing inode fails, we have written data,
-            // so return count of bytes written so far
-            return bytes_written;
-        }
+        memcpy(data + bytes_read, pending->data + (current_offset - size), bytes_to_read - bytes_read);
+        current_offset += bytes_to_read - bytes_read;
+        bytes_read = bytes_to_read;
     }
 
-    return bytes_written;
+    cursor->next_block = current_offset / fs->block_size;
+    pthread_mutex_lock(&fs->cursor_lock);
+    fs->cursors[inode_num] = cursor_copy;
+    pthread_mutex_unlock(&fs->cursor_lock);
+    return bytes_read;  // # of bytes actually read
 }
 
-
-
-
-/*************************/
-/* Helper functions      */
-/*************************/
-
-// Helper function to read an inode from disk
-// bypass_mount_check: if true, skip the mounted disk check (used only during mount operation)
-static int read_inode(int inode_num, inode_t *inode, bool bypass_mount_check)
+int fs_write(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset)
 {
-    if (!disk_mounted && !bypass_mount_check)
-    {
-        return E_DISK_NOT_MOUNTED;
-    }
+    uint64_t start = stats_clock();
+    int result = write_journaled(fs, inode_num, data, len, offset);
 
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    // Out of space, but blocks freed since the last commit come back with
+    // the next one: commit, then write the rest
+    // -> only once, what the failed write gave back itself won't help
+    if ((result == E_OUT_OF_SPACE || (result >= 0 && result < len)) && journal_reclaim(fs))
     {
-        return E_INVALID_INODE;
+        int done = (result > 0) ? result : 0;
+        int more = write_journaled(fs, inode_num, data + done, len - done, offset + done);
+        result = (more >= 0) ? done + more : ((done > 0) ? done : more);
     }
+    return (int)count_op(fs, FS_OP_WRITE, start, result);
+}
 
-    // Calculate block # and offset for the inode
-    int block_num = 1 + (inode_num / INODES_PER_BLOCK); // +1 because block 0 is superblock
-    int offset = (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
-
-    // Read the block containing the inode
-    uint8_t block[BLOCK_SIZE];
-    int result = vdisk_read(&disk, block_num, block);
+// Helper function to write as one update of the journal transaction
+static int write_journaled(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset)
+{
+    int result = enter_inode(fs, inode_num, true);
     if (result != 0)
     {
         return result;
     }
-
-    // Copy inode data
-    memcpy(inode, block + offset, INODE_SIZE);
-
-    return 0;
+    journal_begin(fs);
+    result = write_locked(fs, inode_num, data, len, offset, NULL);
+    journal_end(fs);
+    leave_inode(fs, inode_num);
+    return result;
 }
 
-// Helper function to write an inode to disk
-static int write_inode(int inode_num, inode_t *inode)
+static int write_locked(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t *aio)
 {
-    if (!disk_mounted)
+    // 1. Check for disk mounted
+    if (!fs->disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
 
-    if (inode_num < 0 || (uint32_t)inode_num >= superblock.num_inode_blocks * INODES_PER_BLOCK)
+    // 2. Check if inode # is valid
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
     {
         return E_INVALID_INODE;
     }
 
-    // Calculate block # and offset for the inode
-    int block_num = 1 + (inode_num / INODES_PER_BLOCK); // +1 because block 0 is superblock
-    int offset = (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
+    // 3. Check the file can grow that far
+    if (offset < 0 || (uint64_t)offset > fs->max_file_size)
+    {
+        return E_INVALID_OFFSET;
+    }
+    if (len < 0)
+    {
+        return 0; // nothing to write (not a huge len once cast)
+    }
+    if ((uint64_t)len > fs->max_file_size - offset)
+    {
+        len = (int)(fs->max_file_size - offset); // short write up to the max size
+    }
 
-    // Read the block containing the inode
-    uint8_t block[BLOCK_SIZE];
-    int result = vdisk_read(&disk, block_num, block);
+    // 4. Small append: just buffer it, blocks are allocated (as one run)
+    //    when the buffer fills up or on fs_sync()/unmount()
+    //    -> they are reserved right away, so that the flush can't run out
+    //       of space; on a disk too full for that, write it directly
+    append_buffer_t *pending = &fs->appends[inode_num];
+    inode_t inode;
+    int result = read_inode(fs, inode_num, &inode, false);
     if (result != 0)
     {
         return result;
     }
+    if (inode.valid && len > 0 && (uint32_t)len < fs->append_capacity &&
+        (uint64_t)offset == get_size(&inode) + pending->length)
+    {
+        if (pending->data == NULL)
+        {
+            pending->data = (uint8_t *)malloc(fs->append_capacity);
+        }
+        if (pending->data != NULL && reserve_append(fs, pending, get_size(&inode), pending->length + len))
+        {
+            int bytes_buffered = 0;
+            while (bytes_buffered < len)
+            {
+                // Full buffer: write out its whole blocks, keep the tail
+                if (pending->length == fs->append_capacity)
+                {
+                    result = flush_append(fs, inode_num, true);
+                    if (result != 0)
+                    {
+                        return (bytes_buffered > 0) ? bytes_buffered : result;
+                    }
+                }
 
-    // Update inode data in the block
-    memcpy(block + offset, inode, INODE_SIZE);
+                uint32_t room = fs->append_capacity - pending->length;
+                uint32_t chunk = ((uint32_t)(len - bytes_buffered) < room) ? (uint32_t)(len - bytes_buffered) : room;
+                memcpy(pending->data + pending->length, data + bytes_buffered, chunk);
+                pending->length += chunk;
+                bytes_buffered += chunk;
+            }
+            return bytes_buffered;
+        }
+    }
 
-    // Write the block back to disk
-    result = vdisk_write(&disk, block_num, block);
+    // 5. Anything else: the buffered bytes go first
+    result = flush_append(fs, inode_num, false);
     if (result != 0)
     {
         return result;
     }
 
-    return 0;
+    return write_data(fs, inode_num, data, len, offset, aio);
 }
 
-// Helper function to find a free block
-static int find_free_block()
+
+/*
+ * Asynchronous read()/write(): the block mapping (and allocation) is done
+ * right away, then every block of the request is submitted to the disk in
+ * one batch and *reqp is returned without waiting for them.
+ * NB: `data` must stay untouched until fs_aio_wait(), and the range should
+ *     not be read/written/deleted by other calls before then.
+ */
+int fs_read_async(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t **reqp)
 {
-    if (!disk_mounted)
-    {
-        return E_DISK_NOT_MOUNTED;
-    }
+    return submit_async(fs, inode_num, data, len, offset, false, reqp);
+}
+
+int fs_write_async(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t **reqp)
+{
+    return submit_async(fs, inode_num, data, len, offset, true, reqp);
+}
 
-    // Start from the first data block (after superblock and inode blocks)
-    int first_data_block = 1 + superblock.num_inode_blocks;
+bool fs_aio_done(fs_aio_t *req)
+{
+    pthread_mutex_lock(&req->lock);
+    bool done = (req->pending == 0);
+    pthread_mutex_unlock(&req->lock);
+    return done;
+}
 
-    // Search for the first available block using first-available strategy
-    for (uint32_t i = (uint32_t)first_data_block; i < superblock.num_blocks; i++)
+// Waits for an async request, releases it and returns what read()/write()
+// would have returned (or the first I/O error)
+int fs_aio_wait(fs_aio_t *req)
+{
+    pthread_mutex_lock(&req->lock);
+    while (req->pending > 0)
     {
-        if (block_bitmap[i] == 0)
-        {
-            // Mark the block as used
-            block_bitmap[i] = 1;
-            return i;
-        }
+        pthread_cond_wait(&req->cond, &req->lock);
     }
+    pthread_mutex_unlock(&req->lock);
+
+    int result = (req->error != 0) ? req->error : req->result;
+    pthread_mutex_destroy(&req->lock);
+    pthread_cond_destroy(&req->cond);
+    free(req->ios);
+    free(req);
+    return result;
+}
 
-    return E_OUT_OF_SPACE; // No free blocks available
+
+/*************************/
+/* Single-image API      */
+/*************************/
+
+// Same calls on the default instance, for programs serving one image
+
+int format(char *disk_name, int inodes)
+{
+    return fs_format(disk_name, inodes, NULL);
 }
 
-// Helper function to mark a block as free
-static void free_block(int block_num)
+int fs_mount(char *disk_name, const fs_options_t *opts)
 {
-    if (disk_mounted && block_num > 0 && (uint32_t)block_num < superblock.num_blocks)
-    {
-        // Mark the block as free in the bitmap
-        block_bitmap[block_num] = 0;
-    }
+    pthread_rwlock_wrlock(&default_fs.lock);
+    int result = mount_locked(&default_fs, disk_name, opts);
+    pthread_rwlock_unlock(&default_fs.lock);
+    return result;
 }
 
-// Helper function to get block # for a specific file offset
-static int get_block_for_offset(inode_t *inode, int offset, bool allocate)
+int mount(char *disk_name)
+{
+    return fs_mount(disk_name, NULL);
+}
+
+int unmount(void)
+{
+    pthread_rwlock_wrlock(&default_fs.lock);
+    int result = unmount_locked(&default_fs);
+    pthread_rwlock_unlock(&default_fs.lock);
+    return result;
+}
+
+FS *fs_default(void)
+{
+    return &default_fs;
+}
+
+int create(void)
+{
+    return fs_create(&default_fs);
+}
+
+int delete(int inode_num)
+{
+    return fs_delete(&default_fs, inode_num);
+}
+
+int64_t stat(int inode_num)
 {
-    if (!disk_mounted)
+    return fs_stat(&default_fs, inode_num);
+}
+
+int read(int inode_num, uint8_t *data, int len, int64_t offset)
+{
+    return fs_read(&default_fs, inode_num, data, len, offset);
+}
+
+int write(int inode_num, uint8_t *data, int len, int64_t offset)
+{
+    return fs_write(&default_fs, inode_num, data, len, offset);
+}
+
+
+/*************************/
+/* Helper functions      */
+/*************************/
+
+// Helper function doing the actual write (blocks allocated right away)
+static int write_data(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t *aio)
+{
+    // 1. Check for disk mounted
+    if (!fs->disk_mounted)
     {
         return E_DISK_NOT_MOUNTED;
     }
-    if (offset < 0)
+
+    // 2. Check if inode # is valid
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
     {
-        return E_INVALID_OFFSET;
+        return E_INVALID_INODE;
     }
 
-    // Calculate which block this offset falls into
-    int block_index = offset / BLOCK_SIZE;
-
-    // Direct blocks (0-3)
-    if (block_index < 4)
+    // 3. Read the inode
+    inode_t inode;
+    int result = read_inode(fs, inode_num, &inode, false);
+    if (result != 0)
     {
-        if (inode->direct_blocks[block_index] == 0 && allocate)
-        {
-            // Need to allocate a new block
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block; // Error finding free block
-            }
-
-            // Init the new block with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+        return result;
+    }
 
-            inode->direct_blocks[block_index] = new_block;
-        }
-        return inode->direct_blocks[block_index];
+    // 4. Check if inode is allocated/valid
+    if (inode.valid == 0)
+    {
+        return E_INVALID_INODE;
     }
 
-    // Indirect blocks (4-259)
-    block_index -= 4;
-    if ((uint32_t)block_index < POINTERS_PER_BLOCK)
+    // 5. Inline file: stays in the inode as long as it fits, otherwise its
+    //    contents move to a block and it is written like any other file
+    if (inode.flags & INODE_INLINE)
     {
-        // Check if we have an indirect block
-        if (inode->indirect_block == 0)
+        if ((uint64_t)offset + len <= fs->inline_capacity)
         {
-            if (!allocate)
-            {
-                return 0; // No block and not allocating
-            }
-
-            // Allocate new indirect block
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block;
-            }
-
-            // Init with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
-
-            inode->indirect_block = new_block;
+            return write_inline(fs, inode_num, &inode, data, len, offset);
         }
-
-        // Read the indirect block
-        uint8_t indirect_block[BLOCK_SIZE];
-        int result = vdisk_read(&disk, inode->indirect_block, indirect_block);
+        result = spill_inline(fs, inode_num, &inode);
         if (result != 0)
         {
             return result;
         }
+    }
 
-        uint32_t *pointers = (uint32_t *)indirect_block;
-
-        // Check if we need to allocate a new data block
-        if (pointers[block_index] == 0 && allocate)
+    // 6. If offset beyond curr file size, leave a hole: the blocks in
+    //    between are not allocated and read back as 0s (the size only grows
+    //    to the end of what gets written, so a failed write leaves it as is)
+    if ((uint64_t)offset > get_size(&inode))
+    {
+        // Blocks already mapped past the old size (end of the last block,
+        // leftovers of a failed write) now fall w/in the file -> clear them
+        for (uint64_t curr_offset = get_size(&inode); curr_offset < (uint64_t)offset; )
         {
-            int new_block = find_free_block();
-            if (new_block < 0)
+            int block_offset = curr_offset % fs->block_size;
+            int block_num = get_block_for_offset(fs, &inode, curr_offset, false);
+            if (block_num <= 0)
             {
-                return new_block;
+                break; // nothing mapped from here on
             }
 
-            // Init with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
+            uint8_t block[fs->block_size];
+            memset(block, 0, fs->block_size);
+            if (block_offset > 0)
             {
-                free_block(new_block);
-                return result;
+                result = cache_read(&fs->cache, block_num, block);
+                if (result != 0)
+                {
+                    return result;
+                }
+                memset(block + block_offset, 0, fs->block_size - block_offset);
             }
 
-            pointers[block_index] = new_block;
-
-            // Write the updated indirect block back
-            result = vdisk_write(&disk, inode->indirect_block, indirect_block);
+            result = cache_write(&fs->cache, block_num, block);
             if (result != 0)
             {
-                free_block(new_block);
                 return result;
             }
-        }
 
-        return pointers[block_index];
+            curr_offset += fs->block_size - block_offset;
+        }
     }
 
-    // Double indirect blocks (260+)
-    block_index -= POINTERS_PER_BLOCK;
-    if ((uint32_t)block_index < (uint32_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+    // 7. Write data from user buffer
+    int bytes_written = 0;
+    int64_t current_offset = offset;
+
+    while (bytes_written < len)
     {
-        // Check if we have a double indirect block
-        if (inode->double_indirect_block == 0)
+        // Get block idx and offset w/in the block
+        int block_offset = current_offset % fs->block_size;
+        int block_num = get_block_for_offset(fs, &inode, current_offset, true); // pass allocate=true for potential new block
+
+        // If error getting/allocating the block
+        if (block_num <= 0)
         {
-            if (!allocate)
+            // Update inode size to reflect changes so far
+            if (bytes_written > 0 && (uint64_t)current_offset > get_size(&inode))
             {
-                return 0; // No block and not allocating
+                set_size(&inode, current_offset);
             }
+            write_inode(fs, inode_num, &inode); // size and/or block pointers changed
+            return (bytes_written > 0) ? bytes_written : block_num;
+        }
 
-            // Allocate new double indirect block
-            int new_block = find_free_block();
-            if (new_block < 0)
+        // Whole blocks: map (allocating as needed) the blocks that follow and
+        // write the physically contiguous run straight from the user buffer
+        uint32_t run_length = contiguous_run(fs, &inode, NULL, block_num, current_offset, len - bytes_written, true);
+        if (run_length > 1)
+        {
+            if (aio != NULL)
             {
-                return new_block;
+                cache_update(&fs->cache, block_num, run_length, data + bytes_written);
+                result = aio_queue(aio, block_num, run_length, data + bytes_written, true);
+            }
+            else
+            {
+                result = cache_write_range(&fs->cache, block_num, run_length, data + bytes_written);
             }
-
-            // Init with 0s
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
             if (result != 0)
             {
-                free_block(new_block);
+                // If some data was already written, update size and rtn count
+                if (bytes_written > 0)
+                {
+                    if ((uint64_t)current_offset > get_size(&inode))
+                    {
+                        set_size(&inode, current_offset);
+                    }
+                    write_inode(fs, inode_num, &inode); // size and/or block pointers changed
+                    return bytes_written;
+                }
                 return result;
             }
-
-            inode->double_indirect_block = new_block;
+            bytes_written += run_length * fs->block_size;
+            current_offset += run_length * fs->block_size;
+            continue;
         }
 
-        // Read the double indirect block
-        uint8_t double_indirect_block[BLOCK_SIZE];
-        int result = vdisk_read(&disk, inode->double_indirect_block, double_indirect_block);
-        if (result != 0)
+        // Get how many bytes to write to this block
+        int bytes_to_write = fs->block_size - block_offset;
+        if (bytes_to_write > (len - bytes_written))
         {
-            return result;
+            bytes_to_write = len - bytes_written;
         }
 
-        uint32_t *pointers = (uint32_t *)double_indirect_block;
-
-        // Calculate which indirect block and entry within that block
-        int indirect_index = block_index / POINTERS_PER_BLOCK;
-        int entry_index = block_index % POINTERS_PER_BLOCK;
-
-        // Check if we need to allocate a new indirect block
-        if (pointers[indirect_index] == 0 && allocate)
+        // If not writing a full block or starting from the beginning of a block,
+        // => then need to read the existing block to preserve data
+        uint8_t block[fs->block_size];
+        if (block_offset > 0 || bytes_to_write < (int)fs->block_size)
         {
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block;
-            }
-
-            // Init with zeros
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            int result = vdisk_write(&disk, new_block, zeros);
+            result = cache_read(&fs->cache, block_num, block);
             if (result != 0)
             {
-                free_block(new_block);
+                // If some data was already written, update size and rtn count
+                if (bytes_written > 0)
+                {
+                    if ((uint64_t)current_offset > get_size(&inode))
+                    {
+                        set_size(&inode, current_offset);
+                    }
+                    write_inode(fs, inode_num, &inode); // size and/or block pointers changed
+                    return bytes_written;
+                }
                 return result;
             }
+        }
 
-            pointers[indirect_index] = new_block;
+        // Copy data from user buffer to block
+        memcpy(block + block_offset, data + bytes_written, bytes_to_write);
 
-            // Write the updated double indirect block back
-            result = vdisk_write(&disk, inode->double_indirect_block, double_indirect_block);
-            if (result != 0)
+        // Write block back to disk
+        result = cache_write(&fs->cache, block_num, block);
+        if (result != 0)
+        {
+            // If some data was already written, update size and rtn count
+            if (bytes_written > 0)
             {
-                free_block(new_block);
-                return result;
+                if ((uint64_t)current_offset > get_size(&inode))
+                {
+                    set_size(&inode, current_offset);
+                }
+                write_inode(fs, inode_num, &inode); // size and/or block pointers changed
+                return bytes_written;
             }
-        }
-        else if (pointers[indirect_index] == 0)
-        {
-            return 0; // No block and not allocating
+            return result;
         }
 
-        // Read the indirect block
-        uint8_t indirect_block[BLOCK_SIZE];
-        result = vdisk_read(&disk, pointers[indirect_index], indirect_block);
+        // Update counters
+        bytes_written += bytes_to_write;
+        current_offset += bytes_to_write;
+    }
+
+    // 8. Update inode size if the write extended the file, and write the
+    //    inode back if that or a block allocated in a hole changed it
+    if ((uint64_t)current_offset > get_size(&inode))
+    {
+        set_size(&inode, current_offset);
+    }
+    if (memcmp(&inode, inode_at(fs, inode_num), fs->inode_bytes) != 0)
+    {
+        result = write_inode(fs, inode_num, &inode);
         if (result != 0)
         {
-            return result;
+            // Even writing inode fails, we have written data,
+            // so return count of bytes written so far
+            return bytes_written;
         }
+    }
 
-        uint32_t *sub_pointers = (uint32_t *)indirect_block;
+    return bytes_written;
+}
 
-        // Check if we need to allocate a new data block
-        if (sub_pointers[entry_index] == 0 && allocate)
+// Helper function to write an inode's buffered appends to disk
+// -> `whole_blocks_only`: stop at the last block boundary and keep the
+//    partial tail block buffered so it isn't rewritten on the next flush
+static int flush_append(FS *fs, int inode_num, bool whole_blocks_only)
+{
+    append_buffer_t *pending = &fs->appends[inode_num];
+    if (pending->length == 0)
+    {
+        return 0;
+    }
+
+    inode_t inode;
+    int result = read_inode(fs, inode_num, &inode, false);
+    if (result != 0)
+    {
+        return result;
+    }
+    uint64_t start = get_size(&inode);
+    uint32_t length = pending->length;
+    if (whole_blocks_only)
+    {
+        uint64_t end = ((start + length) / fs->block_size) * fs->block_size;
+        length = (end > start) ? end - start : 0;
+        if (length == 0)
         {
-            int new_block = find_free_block();
-            if (new_block < 0)
-            {
-                return new_block;
-            }
+            return 0;
+        }
+    }
 
-            // Init with zeros
-            uint8_t zeros[BLOCK_SIZE] = {0};
-            result = vdisk_write(&disk, new_block, zeros);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+    // (the blocks come out of the buffer's reservation)
+    home_reserve = &pending->reserved;
+    int written = write_data(fs, inode_num, pending->data, length, start, NULL);
+    home_reserve = NULL;
+    if (written < 0)
+    {
+        return written;
+    }
+
+    // Keep whatever was not written (tail or short write) at the front
+    pending->length -= written;
+    memmove(pending->data, pending->data + written, pending->length);
+    if (pending->length == 0 && !whole_blocks_only)
+    {
+        drop_append(fs, inode_num);
+    }
 
-            sub_pointers[entry_index] = new_block;
+    return ((uint32_t)written == length) ? 0 : E_OUT_OF_SPACE;
+}
 
-            // Write the updated indirect block back
-            result = vdisk_write(&disk, pointers[indirect_index], indirect_block);
-            if (result != 0)
-            {
-                free_block(new_block);
-                return result;
-            }
+// Helper function to flush the append buffers of all files
+static int flush_appends(FS *fs)
+{
+    int first_error = 0;
+    for (uint32_t i = 0; i < fs->superblock.num_inode_blocks * fs->inodes_per_block; i++)
+    {
+        pthread_rwlock_wrlock(&fs->inode_locks[i]);
+        journal_begin(fs);
+        int result = flush_append(fs, i, false);
+        journal_end(fs);
+        pthread_rwlock_unlock(&fs->inode_locks[i]);
+        if (result != 0 && first_error == 0)
+        {
+            first_error = result;
         }
-
-        return sub_pointers[entry_index];
     }
+    return first_error;
+}
 
-    return E_INVALID_OFFSET; // Offset too large for this file system
+// Helper function to discard an append buffer
+static void drop_append(FS *fs, int inode_num)
+{
+    free(fs->appends[inode_num].data);
+    fs->appends[inode_num].data = NULL;
+    fs->appends[inode_num].length = 0;
+    give_blocks(fs, fs->appends[inode_num].reserved);
+    fs->appends[inode_num].reserved = 0;
+}
+
+// Helper function to read an inode from disk
+// bypass_mount_check: if true, skip the mounted disk check (used only during mount operation)
+static int read_inode(FS *fs, int inode_num, inode_t *inode, bool bypass_mount_check)
+{
+    if (!fs->disk_mounted && !bypass_mount_check)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
+    {
+        return E_INVALID_INODE;
+    }
+
+    // Copy inode data from the resident table
+    memset(inode, 0, sizeof(inode_t));
+    memcpy(inode, inode_at(fs, inode_num), fs->inode_bytes);
+
+    return 0;
+}
+
+// Helper function to write an inode to disk
+static int write_inode(FS *fs, int inode_num, inode_t *inode)
+{
+    if (!fs->disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->superblock.num_inode_blocks * fs->inodes_per_block)
+    {
+        return E_INVALID_INODE;
+    }
+
+    // Update the resident table and the free-inode index
+    pthread_mutex_lock(&fs->inode_table_lock);
+    memcpy(inode_at(fs, inode_num), inode, fs->inode_bytes);
+    if (inode->valid)
+    {
+        bitmap_set(&fs->inode_bitmap, inode_num);
+    }
+    else
+    {
+        bitmap_clear(&fs->inode_bitmap, inode_num);
+        pthread_mutex_lock(&fs->cursor_lock);
+        memset(&fs->cursors[inode_num], 0, sizeof(file_cursor_t)); // its blocks are gone
+        pthread_mutex_unlock(&fs->cursor_lock);
+        // Keep create() handing out the lowest free inode:
+        // every inode below the hint is in use
+        if ((uint32_t)inode_num < fs->inode_bitmap.hint)
+        {
+            fs->inode_bitmap.hint = inode_num;
+        }
+    }
+
+    // Write through the block containing the inode
+    // -> calculate block #, +1 because block 0 is superblock
+    int block_num = 1 + (inode_num / fs->inodes_per_block);
+    uint8_t *first = fs->inode_table + (size_t)(block_num - 1) * fs->block_size;
+    int result = meta_write(fs, block_num, first);
+    pthread_mutex_unlock(&fs->inode_table_lock);
+    return result;
+}
+
+// Helper function to find a free block
+// -> next-fit: the search resumes right after the last allocated block
+static int find_free_block(FS *fs)
+{
+    if (!fs->disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+
+    // Superblock and inode blocks are marked as used at mount time,
+    // so whatever the bitmap finds is a data block
+    uint32_t granted;
+    return find_free_run(fs, 0, 1, &granted);
+}
+
+// Helper function to mark a block as free
+static void free_block(FS *fs, int block_num)
+{
+    if (fs->disk_mounted && block_num > 0 && (uint32_t)block_num < fs->superblock.num_blocks)
+    {
+        // Journaled: still in use until the transaction freeing it commits
+        if (journal_free(fs, block_num))
+        {
+            return;
+        }
+
+        // Mark the block as free in the bitmap
+        alloc_shard_t *shard = shard_of(fs, block_num);
+        pthread_mutex_lock(&shard->lock);
+        uint32_t num_free = shard->map.num_free;
+        bitmap_clear(&shard->map, block_num - shard->first_block);
+        num_free = shard->map.num_free - num_free; // 0 if it was free already
+        pthread_mutex_unlock(&shard->lock);
+        give_blocks(fs, num_free);
+    }
+}
+
+// Helper function to get the first block after the fs metadata
+static uint32_t first_data_block(FS *fs)
+{
+    uint32_t journal_blocks = uses_journal(fs) ? fs->superblock.num_journal_blocks : 0;
+    return 1 + fs->superblock.num_inode_blocks + fs->superblock.num_bitmap_blocks + journal_blocks;
+}
+
+// Helper function to write the in-memory superblock back to block 0
+static int write_superblock(FS *fs)
+{
+    uint8_t block[fs->block_size];
+    memset(block, 0, fs->block_size);
+    memcpy(block, &fs->superblock, sizeof(superblock_t));
+    return meta_write(fs, 0, block);
+}
+
+// Helper function to load the on-disk allocation bitmap
+// -> only trusted if the fs was cleanly unmounted (see mount)
+static int load_bitmap(FS *fs)
+{
+    if (fs->superblock.num_bitmap_blocks * fs->bits_per_block < fs->superblock.num_blocks ||
+        fs->superblock.bitmap_start + fs->superblock.num_bitmap_blocks > fs->superblock.num_blocks)
+    {
+        return E_CORRUPT_DISK;
+    }
+
+    uint8_t *raw = (uint8_t *)malloc((size_t)fs->superblock.num_bitmap_blocks * fs->block_size);
+    if (raw == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    int result = cache_read_range(&fs->cache, fs->superblock.bitmap_start, fs->superblock.num_bitmap_blocks, raw);
+    if (result == 0)
+    {
+        for (uint32_t i = 0; i < fs->num_shards; i++)
+        {
+            BITMAP *map = &fs->shards[i].map;
+            memcpy(map->words, raw + fs->shards[i].first_block / 8, (size_t)map->num_words * sizeof(uint64_t));
+            bitmap_refresh(map);
+        }
+    }
+
+    free(raw);
+    return result;
+}
+
+// Helper function to write the allocation bitmap to its on-disk region
+static int store_bitmap(FS *fs)
+{
+    size_t length = (size_t)fs->superblock.num_bitmap_blocks * fs->block_size;
+    uint8_t *raw = (uint8_t *)calloc(length, 1);
+    if (raw == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    for (uint32_t i = 0; i < fs->num_shards; i++)
+    {
+        const BITMAP *map = &fs->shards[i].map;
+        memcpy(raw + fs->shards[i].first_block / 8, map->words, (size_t)map->num_words * sizeof(uint64_t));
+    }
+    int result = cache_write_range(&fs->cache, fs->superblock.bitmap_start, fs->superblock.num_bitmap_blocks, raw);
+
+    free(raw);
+    return result;
+}
+
+// Helper function to load all inodes into the resident table
+// -> also indexes the free ones so create() doesn't have to scan
+static int load_inodes(FS *fs)
+{
+    uint32_t num_inodes = fs->superblock.num_inode_blocks * fs->inodes_per_block;
+    if (fs->superblock.num_inode_blocks == 0 || fs->superblock.num_inode_blocks >= fs->superblock.num_blocks)
+    {
+        return E_CORRUPT_DISK;
+    }
+
+    fs->inode_table = (uint8_t *)malloc((size_t)fs->superblock.num_inode_blocks * fs->block_size);
+    fs->cursors = (file_cursor_t *)calloc(num_inodes, sizeof(file_cursor_t));
+    fs->appends = (append_buffer_t *)calloc(num_inodes, sizeof(append_buffer_t));
+    fs->inode_locks = (pthread_rwlock_t *)malloc(num_inodes * sizeof(pthread_rwlock_t));
+    if (fs->inode_table == NULL || fs->cursors == NULL || fs->appends == NULL || fs->inode_locks == NULL)
+    {
+        drop_inodes(fs);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    for (fs->num_inode_locks = 0; fs->num_inode_locks < num_inodes; fs->num_inode_locks++)
+    {
+        pthread_rwlock_init(&fs->inode_locks[fs->num_inode_locks], NULL);
+    }
+
+    int result = cache_read_range(&fs->cache, 1, fs->superblock.num_inode_blocks, fs->inode_table);
+    if (result == 0)
+    {
+        result = bitmap_init(&fs->inode_bitmap, num_inodes);
+    }
+    if (result != 0)
+    {
+        drop_inodes(fs);
+        return result;
+    }
+
+    for (uint32_t i = 0; i < num_inodes; i++)
+    {
+        if (inode_at(fs, i)->valid)
+        {
+            bitmap_set(&fs->inode_bitmap, i);
+        }
+    }
+
+    return 0;
+}
+
+// Helper function to release the inode table, its index & the per-file state
+// NB: buffered appends are dropped, flush_appends() first to keep them
+static void drop_inodes(FS *fs)
+{
+    if (fs->appends != NULL)
+    {
+        for (uint32_t i = 0; i < fs->inode_bitmap.num_bits; i++)
+        {
+            free(fs->appends[i].data);
+        }
+    }
+
+    for (uint32_t i = 0; i < fs->num_inode_locks; i++)
+    {
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    }
+    fs->num_inode_locks = 0;
+
+    bitmap_destroy(&fs->inode_bitmap);
+    free(fs->inode_locks);
+    free(fs->inode_table);
+    free(fs->cursors);
+    free(fs->appends);
+    fs->inode_table = NULL;
+    fs->cursors = NULL;
+    fs->appends = NULL;
+    fs->inode_locks = NULL;
+}
+
+// Helper function to locate an inode in the resident table
+// -> only the first fs->inode_bytes are an inode_t (see read_inode)
+static inode_t *inode_at(FS *fs, uint32_t inode_num)
+{
+    return (inode_t *)(fs->inode_table + (size_t)inode_num * fs->inode_size);
+}
+
+// Helper function to derive the layout from the superblock's block & inode
+// sizes, and address the disk in blocks of that size
+// -> images formatted before the sizes could be chosen read as 0: 1 KiB
+//    blocks of 32-byte inodes
+static int init_geometry(FS *fs)
+{
+    uint32_t block_size = fs->superblock.block_size ? fs->superblock.block_size : FS_DEFAULT_BLOCK_SIZE;
+    uint32_t inode_size = fs->superblock.inode_size ? fs->superblock.inode_size : INODE_SIZE;
+    if (block_size < FS_MIN_BLOCK_SIZE || block_size > FS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 ||
+        inode_size < INODE_SIZE || inode_size > block_size || (inode_size & (inode_size - 1)) != 0)
+    {
+        return E_CORRUPT_DISK;
+    }
+
+    int result = vdisk_set_sector_size(&fs->disk, block_size);
+    if (result != 0)
+    {
+        return result;
+    }
+    if (fs->disk.size_in_sectors < fs->superblock.num_blocks)
+    {
+        return E_CORRUPT_DISK; // image truncated since it was formatted
+    }
+
+    fs->zero_block = (uint8_t *)calloc(1, block_size);
+    if (fs->zero_block == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    fs->block_size = block_size;
+    fs->inode_size = inode_size;
+    fs->inodes_per_block = block_size / inode_size;
+    fs->pointers_per_block = block_size / sizeof(uint32_t);
+    fs->bits_per_block = block_size * 8;
+    fs->max_extents = INLINE_EXTENTS + block_size / sizeof(extent_t);
+
+    // Largest file: as many blocks as the block map can reach (block #s
+    // w/in a file are 32-bit), and a size the inode can hold
+    uint64_t pointers = fs->pointers_per_block;
+    uint64_t max_blocks = 4 + pointers + pointers * pointers;
+    uint64_t max_size = UINT32_MAX;
+    fs->inode_bytes = INODE_SIZE;
+    if (uses_large_files(fs))
+    {
+        if (inode_size < LARGE_INODE_SIZE)
+        {
+            drop_geometry(fs);
+            return E_CORRUPT_DISK;
+        }
+        max_blocks += pointers * pointers * pointers;
+        max_size = UINT64_MAX;
+        fs->inode_bytes = sizeof(inode_t);
+    }
+    if (uses_extents(fs) || max_blocks > UINT32_MAX)
+    {
+        max_blocks = UINT32_MAX;
+    }
+    fs->max_file_size = max_blocks * block_size;
+    if (fs->max_file_size > max_size)
+    {
+        fs->max_file_size = max_size;
+    }
+
+    // Inline files: the block map bytes, then the spare end of the inode
+    fs->inline_capacity = 0;
+    if (uses_inline_data(fs))
+    {
+        fs->inline_capacity = INLINE_DATA_BYTES + inode_size - fs->inode_bytes;
+    }
+    return 0;
+}
+
+// Helper function to release what init_geometry allocated
+static void drop_geometry(FS *fs)
+{
+    free(fs->zero_block);
+    fs->zero_block = NULL;
+}
+
+// Helper function to rebuild the allocation bitmap from scratch
+// -> scans all inodes to mark data blocks as used if allocated
+static int scan_blocks(FS *fs)
+{
+    int result;
+
+    // Mark superblock, inode & bitmap blocks as used
+    for (uint32_t i = 0; i < first_data_block(fs); i++)
+    {
+        block_set(fs, i);
+    }
+
+    // Scan all inodes to mark data blocks as used if allocated
+    for (uint32_t i = 0; i < fs->superblock.num_inode_blocks * fs->inodes_per_block; i++)
+    {
+        inode_t inode;
+        result = read_inode(fs, i, &inode, true);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        // Inline file: no blocks
+        if (inode.flags & INODE_INLINE)
+        {
+            continue;
+        }
+
+        // Extent format: mark every extent and the block holding the extra ones
+        if (inode.valid && uses_extents(fs))
+        {
+            if (inode.extent_block != 0)
+            {
+                block_set(fs, inode.extent_block);
+            }
+
+            for (uint32_t j = 0; j < inode.extent_count; j++)
+            {
+                extent_t extent;
+                result = read_extent(fs, &inode, j, &extent);
+                if (result != 0)
+                {
+                    return result;
+                }
+
+                for (uint32_t k = 0; extent.start != 0 && k < extent.length; k++)
+                {
+                    block_set(fs, extent.start + k);
+                }
+            }
+            continue;
+        }
+
+        if (inode.valid)
+        {
+            // Mark direct blocks
+            for (int j = 0; j < 4; j++)
+            {
+                if (inode.direct_blocks[j] != 0)
+                {
+                    block_set(fs, inode.direct_blocks[j]);
+                }
+            }
+
+            // Mark indirect block
+            if (inode.indirect_block != 0)
+            {
+                block_set(fs, inode.indirect_block);
+
+                uint8_t indirect_block[fs->block_size];
+                result = meta_read(fs, inode.indirect_block, indirect_block);
+                if (result != 0)
+                {
+                    return result;
+                }
+
+                // Set non-zero entries in indirect block as used
+                uint32_t *pointers = (uint32_t *)indirect_block;
+                for (uint32_t k = 0; k < fs->pointers_per_block; k++)
+                {
+                    if (pointers[k] != 0)
+                    {
+                        block_set(fs, pointers[k]);
+                    }
+                }
+            }
+
+            // Mark double indirect block
+            if (inode.double_indirect_block != 0)
+            {
+                block_set(fs, inode.double_indirect_block);
+
+                uint8_t double_indirect_block[fs->block_size];
+                result = meta_read(fs, inode.double_indirect_block, double_indirect_block);
+                if (result != 0)
+                {
+                    return result;
+                }
+
+                // Process pointer in the double indirect block
+                uint32_t *indirect_pointers = (uint32_t *)double_indirect_block;
+                for (uint32_t j = 0; j < fs->pointers_per_block; j++)
+                {
+                    if (indirect_pointers[j] != 0)
+                    {
+                        // Mark indir block as used
+                        block_set(fs, indirect_pointers[j]);
+
+                        uint8_t curr_indirect_block[fs->block_size];
+                        result = meta_read(fs, indirect_pointers[j], curr_indirect_block);
+                        if (result != 0)
+                        {
+                            return result;
+                        }
+
+                        // Set non-zero entries in this indirect block
+                        uint32_t *data_pointers = (uint32_t *)curr_indirect_block;
+                        for (uint32_t k = 0; k < fs->pointers_per_block; k++)
+                        {
+                            if (data_pointers[k] != 0)
+                            {
+                                block_set(fs, data_pointers[k]);
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Mark triple indirect block and the 2 levels below it
+            if (inode.triple_indirect_block != 0)
+            {
+                result = mark_pointer_tree(fs, inode.triple_indirect_block, 3);
+                if (result != 0)
+                {
+                    return result;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Helper function to count how many whole blocks, starting with `block_num`
+// (mapped at `offset`), are physically contiguous on disk
+// -> at most `bytes_left` / block size, and 1 if `offset` is not block-aligned
+// -> `cursor` (read-only lookups, may be NULL) speeds up the block mapping
+static uint32_t contiguous_run(FS *fs, inode_t *inode, file_cursor_t *cursor, int block_num, int64_t offset, int bytes_left, bool allocate)
+{
+    if (offset % fs->block_size != 0)
+    {
+        return 1;
+    }
+
+    // Extent format: the run is whatever is left of the extent, grown in
+    // one go (as far as the allocator allows) when it ends the file
+    if (uses_extents(fs))
+    {
+        uint32_t want = bytes_left / fs->block_size;
+        uint32_t block_index = offset / fs->block_size;
+        uint32_t mapped, run_left;
+        if (want <= 1 || map_extent(fs, inode, block_index, &mapped, &run_left) != 0 || mapped != (uint32_t)block_num)
+        {
+            return 1;
+        }
+
+        uint32_t run_length = (run_left < want) ? run_left : want;
+        if (allocate && run_length < want)
+        {
+            uint32_t next_block, next_left;
+            if (map_extent(fs, inode, block_index + run_length, &next_block, &next_left) == 0 && next_left == 0 &&
+                extent_append(fs, inode, want - run_length, false) > 0)
+            {
+                map_extent(fs, inode, block_index, &mapped, &run_left);
+                run_length = (run_left < want) ? run_left : want;
+            }
+        }
+        return run_length;
+    }
+
+    uint32_t run_length = 1;
+    while ((int)((run_length + 1) * fs->block_size) <= bytes_left)
+    {
+        int64_t next_offset = offset + (int64_t)run_length * fs->block_size;
+        int next_block = (cursor != NULL) ? cursor_block_for_offset(fs, cursor, inode, next_offset)
+                                          : get_block_for_offset(fs, inode, next_offset, allocate);
+        if (next_block != block_num + (int)run_length)
+        {
+            break;
+        }
+        run_length++;
+    }
+    return run_length;
+}
+
+// Helper function to read a single entry of a pointer block
+// -> avoids copying the whole block when the cache/disk can hand out a pointer
+static int read_pointer(FS *fs, uint32_t block_num, uint32_t index, uint32_t *pointer)
+{
+    count_add(&fs->stats.pointer_lookups, 1);
+    if (journal_lookup(fs, block_num, index * sizeof(uint32_t), sizeof(uint32_t), (uint8_t *)pointer))
+    {
+        return 0; // changed since the last commit
+    }
+
+    const uint8_t *block = cache_peek(&fs->cache, block_num);
+    if (block != NULL)
+    {
+        memcpy(pointer, block + index * sizeof(uint32_t), sizeof(uint32_t));
+        return 0;
+    }
+
+    uint8_t block_copy[fs->block_size];
+    int result = cache_read(&fs->cache, block_num, block_copy);
+    if (result != 0)
+    {
+        return result;
+    }
+    memcpy(pointer, block_copy + index * sizeof(uint32_t), sizeof(uint32_t));
+    return 0;
+}
+
+// Helper function to update a single entry of a pointer block
+static int write_pointer(FS *fs, uint32_t block_num, uint32_t index, uint32_t pointer)
+{
+    uint8_t block[fs->block_size];
+    int result = meta_read(fs, block_num, block);
+    if (result != 0)
+    {
+        return result;
+    }
+    memcpy(block + index * sizeof(uint32_t), &pointer, sizeof(uint32_t));
+    return meta_write(fs, block_num, block);
+}
+
+// Helper function to get block # for a file offset without allocating
+// -> remembers the last pointer block it went through, so streaming a file
+//    only walks the upper levels once per fs->pointers_per_block blocks
+static int cursor_block_for_offset(FS *fs, file_cursor_t *cursor, inode_t *inode, int64_t offset)
+{
+    // Direct blocks & extents: nothing worth remembering
+    if (uses_extents(fs) || offset < 0 || (uint64_t)offset / fs->block_size < 4 ||
+        (uint64_t)offset / fs->block_size > UINT32_MAX)
+    {
+        return get_block_for_offset(fs, inode, offset, false);
+    }
+    uint32_t block_index = offset / fs->block_size;
+
+    // Not covered by the remembered pointer block -> resolve it
+    if (cursor->map_block == 0 || block_index - cursor->map_first >= fs->pointers_per_block)
+    {
+        uint32_t first, pointer_block;
+        if (block_index < 4 + fs->pointers_per_block)
+        {
+            first = 4;
+            pointer_block = inode->indirect_block;
+        }
+        else if (block_index - 4 - fs->pointers_per_block < fs->pointers_per_block * fs->pointers_per_block)
+        {
+            uint32_t index = block_index - 4 - fs->pointers_per_block;
+            if (inode->double_indirect_block == 0)
+            {
+                return 0; // No block
+            }
+
+            first = 4 + fs->pointers_per_block + (index / fs->pointers_per_block) * fs->pointers_per_block;
+            int result = read_pointer(fs, inode->double_indirect_block, index / fs->pointers_per_block, &pointer_block);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+        else
+        {
+            // Triple indirect: 2 levels above the pointer block
+            uint32_t per_double = fs->pointers_per_block * fs->pointers_per_block;
+            uint32_t index = block_index - 4 - fs->pointers_per_block - per_double;
+            if (!uses_large_files(fs) || index / per_double >= fs->pointers_per_block || inode->triple_indirect_block == 0)
+            {
+                return get_block_for_offset(fs, inode, offset, false);
+            }
+
+            first = block_index - index % fs->pointers_per_block;
+            uint32_t double_block;
+            int result = read_pointer(fs, inode->triple_indirect_block, index / per_double, &double_block);
+            if (result != 0 || double_block == 0)
+            {
+                return result; // Error or no block
+            }
+            result = read_pointer(fs, double_block, (index / fs->pointers_per_block) % fs->pointers_per_block, &pointer_block);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+
+        if (pointer_block == 0)
+        {
+            return 0; // No block
+        }
+        cursor->map_first = first;
+        cursor->map_block = pointer_block;
+    }
+
+    uint32_t pointer;
+    int result = read_pointer(fs, cursor->map_block, block_index - cursor->map_first, &pointer);
+    if (result != 0)
+    {
+        return result;
+    }
+    return pointer;
+}
+
+// Helper function to prefetch the blocks following a sequential read
+// -> `first_block`/`last_block`: file blocks covered by the curr read
+// -> the window starts at READAHEAD_MIN and doubles (up to readahead_max)
+//    every time the reader gets within half a window of the prefetched data
+static void readahead(FS *fs, file_cursor_t *cursor, inode_t *inode, uint32_t first_block, uint32_t last_block)
+{
+    // Nothing to prefetch into for a pass-through cache
+    if (fs->readahead_max == 0 || fs->cache.capacity == 0)
+    {
+        return;
+    }
+
+    // 1. Random access: drop the window
+    if (first_block != cursor->next_block)
+    {
+        cursor->ra_window = 0;
+        cursor->ra_next = 0;
+        return;
+    }
+
+    // 2. Enough already prefetched ahead of the reader
+    if (cursor->ra_next > last_block + cursor->ra_window / 2)
+    {
+        return;
+    }
+
+    // 3. Grow the window
+    if (cursor->ra_window == 0)
+    {
+        cursor->ra_window = (READAHEAD_MIN < fs->readahead_max) ? READAHEAD_MIN : fs->readahead_max;
+    }
+    else if (cursor->ra_window * 2 <= fs->readahead_max)
+    {
+        cursor->ra_window *= 2;
+    }
+
+    // 4. Prefetch the window (up to the end of the file), one call per
+    //    physically contiguous run
+    uint32_t start = (cursor->ra_next > last_block) ? cursor->ra_next : last_block + 1;
+    uint32_t end = last_block + 1 + cursor->ra_window;
+    uint32_t file_blocks = (get_size(inode) + fs->block_size - 1) / fs->block_size;
+    if (end > file_blocks)
+    {
+        end = file_blocks;
+    }
+
+    uint32_t run_start = 0, run_length = 0;
+    for (uint32_t i = start; i <= end; i++)
+    {
+        int block_num = (i < end) ? cursor_block_for_offset(fs, cursor, inode, (int64_t)i * fs->block_size) : 0;
+        if (block_num > 0 && run_length > 0 && (uint32_t)block_num == run_start + run_length)
+        {
+            run_length++;
+            continue;
+        }
+
+        if (run_length > 0)
+        {
+            cache_prefetch(&fs->cache, run_start, run_length); // best effort
+        }
+        run_start = (block_num > 0) ? (uint32_t)block_num : 0;
+        run_length = (block_num > 0) ? 1 : 0;
+    }
+
+    cursor->ra_next = (end > start) ? end : start;
+}
+
+// Helper function to get block # for a specific file offset
+static int get_block_for_offset(FS *fs, inode_t *inode, int64_t offset, bool allocate)
+{
+    if (!fs->disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+    if (offset < 0)
+    {
+        return E_INVALID_OFFSET;
+    }
+
+    // Extent format: look the block up in the extent list instead
+    if (uses_extents(fs))
+    {
+        return extent_block_for_offset(fs, inode, offset, allocate);
+    }
+
+    // Calculate which block this offset falls into
+    uint64_t block_index = offset / fs->block_size;
+
+    // Direct blocks (0-3)
+    if (block_index < 4)
+    {
+        if (inode->direct_blocks[block_index] == 0 && allocate)
+        {
+            // Need to allocate a new block
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block; // Error finding free block
+            }
+
+            // Init the new block with 0s
+            int result = cache_write(&fs->cache, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            inode->direct_blocks[block_index] = new_block;
+        }
+        return inode->direct_blocks[block_index];
+    }
+
+    // Indirect blocks (4-259)
+    block_index -= 4;
+    if (block_index < fs->pointers_per_block)
+    {
+        // Check if we have an indirect block
+        if (inode->indirect_block == 0)
+        {
+            if (!allocate)
+            {
+                return 0; // No block and not allocating
+            }
+
+            // Allocate new indirect block
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Init with 0s
+            int result = meta_write(fs, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            inode->indirect_block = new_block;
+        }
+
+        // Look up the entry straight in the indirect block
+        uint32_t pointer;
+        int result = read_pointer(fs, inode->indirect_block, block_index, &pointer);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        // Check if we need to allocate a new data block
+        if (pointer == 0 && allocate)
+        {
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Init with 0s
+            result = cache_write(&fs->cache, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            // Update the indirect block
+            result = write_pointer(fs, inode->indirect_block, block_index, new_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+            pointer = new_block;
+        }
+
+        return pointer;
+    }
+
+    // Double indirect blocks (260+)
+    block_index -= fs->pointers_per_block;
+    if (block_index < (uint64_t)fs->pointers_per_block * fs->pointers_per_block)
+    {
+        // Check if we have a double indirect block
+        if (inode->double_indirect_block == 0)
+        {
+            if (!allocate)
+            {
+                return 0; // No block and not allocating
+            }
+
+            // Allocate new double indirect block
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Init with 0s
+            int result = meta_write(fs, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            inode->double_indirect_block = new_block;
+        }
+
+        // Calculate which indirect block and entry within that block
+        int indirect_index = block_index / fs->pointers_per_block;
+        int entry_index = block_index % fs->pointers_per_block;
+
+        // Look up the indirect block in the double indirect block
+        uint32_t indirect_block;
+        int result = read_pointer(fs, inode->double_indirect_block, indirect_index, &indirect_block);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        // Check if we need to allocate a new indirect block
+        if (indirect_block == 0 && allocate)
+        {
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Init with zeros
+            result = meta_write(fs, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            // Update the double indirect block
+            result = write_pointer(fs, inode->double_indirect_block, indirect_index, new_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+            indirect_block = new_block;
+        }
+        else if (indirect_block == 0)
+        {
+            return 0; // No block and not allocating
+        }
+
+        // Look up the data block in the indirect block
+        uint32_t pointer;
+        result = read_pointer(fs, indirect_block, entry_index, &pointer);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        // Check if we need to allocate a new data block
+        if (pointer == 0 && allocate)
+        {
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Init with zeros
+            result = cache_write(&fs->cache, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            // Update the indirect block
+            result = write_pointer(fs, indirect_block, entry_index, new_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+            pointer = new_block;
+        }
+
+        return pointer;
+    }
+
+    // Triple indirect blocks (large files only)
+    uint64_t per_double = (uint64_t)fs->pointers_per_block * fs->pointers_per_block;
+    block_index -= per_double;
+    if (uses_large_files(fs) && block_index < per_double * fs->pointers_per_block)
+    {
+        // Check if we have a triple indirect block
+        if (inode->triple_indirect_block == 0)
+        {
+            if (!allocate)
+            {
+                return 0; // No block and not allocating
+            }
+
+            // Allocate new triple indirect block
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+
+            // Init with 0s
+            int result = meta_write(fs, new_block, fs->zero_block);
+            if (result != 0)
+            {
+                free_block(fs, new_block);
+                return result;
+            }
+
+            inode->triple_indirect_block = new_block;
+        }
+
+        // Walk down the double indirect, then the indirect block
+        int double_block = map_pointer(fs, inode->triple_indirect_block, block_index / per_double, allocate, false);
+        if (double_block <= 0)
+        {
+            return double_block; // Error or no block
+        }
+        int indirect_block = map_pointer(fs, double_block, (block_index / fs->pointers_per_block) % fs->pointers_per_block, allocate, false);
+        if (indirect_block <= 0)
+        {
+            return indirect_block; // Error or no block
+        }
+        return map_pointer(fs, indirect_block, block_index % fs->pointers_per_block, allocate, true);
+    }
+
+    return E_INVALID_OFFSET; // Offset too large for this file system
+}
+
+// Helper function to look up an entry of a pointer block
+// -> with `allocate`, a null entry gets a new block, zeroed: a `data` block
+//    or a pointer block (the latter goes through the journal)
+static int map_pointer(FS *fs, uint32_t block_num, uint32_t index, bool allocate, bool data)
+{
+    uint32_t pointer;
+    int result = read_pointer(fs, block_num, index, &pointer);
+    if (result != 0)
+    {
+        return result;
+    }
+    if (pointer != 0 || !allocate)
+    {
+        return pointer;
+    }
+
+    int new_block = find_free_block(fs);
+    if (new_block < 0)
+    {
+        return new_block;
+    }
+    result = data ? cache_write(&fs->cache, new_block, fs->zero_block) : meta_write(fs, new_block, fs->zero_block);
+    if (result == 0)
+    {
+        result = write_pointer(fs, block_num, index, new_block);
+    }
+    if (result != 0)
+    {
+        free_block(fs, new_block);
+        return result;
+    }
+    return new_block;
+}
+
+// Helper function to free a pointer block and every block below it
+// -> `depth`: 1 for an indirect block (its entries are data blocks), 2 for
+//    a double indirect one, 3 for a triple indirect one
+static int free_pointer_tree(FS *fs, uint32_t block_num, uint32_t depth)
+{
+    uint8_t block[fs->block_size];
+    int result = meta_read(fs, block_num, block);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    uint32_t *pointers = (uint32_t *)block;
+    for (uint32_t i = 0; i < fs->pointers_per_block; i++)
+    {
+        if (pointers[i] != 0 && depth > 1)
+        {
+            result = free_pointer_tree(fs, pointers[i], depth - 1);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+        else if (pointers[i] != 0)
+        {
+            free_block(fs, pointers[i]);
+        }
+    }
+
+    free_block(fs, block_num);
+    return 0;
+}
+
+// Helper function to mark a pointer block and every block below it as
+// used (see free_pointer_tree for `depth`)
+static int mark_pointer_tree(FS *fs, uint32_t block_num, uint32_t depth)
+{
+    block_set(fs, block_num);
+
+    uint8_t block[fs->block_size];
+    int result = meta_read(fs, block_num, block);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    uint32_t *pointers = (uint32_t *)block;
+    for (uint32_t i = 0; i < fs->pointers_per_block; i++)
+    {
+        if (pointers[i] != 0 && depth > 1)
+        {
+            result = mark_pointer_tree(fs, pointers[i], depth - 1);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+        else if (pointers[i] != 0)
+        {
+            block_set(fs, pointers[i]);
+        }
+    }
+    return 0;
+}
+
+
+// Helper function to tell whether the mounted disk uses the extent format
+static bool uses_extents(FS *fs)
+{
+    return (fs->superblock.flags & FS_FLAG_EXTENTS) != 0;
+}
+
+// Helper function to tell whether the mounted disk has 64-bit file sizes
+// (and triple indirect blocks)
+static bool uses_large_files(FS *fs)
+{
+    return (fs->superblock.flags & FS_FLAG_LARGE_FILES) != 0;
+}
+
+// Helper function to tell whether the mounted disk keeps small files inline
+static bool uses_inline_data(FS *fs)
+{
+    return (fs->superblock.flags & FS_FLAG_INLINE_DATA) != 0;
+}
+
+// Helper function to copy bytes of an inline file out of its inode
+// -> the first INLINE_DATA_BYTES are in the inode_t, the rest in the spare
+//    end of the on-disk inode (the inode lock keeps them from changing)
+static void read_inline(FS *fs, int inode_num, const inode_t *inode, uint8_t *data, uint32_t len, uint32_t offset)
+{
+    uint32_t head = (offset < INLINE_DATA_BYTES) ? INLINE_DATA_BYTES - offset : 0;
+    if (head > len)
+    {
+        head = len;
+    }
+    memcpy(data, inode->inline_data + offset, head);
+
+    const uint8_t *tail = (const uint8_t *)inode_at(fs, inode_num) + fs->inode_bytes;
+    memcpy(data + head, tail + (offset + head - INLINE_DATA_BYTES), len - head);
+}
+
+// Helper function to write bytes of an inline file into its inode (see
+// read_inline), then the inode itself
+// -> what lies between the old size and `offset` is zeroed (a hole)
+static int write_inline(FS *fs, int inode_num, inode_t *inode, const uint8_t *data, uint32_t len, uint32_t offset)
+{
+    uint8_t contents[fs->inline_capacity];
+    uint32_t size = inode->size;
+    uint32_t end = (offset + len > size) ? offset + len : size;
+    read_inline(fs, inode_num, inode, contents, size, 0);
+    if (offset > size)
+    {
+        memset(contents + size, 0, offset - size);
+    }
+    memcpy(contents + offset, data, len);
+
+    uint32_t head = (end < INLINE_DATA_BYTES) ? end : INLINE_DATA_BYTES;
+    memcpy(inode->inline_data, contents, head);
+    pthread_mutex_lock(&fs->inode_table_lock);
+    memcpy((uint8_t *)inode_at(fs, inode_num) + fs->inode_bytes, contents + head, end - head);
+    pthread_mutex_unlock(&fs->inode_table_lock);
+
+    set_size(inode, end);
+    int result = write_inode(fs, inode_num, inode);
+    return (result == 0) ? (int)len : result;
+}
+
+// Helper function to move an inline file out to a data block (it's about
+// to outgrow its inode)
+static int spill_inline(FS *fs, int inode_num, inode_t *inode)
+{
+    uint8_t block[fs->block_size];
+    uint32_t size = inode->size;
+    memset(block, 0, fs->block_size);
+    read_inline(fs, inode_num, inode, block, size, 0);
+
+    // 1. Now a regular (empty) file
+    inode->flags &= ~INODE_INLINE;
+    memset(inode->inline_data, 0, INLINE_DATA_BYTES);
+
+    // 2. Its contents (smaller than a block) go in the first block
+    if (size > 0)
+    {
+        int block_num = get_block_for_offset(fs, inode, 0, true);
+        if (block_num <= 0)
+        {
+            return (block_num < 0) ? block_num : E_OUT_OF_SPACE;
+        }
+        int result = cache_write(&fs->cache, block_num, block);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+    return write_inode(fs, inode_num, inode);
+}
+
+// Helper functions to read/update a file size (split in 2 fields)
+static uint64_t get_size(const inode_t *inode)
+{
+    return ((uint64_t)inode->size_high << 32) | inode->size;
+}
+
+static void set_size(inode_t *inode, uint64_t size)
+{
+    inode->size = (uint32_t)size;
+    inode->size_high = (uint32_t)(size >> 32);
+}
+
+// Helper function to allocate a run of up to `want` contiguous free blocks
+// -> starts at `goal` if that block is free, else where the next-fit search lands
+// -> returns the first block and stores in `granted` how many were taken
+// -> blocks held for append buffers are left alone, except by the thread
+//    flushing one (it draws on that buffer's reservation first)
+static int find_free_run(FS *fs, uint32_t goal, uint32_t want, uint32_t *granted)
+{
+    if (!fs->disk_mounted)
+    {
+        return E_DISK_NOT_MOUNTED;
+    }
+
+    count_add(&fs->stats.allocations, 1);
+
+    // 0. Count the blocks out first: the bitmap has at least that many free
+    uint32_t *reserve = (home_reserve != NULL && *home_reserve > 0) ? home_reserve : NULL;
+    if (reserve != NULL)
+    {
+        want = (want < *reserve) ? want : *reserve;
+        *reserve -= want;
+    }
+    else
+    {
+        want = take_blocks(fs, want, false);
+        if (want == 0)
+        {
+            return E_OUT_OF_SPACE; // No free blocks available
+        }
+    }
+
+    // 1. Right at the goal if it is free (runs never cross a shard)
+    if (goal != 0 && goal < fs->superblock.num_blocks)
+    {
+        alloc_shard_t *shard = shard_of(fs, goal);
+        pthread_mutex_lock(&shard->lock);
+        *granted = bitmap_claim_run(&shard->map, goal - shard->first_block, want);
+        pthread_mutex_unlock(&shard->lock);
+        if (*granted > 0)
+        {
+            count_add(&fs->stats.alloc_goal_hits, 1);
+            journal_bitmap_dirty(fs, goal, *granted);
+            if (reserve != NULL)
+            {
+                *reserve += want - *granted;
+            }
+            else
+            {
+                give_blocks(fs, want - *granted);
+            }
+            return (int)goal;
+        }
+    }
+
+    // 2. Else next-fit, starting in this thread's home shard and moving on
+    //    to the next ones when it is full
+    //    -> scan length: # of bits between the next-fit hint and the free
+    //       one found, whole shards for the full ones
+    if (home_shard == UINT32_MAX)
+    {
+        home_shard = __atomic_fetch_add(&next_home_shard, 1, __ATOMIC_RELAXED);
+    }
+    uint64_t scanned = 0;
+    for (uint32_t i = 0; i < fs->num_shards; i++)
+    {
+        alloc_shard_t *shard = &fs->shards[(home_shard + i) % fs->num_shards];
+        pthread_mutex_lock(&shard->lock);
+        uint32_t from = (shard->map.hint < shard->map.num_bits) ? shard->map.hint : 0;
+        int64_t start = bitmap_find_free(&shard->map);
+        if (start >= 0)
+        {
+            *granted = bitmap_claim_run(&shard->map, (uint32_t)start, want);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (start >= 0)
+        {
+            scanned += ((uint32_t)start >= from) ? (uint32_t)start - from : (uint32_t)start + shard->map.num_bits - from;
+            count_add(&fs->stats.alloc_scanned, scanned);
+            count_max(&fs->stats.alloc_max_scan, scanned);
+            journal_bitmap_dirty(fs, shard->first_block + start, *granted);
+            if (reserve != NULL)
+            {
+                *reserve += want - *granted;
+            }
+            else
+            {
+                give_blocks(fs, want - *granted);
+            }
+            return (int)(shard->first_block + start);
+        }
+        scanned += shard->map.num_bits;
+    }
+
+    count_add(&fs->stats.alloc_scanned, scanned);
+    count_max(&fs->stats.alloc_max_scan, scanned);
+    if (reserve != NULL)
+    {
+        *reserve += want;
+    }
+    else
+    {
+        give_blocks(fs, want);
+    }
+    return E_OUT_OF_SPACE; // No free blocks available
+}
+
+// Helper function to count out up to `want` of the free blocks not held for
+// an append buffer (all of them or none if `all_or_nothing`)
+// -> returns how many were taken, the caller gives back what it doesn't use
+static uint32_t take_blocks(FS *fs, uint32_t want, bool all_or_nothing)
+{
+    uint64_t available = __atomic_load_n(&fs->unreserved_blocks, __ATOMIC_RELAXED);
+    uint32_t taken;
+    do
+    {
+        taken = (want < available) ? want : (uint32_t)available;
+        if (taken == 0 || (all_or_nothing && taken < want))
+        {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&fs->unreserved_blocks, &available, available - taken, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return taken;
+}
+
+// Helper function to put back blocks counted out by take_blocks (or freed)
+static void give_blocks(FS *fs, uint32_t count)
+{
+    if (count > 0)
+    {
+        __atomic_fetch_add(&fs->unreserved_blocks, count, __ATOMIC_RELAXED);
+    }
+}
+
+// Helper function to hold enough free blocks for an append buffer to hold
+// `length` bytes starting at file offset `start` (its flush can't run out
+// of space): data blocks, plus room for the pointer/extent blocks they may
+// need (an estimate on the safe side)
+// -> false if the disk is too full, the buffer is left as it was
+static bool reserve_append(FS *fs, append_buffer_t *pending, uint64_t start, uint32_t length)
+{
+    uint64_t data_blocks = (start + length + fs->block_size - 1) / fs->block_size -
+                           (start + fs->block_size - 1) / fs->block_size;
+    uint64_t needed = data_blocks + data_blocks / fs->pointers_per_block + 4;
+    if (needed <= pending->reserved)
+    {
+        return true;
+    }
+
+    uint32_t more = (uint32_t)needed - pending->reserved;
+    if (take_blocks(fs, more, true) == 0)
+    {
+        return false;
+    }
+    pending->reserved += more;
+    return true;
+}
+
+// Helper function to fetch extent `index` of an inode
+// -> the first ones live in the inode, the others in its extent block
+static int read_extent(FS *fs, inode_t *inode, uint32_t index, extent_t *extent)
+{
+    if (index < INLINE_EXTENTS)
+    {
+        *extent = inode->extents[index];
+        return 0;
+    }
+    if (index >= fs->max_extents || inode->extent_block == 0)
+    {
+        return E_CORRUPT_DISK;
+    }
+
+    uint32_t entry = (index - INLINE_EXTENTS) * 2; // in uint32_t units
+    int result = read_pointer(fs, inode->extent_block, entry, &extent->start);
+    if (result != 0)
+    {
+        return result;
+    }
+    return read_pointer(fs, inode->extent_block, entry + 1, &extent->length);
+}
+
+// Helper function to store extent `index` of an inode
+// -> allocates the extent block the first time it is needed
+static int write_extent(FS *fs, inode_t *inode, uint32_t index, const extent_t *extent)
+{
+    if (index < INLINE_EXTENTS)
+    {
+        inode->extents[index] = *extent;
+        return 0;
+    }
+    if (index >= fs->max_extents)
+    {
+        return E_OUT_OF_SPACE; // file too fragmented
+    }
+
+    uint8_t block[fs->block_size];
+    memset(block, 0, fs->block_size);
+    uint32_t block_num = inode->extent_block;
+    if (block_num == 0)
+    {
+        int new_block = find_free_block(fs);
+        if (new_block < 0)
+        {
+            return new_block;
+        }
+        block_num = new_block;
+    }
+    else
+    {
+        int result = meta_read(fs, block_num, block);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    memcpy(block + (index - INLINE_EXTENTS) * sizeof(extent_t), extent, sizeof(extent_t));
+    int result = meta_write(fs, block_num, block);
+    if (result != 0)
+    {
+        if (inode->extent_block == 0)
+        {
+            free_block(fs, block_num);
+        }
+        return result;
+    }
+    inode->extent_block = block_num;
+    return 0;
+}
+
+// Helper function to map a file block to its physical block
+// -> `run_left` tells how many blocks of the extent remain from there on
+//    (itself included): `block_num` is 0 in a hole, and both are 0 past the
+//    last extent
+static int map_extent(FS *fs, inode_t *inode, uint32_t block_index, uint32_t *block_num, uint32_t *run_left)
+{
+    *block_num = 0;
+    *run_left = 0;
+
+    uint32_t first = 0; // file block # the curr extent starts at
+    for (uint32_t i = 0; i < inode->extent_count; i++)
+    {
+        extent_t extent;
+        int result = read_extent(fs, inode, i, &extent);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        if (block_index - first < extent.length)
+        {
+            // start of 0 -> hole
+            *block_num = (extent.start != 0) ? extent.start + (block_index - first) : 0;
+            *run_left = extent.length - (block_index - first);
+            return 0;
+        }
+        first += extent.length;
+    }
+
+    return 0;
+}
+
+// Helper function to map up to `want` new blocks at the end of a file
+// -> grows the last extent in place if the blocks right after it are free,
+//    else starts a new extent on the next free run
+// -> `zero`: init the new blocks with 0s (not needed if about to be overwritten)
+// -> returns the # of blocks added (>= 1) or an error code
+static int extent_append(FS *fs, inode_t *inode, uint32_t want, bool zero)
+{
+    extent_t last = {0, 0};
+    if (inode->extent_count > 0)
+    {
+        int result = read_extent(fs, inode, inode->extent_count - 1, &last);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    // 1. Get a run, ideally right after the last extent (unless it's a hole)
+    uint32_t goal = (last.start != 0) ? last.start + last.length : 0;
+    uint32_t granted;
+    int start = find_free_run(fs, goal, want, &granted);
+    if (start < 0)
+    {
+        return start;
+    }
+
+    // 2. Init with 0s if asked to
+    if (zero)
+    {
+        for (uint32_t i = 0; i < granted; i++)
+        {
+            int result = cache_write(&fs->cache, start + i, fs->zero_block);
+            if (result != 0)
+            {
+                for (uint32_t j = 0; j < granted; j++)
+                {
+                    free_block(fs, start + j);
+                }
+                return result;
+            }
+        }
+    }
+
+    // 3. Record it: longer last extent, or a new one
+    int result;
+    if (goal != 0 && (uint32_t)start == goal)
+    {
+        last.length += granted;
+        result = write_extent(fs, inode, inode->extent_count - 1, &last);
+    }
+    else
+    {
+        extent_t extent = {(uint32_t)start, granted};
+        result = write_extent(fs, inode, inode->extent_count, &extent);
+        if (result == 0)
+        {
+            inode->extent_count++;
+        }
+    }
+
+    if (result != 0)
+    {
+        for (uint32_t i = 0; i < granted; i++)
+        {
+            free_block(fs, start + i);
+        }
+        return result;
+    }
+
+    return (int)granted;
+}
+
+// Helper function to get block # for a file offset (extent format)
+static int extent_block_for_offset(FS *fs, inode_t *inode, int64_t offset, bool allocate)
+{
+    uint32_t block_index = offset / fs->block_size;
+    while (true)
+    {
+        uint32_t block_num, run_left;
+        int result = map_extent(fs, inode, block_index, &block_num, &run_left);
+        if (result != 0)
+        {
+            return result;
+        }
+        if (block_num != 0 || !allocate)
+        {
+            return block_num;
+        }
+
+        // W/in a hole: give that block its own extent
+        if (run_left > 0)
+        {
+            return extent_fill_hole(fs, inode, block_index);
+        }
+
+        // Past the end of the file: hole up to the block, then map one more
+        // (zeroed) block
+        result = extent_append_hole(fs, inode, block_index);
+        if (result != 0)
+        {
+            return result;
+        }
+        result = extent_append(fs, inode, 1, true);
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+}
+
+// Helper function to load the whole extent list of an inode
+static int load_extents(FS *fs, inode_t *inode, extent_t *list)
+{
+    for (uint32_t i = 0; i < inode->extent_count; i++)
+    {
+        int result = read_extent(fs, inode, i, &list[i]);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Helper function to write back an edited extent list (the whole list)
+// -> all or nothing: on error the inode & the list on disk are unchanged,
+//    so the caller can give back the blocks it was about to map
+// -> inline entries before `from` are unchanged and not rewritten
+static int store_extents(FS *fs, inode_t *inode, const extent_t *list, uint32_t count, uint32_t from)
+{
+    if (count > fs->max_extents)
+    {
+        return E_OUT_OF_SPACE; // file too fragmented
+    }
+
+    // 1. Entries past the inode: the extent block, rebuilt and written at once
+    //    (allocated the first time it is needed)
+    if (count > INLINE_EXTENTS)
+    {
+        uint32_t block_num = inode->extent_block;
+        if (block_num == 0)
+        {
+            int new_block = find_free_block(fs);
+            if (new_block < 0)
+            {
+                return new_block;
+            }
+            block_num = new_block;
+        }
+
+        uint8_t block[fs->block_size];
+        memset(block, 0, fs->block_size);
+        memcpy(block, &list[INLINE_EXTENTS], (count - INLINE_EXTENTS) * sizeof(extent_t));
+        int result = meta_write(fs, block_num, block);
+        if (result != 0)
+        {
+            if (inode->extent_block == 0)
+            {
+                free_block(fs, block_num);
+            }
+            return result;
+        }
+        inode->extent_block = block_num;
+    }
+
+    // 2. Entries in the inode
+    for (uint32_t i = from; i < count && i < INLINE_EXTENTS; i++)
+    {
+        inode->extents[i] = list[i];
+    }
+    inode->extent_count = count;
+    return 0;
+}
+
+// Helper function to make an extent-mapped file reach file block
+// `block_index` with a hole (no-op if already mapped that far)
+static int extent_append_hole(FS *fs, inode_t *inode, uint32_t block_index)
+{
+    extent_t list[fs->max_extents];
+    int result = load_extents(fs, inode, list);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    uint32_t mapped = 0;
+    for (uint32_t i = 0; i < inode->extent_count; i++)
+    {
+        mapped += list[i].length;
+    }
+    if (block_index <= mapped)
+    {
+        return 0;
+    }
+
+    // Grow the last extent if it's already a hole, else add one
+    uint32_t count = inode->extent_count;
+    if (count > 0 && list[count - 1].start == 0)
+    {
+        list[count - 1].length += block_index - mapped;
+        return store_extents(fs, inode, list, count, count - 1);
+    }
+    if (count >= fs->max_extents)
+    {
+        return E_OUT_OF_SPACE; // file too fragmented
+    }
+    list[count].start = 0;
+    list[count].length = block_index - mapped;
+    return store_extents(fs, inode, list, count + 1, count);
+}
+
+// Helper function to give a (zeroed) block to file block `block_index`,
+// which lies in a hole
+// -> splits the hole extent around it, or grows the data extent right
+//    before the hole if the new block follows it on disk
+static int extent_fill_hole(FS *fs, inode_t *inode, uint32_t block_index)
+{
+    extent_t list[fs->max_extents + 2];
+    int result = load_extents(fs, inode, list);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // 1. Find the hole
+    uint32_t count = inode->extent_count;
+    uint32_t i = 0, first = 0;
+    while (i < count && block_index - first >= list[i].length)
+    {
+        first += list[i].length;
+        i++;
+    }
+    if (i == count || list[i].start != 0)
+    {
+        return E_CORRUPT_DISK; // caller made sure it's a hole
+    }
+
+    // 2. Get a block, ideally right after the previous extent
+    uint32_t goal = (i > 0 && list[i - 1].start != 0) ? list[i - 1].start + list[i - 1].length : 0;
+    uint32_t granted;
+    int block_num = find_free_run(fs, goal, 1, &granted);
+    if (block_num < 0)
+    {
+        return block_num;
+    }
+
+    result = cache_write(&fs->cache, block_num, fs->zero_block);
+    if (result != 0)
+    {
+        free_block(fs, block_num);
+        return result;
+    }
+
+    // 3. Replace the hole by [hole before][block][hole after]
+    uint32_t before = block_index - first;
+    uint32_t after = list[i].length - before - 1;
+    bool merge = (before == 0 && goal != 0 && (uint32_t)block_num == goal);
+
+    extent_t pieces[3];
+    uint32_t num_pieces = 0;
+    if (merge)
+    {
+        list[i - 1].length++;
+    }
+    else
+    {
+        if (before > 0)
+        {
+            pieces[num_pieces].start = 0;
+            pieces[num_pieces].length = before;
+            num_pieces++;
+        }
+        pieces[num_pieces].start = block_num;
+        pieces[num_pieces].length = 1;
+        num_pieces++;
+    }
+    if (after > 0)
+    {
+        pieces[num_pieces].start = 0;
+        pieces[num_pieces].length = after;
+        num_pieces++;
+    }
+
+    memmove(&list[i + num_pieces], &list[i + 1], (count - i - 1) * sizeof(extent_t));
+    memcpy(&list[i], pieces, num_pieces * sizeof(extent_t));
+
+    result = store_extents(fs, inode, list, count - 1 + num_pieces, merge ? i - 1 : i);
+    if (result != 0)
+    {
+        free_block(fs, block_num);
+        return result;
+    }
+
+    return block_num;
+}
+
+// Helper function to free all blocks of an extent-mapped file
+static int free_extents(FS *fs, inode_t *inode)
+{
+    for (uint32_t i = 0; i < inode->extent_count; i++)
+    {
+        extent_t extent;
+        int result = read_extent(fs, inode, i, &extent);
+        if (result != 0)
+        {
+            return result;
+        }
+
+        for (uint32_t j = 0; extent.start != 0 && j < extent.length; j++)
+        {
+            free_block(fs, extent.start + j);
+        }
+    }
+
+    if (inode->extent_block != 0)
+    {
+        free_block(fs, inode->extent_block);
+    }
+
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->extent_count = 0;
+    inode->extent_block = 0;
+    return 0;
+}
+
+
+/*************************/
+/* Concurrency helpers   */
+/*************************/
+
+// Helper function to start an operation on one inode: holds the fs shared
+// (no unmount under our feet) and the inode shared (readers) or exclusive
+static int enter_inode(FS *fs, int inode_num, bool exclusive)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    if (!fs->disk_mounted)
+    {
+        pthread_rwlock_unlock(&fs->lock);
+        return E_DISK_NOT_MOUNTED;
+    }
+    if (inode_num < 0 || (uint32_t)inode_num >= fs->num_inode_locks)
+    {
+        pthread_rwlock_unlock(&fs->lock);
+        return E_INVALID_INODE;
+    }
+
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(&fs->inode_locks[inode_num]);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&fs->inode_locks[inode_num]);
+    }
+    return 0;
+}
+
+// Helper function to check whether some instance has `disk_name` mounted
+// Helper function to list an instance as the user of an image, unless
+// another one has it (mounted or being formatted)
+// -> check & insert in one go, and by file identity: 2 paths to the same
+//    image (relative, symlink, hard link) are the same image
+static int claim_image(FS *fs, char *disk_name)
+{
+    vdisk_id_t id;
+    int result = vdisk_file_id(disk_name, &id);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    pthread_mutex_lock(&mounted_lock);
+    FS *other = mounted_list;
+    while (other != NULL && (other->disk_id.dev != id.dev || other->disk_id.ino != id.ino))
+    {
+        other = other->next;
+    }
+    if (other == NULL)
+    {
+        fs->disk_id = id;
+        fs->next = mounted_list;
+        mounted_list = fs;
+    }
+    pthread_mutex_unlock(&mounted_lock);
+    return (other == NULL) ? 0 : E_DISK_ALREADY_MOUNTED;
+}
+
+// Helper function to take an instance off the list of image users
+static void release_image(FS *fs)
+{
+    pthread_mutex_lock(&mounted_lock);
+    FS **link = &mounted_list;
+    while (*link != NULL && *link != fs)
+    {
+        link = &(*link)->next;
+    }
+    if (*link != NULL)
+    {
+        *link = fs->next;
+    }
+    pthread_mutex_unlock(&mounted_lock);
+}
+
+// Helper function to end an operation started with enter_inode()
+// -> commits the journal if the operation filled it up (no inode held then)
+static void leave_inode(FS *fs, int inode_num)
+{
+    pthread_rwlock_unlock(&fs->inode_locks[inode_num]);
+    journal_commit_if_full(fs);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+// Helper function to split the block bitmap into allocator shards
+// -> one shard unless several threads are expected, shards stay big enough
+//    for long runs and start on a bitmap word
+static int alloc_init(FS *fs, uint32_t wanted_shards)
+{
+    uint32_t num_blocks = fs->superblock.num_blocks;
+    if (wanted_shards > ALLOC_MAX_SHARDS)
+    {
+        wanted_shards = ALLOC_MAX_SHARDS;
+    }
+    if (wanted_shards == 0)
+    {
+        wanted_shards = 1;
+    }
+
+    fs->shard_blocks = (num_blocks + wanted_shards - 1) / wanted_shards;
+    if (fs->shard_blocks < ALLOC_SHARD_MIN_BLOCKS)
+    {
+        fs->shard_blocks = ALLOC_SHARD_MIN_BLOCKS;
+    }
+    fs->shard_blocks = (fs->shard_blocks + 63) & ~63u;
+    fs->num_shards = (num_blocks + fs->shard_blocks - 1) / fs->shard_blocks;
+
+    fs->shards = (alloc_shard_t *)calloc(fs->num_shards, sizeof(alloc_shard_t));
+    if (fs->shards == NULL)
+    {
+        fs->num_shards = 0;
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    for (uint32_t i = 0; i < fs->num_shards; i++)
+    {
+        uint32_t first = i * fs->shard_blocks;
+        uint32_t count = (num_blocks - first < fs->shard_blocks) ? num_blocks - first : fs->shard_blocks;
+        pthread_mutex_init(&fs->shards[i].lock, NULL);
+        fs->shards[i].first_block = first;
+        int result = bitmap_init(&fs->shards[i].map, count);
+        if (result != 0)
+        {
+            fs->num_shards = i + 1;
+            alloc_destroy(fs);
+            return result;
+        }
+    }
+    return 0;
+}
+
+// Helper function to release the allocator shards
+static void alloc_destroy(FS *fs)
+{
+    for (uint32_t i = 0; i < fs->num_shards; i++)
+    {
+        bitmap_destroy(&fs->shards[i].map);
+        pthread_mutex_destroy(&fs->shards[i].lock);
+    }
+    free(fs->shards);
+    fs->shards = NULL;
+    fs->num_shards = 0;
+}
+
+// Helper function to get the shard tracking a block
+static alloc_shard_t *shard_of(FS *fs, uint32_t block_num)
+{
+    return &fs->shards[block_num / fs->shard_blocks];
+}
+
+// Helper function to mark a block as used (mount-time rebuild)
+static void block_set(FS *fs, uint32_t block_num)
+{
+    if (block_num < fs->superblock.num_blocks)
+    {
+        alloc_shard_t *shard = shard_of(fs, block_num);
+        pthread_mutex_lock(&shard->lock);
+        bitmap_set(&shard->map, block_num - shard->first_block);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+
+/*************************/
+/* Async I/O helpers     */
+/*************************/
+
+// Helper function doing the whole async request: mapping under the inode
+// lock, then the batch submission (before unmount can stop the engine)
+static int submit_async(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, bool write, fs_aio_t **reqp)
+{
+    uint64_t start = stats_clock();
+    fs_aio_t *aio = (fs_aio_t *)calloc(1, sizeof(fs_aio_t));
+    if (aio == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    int result = enter_inode(fs, inode_num, write);
+    if (result == 0)
+    {
+        if (write)
+        {
+            journal_begin(fs);
+            result = write_locked(fs, inode_num, data, len, offset, aio);
+            journal_end(fs);
+        }
+        else
+        {
+            result = read_locked(fs, inode_num, data, len, offset, aio);
+        }
+        if (result >= 0)
+        {
+            pthread_mutex_init(&aio->lock, NULL);
+            pthread_cond_init(&aio->cond, NULL);
+            aio->result = result;
+            aio->pending = aio->num_ios;
+            vdisk_aio_submit(&fs->disk, aio->ios, aio->num_ios);
+        }
+        leave_inode(fs, inode_num);
+    }
+
+    count_op(fs, write ? FS_OP_WRITE : FS_OP_READ, start, result);
+    if (result < 0)
+    {
+        free(aio->ios);
+        free(aio);
+        return result;
+    }
+
+    *reqp = aio;
+    return 0;
+}
+
+// Helper function to add a run of blocks to an async request
+static int aio_queue(fs_aio_t *aio, uint32_t block_num, uint32_t count, uint8_t *buffer, bool write)
+{
+    if (aio->num_ios == aio->max_ios)
+    {
+        uint32_t max_ios = (aio->max_ios == 0) ? 8 : aio->max_ios * 2;
+        vdisk_io_t *ios = (vdisk_io_t *)realloc(aio->ios, max_ios * sizeof(vdisk_io_t));
+        if (ios == NULL)
+        {
+            return E_OUT_OF_SPACE; // see error.h
+        }
+        aio->ios = ios;
+        aio->max_ios = max_ios;
+    }
+
+    vdisk_io_t *io = &aio->ios[aio->num_ios++];
+    io->sector = block_num;
+    io->count = count;
+    io->buffer = buffer;
+    io->write = write;
+    io->result = 0;
+    io->done = aio_done;
+    io->data = aio;
+    return 0;
+}
+
+// Helper function to add a run of blocks to an async read: cached blocks
+// are copied right away, only the misses go to the disk
+static int aio_queue_read(FS *fs, fs_aio_t *aio, uint32_t block_num, uint32_t count, uint8_t *buffer)
+{
+    vdisk_run_t *misses = (vdisk_run_t *)malloc((count / 2 + 1) * sizeof(vdisk_run_t));
+    if (misses == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+
+    uint32_t first_io = aio->num_ios;
+    int num_misses = cache_read_hits(&fs->cache, block_num, count, buffer, misses);
+    int result = 0;
+    for (int i = 0; i < num_misses && result == 0; i++)
+    {
+        result = aio_queue(aio, misses[i].sector, misses[i].count, misses[i].buffer, false);
+    }
+    if (result != 0)
+    {
+        aio->num_ios = first_io; // the whole run failed
+    }
+
+    free(misses);
+    return result;
+}
+
+// Helper function called by the disk as each I/O of a request completes
+static void aio_done(vdisk_io_t *io)
+{
+    fs_aio_t *aio = (fs_aio_t *)io->data;
+    pthread_mutex_lock(&aio->lock);
+    if (io->result != 0 && aio->error == 0)
+    {
+        aio->error = io->result;
+    }
+    aio->pending--;
+    if (aio->pending == 0)
+    {
+        pthread_cond_broadcast(&aio->cond);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+
+/*************************/
+/* Journal helpers       */
+/*************************/
+
+/*
+ * Metadata journal (FS_FLAG_JOURNAL): superblock, inode, bitmap, pointer &
+ * extent blocks are not written in place right away, the running
+ * transaction keeps their latest copy. A commit then
+ *   1. writes back the dirty data blocks (ordered mode: a committed pointer
+ *      never leads to stale data),
+ *   2. logs every block of the transaction in one sequential write to a
+ *      journal slot, followed by a commit record holding their checksum,
+ *      and syncs once,
+ *   3. checkpoints them: written through to their home location.
+ * Commits alternate between the 2 slots, so by the time a slot is reused the
+ * sync of the commit in between has made its checkpoint durable: after a
+ * crash, replaying the last complete commit is enough (see journal_recover).
+ * Updates are grouped: a commit happens once the transaction holds half of
+ * what one commit can log, or on fs_sync()/unmount().
+ * NB: blocks freed by the transaction are only reused once it has committed,
+ *     else a crash could leave a committed file pointing at someone's data.
+ */
+
+// Helper function to tell whether the mounted disk has a journal
+static bool uses_journal(FS *fs)
+{
+    return (fs->superblock.flags & FS_FLAG_JOURNAL) != 0;
+}
+
+// Helper function to read a metadata block (pointer, extent, inode... block)
+// -> the running transaction has the latest copy of those it changed
+static int meta_read(FS *fs, uint32_t block_num, uint8_t *block)
+{
+    if (journal_lookup(fs, block_num, 0, fs->block_size, block))
+    {
+        return 0;
+    }
+    return cache_read(&fs->cache, block_num, block);
+}
+
+// Helper function to write a metadata block
+// -> journaled: only logged in the transaction (and the cached copy
+//    refreshed), it reaches its home location once committed
+static int meta_write(FS *fs, uint32_t block_num, uint8_t *block)
+{
+    if (fs->journal.capacity == 0)
+    {
+        return cache_write(&fs->cache, block_num, block);
+    }
+
+    int result = journal_log(fs, block_num, block);
+    if (result == 0)
+    {
+        cache_update(&fs->cache, block_num, 1, block);
+    }
+    return result;
+}
+
+// Helper function to set up the (empty) transaction of a journaled disk
+static int journal_init(FS *fs)
+{
+    journal_t *journal = &fs->journal;
+    journal->capacity = 0;
+    if (!uses_journal(fs))
+    {
+        return 0;
+    }
+
+    // 1. Check the journal lies within the disk
+    const superblock_t *sb = &fs->superblock;
+    if (sb->num_journal_blocks < JOURNAL_MIN_BLOCKS || sb->journal_start == 0 ||
+        sb->journal_start > sb->num_blocks || sb->num_journal_blocks > sb->num_blocks - sb->journal_start ||
+        sb->num_bitmap_blocks == 0)
+    {
+        return E_CORRUPT_DISK;
+    }
+
+    // 2. A slot holds the descriptor, the blocks & the commit record
+    uint32_t slot_blocks = sb->num_journal_blocks / 2;
+    uint32_t entries = JOURNAL_ENTRIES(fs->block_size);
+    uint32_t capacity = (slot_blocks - 2 < entries) ? slot_blocks - 2 : entries;
+
+    // 3. Room for one commit's worth of blocks, grown if one update needs more
+    journal->max_count = capacity;
+    journal->index_mask = 1;
+    while (journal->index_mask + 1 < 2 * capacity)
+    {
+        journal->index_mask = journal->index_mask * 2 + 1;
+    }
+    journal->blocks = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    journal->data = (uint8_t *)malloc((size_t)capacity * fs->block_size);
+    journal->index = (int32_t *)malloc((journal->index_mask + 1) * sizeof(int32_t));
+    journal->bitmap_dirty = (bool *)calloc(sb->num_bitmap_blocks, sizeof(bool));
+    journal->log = (uint8_t *)vdisk_alloc_buffer((size_t)(capacity + 2) * fs->block_size);
+    if (journal->blocks == NULL || journal->data == NULL || journal->index == NULL ||
+        journal->bitmap_dirty == NULL || journal->log == NULL)
+    {
+        journal_destroy(fs);
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    memset(journal->index, 0xff, (journal->index_mask + 1) * sizeof(int32_t));
+
+    journal->count = 0;
+    journal->num_freed = 0;
+    journal->sequence = 1;
+    journal->capacity = capacity;
+    return 0;
+}
+
+// Helper function to release the transaction
+// NB: whatever it holds is lost, journal_commit() first to keep it
+static void journal_destroy(FS *fs)
+{
+    journal_t *journal = &fs->journal;
+    free(journal->blocks);
+    free(journal->data);
+    free(journal->index);
+    free(journal->freed);
+    free(journal->bitmap_dirty);
+    vdisk_free_buffer(journal->log);
+    journal->blocks = NULL;
+    journal->data = NULL;
+    journal->index = NULL;
+    journal->freed = NULL;
+    journal->bitmap_dirty = NULL;
+    journal->log = NULL;
+    journal->capacity = 0;
+    journal->count = 0;
+    journal->max_count = 0;
+    journal->num_freed = 0;
+    journal->max_freed = 0;
+}
+
+// Helper function to read the commit in a journal slot into journal.log
+// -> returns 1 if it is complete (sequence in `sequence`), 0 if there is
+//    none (or only part of one), or an I/O error code
+static int read_commit(FS *fs, uint32_t slot, uint32_t *sequence)
+{
+    journal_t *journal = &fs->journal;
+    uint32_t start = fs->superblock.journal_start + slot * (fs->superblock.num_journal_blocks / 2);
+
+    // 1. Descriptor
+    int result = vdisk_read(&fs->disk, start, journal->log);
+    if (result != 0)
+    {
+        return result;
+    }
+    journal_header_t descriptor;
+    memcpy(&descriptor, journal->log, sizeof(journal_header_t));
+    if (descriptor.magic != JOURNAL_DESCRIPTOR || descriptor.count == 0 || descriptor.count > journal->capacity)
+    {
+        return 0;
+    }
+
+    // 2. Logged blocks & commit record, which must match the descriptor
+    result = vdisk_read_range(&fs->disk, start + 1, descriptor.count + 1, journal->log + fs->block_size);
+    if (result != 0)
+    {
+        return result;
+    }
+    journal_header_t commit;
+    memcpy(&commit, journal->log + (size_t)(descriptor.count + 1) * fs->block_size, sizeof(journal_header_t));
+    if (commit.magic != JOURNAL_COMMIT || commit.sequence != descriptor.sequence || commit.count != descriptor.count ||
+        commit.checksum != journal_checksum(journal->log, (size_t)(descriptor.count + 1) * fs->block_size))
+    {
+        return 0;
+    }
+
+    *sequence = descriptor.sequence;
+    return 1;
+}
+
+// Helper function to recover at mount: finds the last complete commit and,
+// unless the fs was cleanly unmounted, writes its blocks back home
+// -> a crash mid-commit leaves that commit incomplete: the one before it
+//    (in the other slot) is replayed instead
+static int journal_recover(FS *fs)
+{
+    journal_t *journal = &fs->journal;
+    if (journal->capacity == 0)
+    {
+        return 0;
+    }
+
+    // 1. Find the latest complete commit
+    int latest = -1;
+    uint32_t latest_sequence = 0;
+    for (uint32_t slot = 0; slot < 2; slot++)
+    {
+        uint32_t sequence;
+        int result = read_commit(fs, slot, &sequence);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result == 1 && (latest < 0 || sequence > latest_sequence))
+        {
+            latest = (int)slot;
+            latest_sequence = sequence;
+        }
+    }
+
+    // 2. Number the next commits after it (stale slots must never look newer)
+    journal->sequence = latest_sequence + 1;
+    if (latest < 0 || fs->superblock.state == FS_STATE_CLEAN)
+    {
+        return 0; // nothing logged, or all of it checkpointed already
+    }
+
+    // 3. Replay it: every logged block back to its home location
+    uint32_t sequence;
+    int result = read_commit(fs, (uint32_t)latest, &sequence);
+    if (result != 1)
+    {
+        return (result < 0) ? result : E_CORRUPT_DISK;
+    }
+
+    journal_header_t descriptor;
+    memcpy(&descriptor, journal->log, sizeof(journal_header_t));
+    const uint32_t *blocks = (const uint32_t *)(journal->log + sizeof(journal_header_t));
+    for (uint32_t i = 0; i < descriptor.count; i++)
+    {
+        if (blocks[i] >= fs->superblock.journal_start && blocks[i] < first_data_block(fs))
+        {
+            return E_CORRUPT_DISK; // never logged: part of the journal
+        }
+        if (blocks[i] >= fs->superblock.num_blocks)
+        {
+            return E_CORRUPT_DISK;
+        }
+        result = cache_write_range(&fs->cache, blocks[i], 1, journal->log + (size_t)(i + 1) * fs->block_size);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+    result = vdisk_sync(&fs->disk);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // 4. The superblock may have been replayed too
+    uint8_t block[fs->block_size];
+    result = cache_read(&fs->cache, 0, block);
+    if (result != 0)
+    {
+        return result;
+    }
+    memcpy(&fs->superblock, block, sizeof(superblock_t));
+    if (memcmp(fs->superblock.magic, MAGIC_NUMBER, 16) != 0 || !uses_journal(fs))
+    {
+        return E_CORRUPT_DISK;
+    }
+    return 0;
+}
+
+// Helper function to start an update: no commit until journal_end()
+static void journal_begin(FS *fs)
+{
+    if (fs->journal.capacity > 0)
+    {
+        pthread_rwlock_rdlock(&fs->journal.txn_lock);
+    }
+}
+
+// Helper function to end an update started with journal_begin()
+static void journal_end(FS *fs)
+{
+    if (fs->journal.capacity > 0)
+    {
+        pthread_rwlock_unlock(&fs->journal.txn_lock);
+    }
+}
+
+// Helper function to commit the running transaction
+// -> waits for the updates in progress, holds `lock` (at least shared) only
+static int journal_commit(FS *fs)
+{
+    if (fs->journal.capacity == 0)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&fs->journal.txn_lock);
+    int result = commit_locked(fs);
+    pthread_rwlock_unlock(&fs->journal.txn_lock);
+    return result;
+}
+
+// Helper function to commit once the transaction is half of what a commit
+// holds: leaves room for the updates running meanwhile
+static void journal_commit_if_full(FS *fs)
+{
+    journal_t *journal = &fs->journal;
+    if (journal->capacity == 0 || __atomic_load_n(&journal->count, __ATOMIC_RELAXED) < journal->capacity / 2)
+    {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&journal->txn_lock);
+    if (journal->count >= journal->capacity / 2) // unless another thread just did
+    {
+        commit_locked(fs); // best effort: the blocks stay logged, the next commit retries
+    }
+    pthread_rwlock_unlock(&journal->txn_lock);
+}
+
+// Helper function to commit so that the blocks freed since the last commit
+// can be allocated again
+// -> false if there are none (or the commit failed)
+static bool journal_reclaim(FS *fs)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    bool reclaimed = false;
+    if (fs->disk_mounted && fs->journal.capacity > 0)
+    {
+        pthread_mutex_lock(&fs->journal.lock);
+        bool pending = (fs->journal.num_freed > 0);
+        pthread_mutex_unlock(&fs->journal.lock);
+        reclaimed = pending && journal_commit(fs) == 0;
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return reclaimed;
+}
+
+// Helper function doing the commit (txn_lock held exclusively)
+static int commit_locked(FS *fs)
+{
+    journal_t *journal = &fs->journal;
+
+    // 1. Log the bitmap blocks the transaction changed, as it leaves them
+    //    (the blocks it freed are free in there already)
+    for (uint32_t i = 0; i < journal->num_freed; i++)
+    {
+        journal->bitmap_dirty[journal->freed[i] / fs->bits_per_block] = true;
+    }
+    for (uint32_t i = 0; i < fs->superblock.num_bitmap_blocks; i++)
+    {
+        if (!__atomic_load_n(&journal->bitmap_dirty[i], __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        uint8_t block[fs->block_size];
+        bitmap_block(fs, i, block);
+        int result = journal_log(fs, fs->superblock.bitmap_start + i, block);
+        if (result != 0)
+        {
+            return result;
+        }
+        journal->bitmap_dirty[i] = false;
+    }
+    if (journal->count == 0)
+    {
+        return 0;
+    }
+
+    // 2. Ordered mode: the data goes first
+    int result = cache_flush(&fs->cache);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // 3. Log & checkpoint
+    //    -> a transaction grown past what one commit holds (a single huge
+    //       update) takes several, each of them atomic
+    for (uint32_t first = 0; first < journal->count; first += journal->capacity)
+    {
+        uint32_t count = journal->count - first;
+        if (count > journal->capacity)
+        {
+            count = journal->capacity;
+        }
+        result = write_commit(fs, first, count);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    // 4. The freed blocks can be reused now (already free on disk)
+    for (uint32_t i = 0; i < journal->num_freed; i++)
+    {
+        alloc_shard_t *shard = shard_of(fs, journal->freed[i]);
+        pthread_mutex_lock(&shard->lock);
+        uint32_t num_free = shard->map.num_free;
+        bitmap_clear(&shard->map, journal->freed[i] - shard->first_block);
+        num_free = shard->map.num_free - num_free;
+        pthread_mutex_unlock(&shard->lock);
+        give_blocks(fs, num_free);
+    }
+
+    // 5. Start an empty transaction
+    pthread_mutex_lock(&journal->lock);
+    journal->num_freed = 0;
+    __atomic_store_n(&journal->count, 0, __ATOMIC_RELAXED);
+    memset(journal->index, 0xff, (journal->index_mask + 1) * sizeof(int32_t));
+    pthread_mutex_unlock(&journal->lock);
+    return 0;
+}
+
+// Helper function to write one commit: transaction entries [first, first + count)
+static int write_commit(FS *fs, uint32_t first, uint32_t count)
+{
+    journal_t *journal = &fs->journal;
+    uint32_t start = fs->superblock.journal_start + (journal->sequence % 2) * (fs->superblock.num_journal_blocks / 2);
+
+    // 1. Lay out [descriptor][blocks][commit record]
+    uint8_t *log = journal->log;
+    journal_header_t header = {JOURNAL_DESCRIPTOR, journal->sequence, count, 0};
+    memset(log, 0, fs->block_size);
+    memcpy(log, &header, sizeof(journal_header_t));
+    memcpy(log + sizeof(journal_header_t), &journal->blocks[first], count * sizeof(uint32_t));
+    memcpy(log + fs->block_size, journal->data + (size_t)first * fs->block_size, (size_t)count * fs->block_size);
+
+    uint8_t *commit = log + (size_t)(count + 1) * fs->block_size;
+    header.magic = JOURNAL_COMMIT;
+    header.checksum = journal_checksum(log, (size_t)(count + 1) * fs->block_size);
+    memset(commit, 0, fs->block_size);
+    memcpy(commit, &header, sizeof(journal_header_t));
+
+    // 2. One sequential write, one sync
+    int result = vdisk_write_range(&fs->disk, start, count + 2, log);
+    if (result == 0)
+    {
+        result = vdisk_sync(&fs->disk);
+    }
+    if (result != 0)
+    {
+        return result;
+    }
+    journal->sequence++;
+
+    // 3. Checkpoint: write through to the home locations, one call per run
+    //    of consecutive blocks (no sync, the next commit's covers it)
+    for (uint32_t i = first; i < first + count; )
+    {
+        uint32_t run = 1;
+        while (i + run < first + count && journal->blocks[i + run] == journal->blocks[i] + run)
+        {
+            run++;
+        }
+        result = cache_write_range(&fs->cache, journal->blocks[i], run, journal->data + (size_t)i * fs->block_size);
+        if (result != 0)
+        {
+            return result;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Helper function to copy (part of) a block from the transaction
+// -> false if it isn't in there
+static bool journal_lookup(FS *fs, uint32_t block_num, uint32_t offset, uint32_t length, uint8_t *buffer)
+{
+    journal_t *journal = &fs->journal;
+    if (journal->capacity == 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    int32_t entry = *txn_entry(journal, block_num);
+    if (entry >= 0)
+    {
+        memcpy(buffer, journal->data + (size_t)entry * fs->block_size + offset, length);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return entry >= 0;
+}
+
+// Helper function to add a block (or its new contents) to the transaction
+static int journal_log(FS *fs, uint32_t block_num, const uint8_t *block)
+{
+    journal_t *journal = &fs->journal;
+    pthread_mutex_lock(&journal->lock);
+    int32_t *entry = txn_entry(journal, block_num);
+    if (*entry < 0)
+    {
+        if (journal->count == journal->max_count)
+        {
+            if (txn_grow(fs) != 0)
+            {
+                pthread_mutex_unlock(&journal->lock);
+                return E_OUT_OF_SPACE; // see error.h
+            }
+            entry = txn_entry(journal, block_num);
+        }
+        *entry = (int32_t)journal->count;
+        journal->blocks[journal->count] = block_num;
+        __atomic_store_n(&journal->count, journal->count + 1, __ATOMIC_RELAXED);
+    }
+    memcpy(journal->data + (size_t)*entry * fs->block_size, block, fs->block_size);
+    pthread_mutex_unlock(&journal->lock);
+    return 0;
+}
+
+// Helper function to find a block's cell in the transaction index
+// (linear probing, -1 = free cell)
+static int32_t *txn_entry(journal_t *journal, uint32_t block_num)
+{
+    uint32_t cell = (block_num * 2654435761u) & journal->index_mask;
+    while (journal->index[cell] >= 0 && journal->blocks[journal->index[cell]] != block_num)
+    {
+        cell = (cell + 1) & journal->index_mask;
+    }
+    return &journal->index[cell];
+}
+
+// Helper function to double the room in the transaction (journal.lock held)
+static int txn_grow(FS *fs)
+{
+    journal_t *journal = &fs->journal;
+    uint32_t max_count = journal->max_count * 2;
+    uint32_t *blocks = (uint32_t *)realloc(journal->blocks, max_count * sizeof(uint32_t));
+    if (blocks == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    journal->blocks = blocks;
+    uint8_t *data = (uint8_t *)realloc(journal->data, (size_t)max_count * fs->block_size);
+    if (data == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    journal->data = data;
+    uint32_t index_mask = journal->index_mask * 2 + 1;
+    int32_t *index = (int32_t *)realloc(journal->index, (index_mask + 1) * sizeof(int32_t));
+    if (index == NULL)
+    {
+        return E_OUT_OF_SPACE; // see error.h
+    }
+    journal->index = index;
+    journal->index_mask = index_mask;
+    journal->max_count = max_count;
+
+    // Rehash
+    memset(journal->index, 0xff, (index_mask + 1) * sizeof(int32_t));
+    for (uint32_t i = 0; i < journal->count; i++)
+    {
+        *txn_entry(journal, journal->blocks[i]) = (int32_t)i;
+    }
+    return 0;
+}
+
+// Helper function to defer freeing a block until the transaction commits
+// -> false if not journaled (or no memory to remember it): free it now
+static bool journal_free(FS *fs, uint32_t block_num)
+{
+    journal_t *journal = &fs->journal;
+    if (journal->capacity == 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    if (journal->num_freed == journal->max_freed)
+    {
+        uint32_t max_freed = (journal->max_freed == 0) ? 64 : journal->max_freed * 2;
+        uint32_t *freed = (uint32_t *)realloc(journal->freed, max_freed * sizeof(uint32_t));
+        if (freed == NULL)
+        {
+            pthread_mutex_unlock(&journal->lock);
+            return false;
+        }
+        journal->freed = freed;
+        journal->max_freed = max_freed;
+    }
+    journal->freed[journal->num_freed++] = block_num;
+    pthread_mutex_unlock(&journal->lock);
+    return true;
+}
+
+// Helper function to flag the bitmap block(s) covering newly allocated blocks
+static void journal_bitmap_dirty(FS *fs, uint32_t block_num, uint32_t count)
+{
+    if (fs->journal.capacity == 0 || count == 0)
+    {
+        return;
+    }
+    __atomic_store_n(&fs->journal.bitmap_dirty[block_num / fs->bits_per_block], true, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->journal.bitmap_dirty[(block_num + count - 1) / fs->bits_per_block], true, __ATOMIC_RELAXED);
+}
+
+// Helper function to build bitmap block `index` from the allocator shards
+// -> with the blocks freed by the transaction marked free
+static void bitmap_block(FS *fs, uint32_t index, uint8_t *block)
+{
+    memset(block, 0, fs->block_size);
+    size_t first_byte = (size_t)index * fs->block_size; // w/in the whole bitmap
+    for (uint32_t i = 0; i < fs->num_shards; i++)
+    {
+        alloc_shard_t *shard = &fs->shards[i];
+        size_t shard_first = shard->first_block / 8;
+        size_t shard_end = shard_first + (size_t)shard->map.num_words * sizeof(uint64_t);
+        size_t from = (shard_first > first_byte) ? shard_first : first_byte;
+        size_t to = (shard_end < first_byte + fs->block_size) ? shard_end : first_byte + fs->block_size;
+        if (from >= to)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        memcpy(block + (from - first_byte), (uint8_t *)shard->map.words + (from - shard_first), to - from);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    for (uint32_t i = 0; i < fs->journal.num_freed; i++)
+    {
+        uint32_t block_num = fs->journal.freed[i];
+        if (block_num / fs->bits_per_block == index)
+        {
+            block[(block_num % fs->bits_per_block) / 8] &= ~(1 << (block_num % 8));
+        }
+    }
+}
+
+// Helper function to checksum a commit (FNV-1a, one 32-bit word at a time)
+static uint32_t journal_checksum(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+    {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(uint32_t));
+        hash = (hash ^ word) * 16777619u;
+    }
+    return hash;
 }
@@ -0,0 +1,1133 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include "include/fs.h"
+#include "include/fs_layout.h"
+
+/*
+ * fs_fsck: offline consistency check and dump of a disk image
+ *
+ * Usage: fs_fsck [options] <image>
+ *   -t <threads>   threads scanning the inodes (default: # of CPUs)
+ *   -v             print the layout of every file
+ *   -i <inode>     print the layout of that file only
+ *
+ * The image is mapped read-only and never written: when the fs was not
+ * cleanly unmounted, the last complete journal commit is applied in memory
+ * only, as mount would before using the image. Checked:
+ *   - superblock: magic, geometry, regions within the disk & in order
+ *   - journal: both slots, blocks logged outside the disk or in the journal
+ *   - inodes: flags, sizes, block pointers / extents within the data area
+ *   - blocks referenced twice, by one file or two (cross-links)
+ *   - allocation bitmap against the blocks actually referenced
+ * Inodes are split between the threads, which claim each block they find
+ * with an atomic compare-and-swap (so a block is owned by a single inode).
+ *
+ * Exit status: 0 if clean, 1 if problems were found, 2 if the image could
+ * not be checked at all.
+ */
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_CHUNK 256      // inodes a thread takes from the queue at once
+#define FSCK_MAX_EXAMPLES 8 // bitmap mismatches listed before just counting
+
+// Problem found in an inode (printed in inode order once the scan is over)
+typedef struct
+{
+    uint32_t inode;
+    uint32_t sequence; // order found in, w/in the inode
+    bool warning;
+    char message[120];
+} problem_t;
+
+typedef struct
+{
+    problem_t *items;
+    size_t count;
+    size_t capacity;
+} problem_list_t;
+
+// What the scan found about one inode
+typedef struct
+{
+    bool valid;
+    bool inline_data;
+    uint64_t size;
+    uint32_t data_blocks;
+    uint32_t meta_blocks; // pointer/extent blocks
+    uint32_t fragments;   // runs of physically contiguous data blocks
+    extent_t *runs;       // those runs, when the inode is dumped
+    uint32_t num_runs;
+    uint32_t runs_capacity;
+} inode_report_t;
+
+// Image being checked, with its geometry derived as init_geometry() does
+typedef struct
+{
+    const uint8_t *base;
+    size_t length;
+    superblock_t sb;
+    uint32_t block_size;
+    uint32_t inode_size;
+    uint32_t inode_bytes;
+    uint32_t inodes_per_block;
+    uint32_t pointers_per_block;
+    uint32_t max_extents;
+    uint32_t inline_capacity;
+    uint32_t num_inodes;
+    uint32_t first_data;
+    uint64_t max_file_size;
+    bool extents;
+    bool large_files;
+    bool inline_data;
+    bool journal;
+
+    const uint8_t **replayed; // journal copy of a block (NULL: home location)
+    uint32_t *owners;         // inode + 1 referencing each block (0: none)
+    inode_report_t *reports;
+    uint32_t next_inode;      // work queue: first inode not taken yet
+    bool dump_all;
+    int64_t dump_inode;
+
+    uint32_t errors;
+    uint32_t warnings;
+} image_t;
+
+// One scanning thread
+typedef struct
+{
+    image_t *img;
+    pthread_t thread;
+    problem_list_t problems;
+} worker_t;
+
+// State of the walk of one inode's block map
+typedef struct
+{
+    worker_t *worker;
+    uint32_t inode;
+    inode_report_t *report;
+    uint32_t last_block;     // last data block found (0: none yet)
+    uint64_t mapped_end;     // 1 + highest file block # mapped
+    uint32_t sequence;
+} walk_t;
+
+// Helper function to get a monotonic timestamp in ns
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Helper function to print a problem of the image as a whole
+static void image_problem(image_t *img, bool warning, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("%s: ", warning ? "warning" : "error");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+
+    if (warning)
+    {
+        img->warnings++;
+    }
+    else
+    {
+        img->errors++;
+    }
+}
+
+// Helper function to record a problem of an inode (see problem_t)
+static void inode_problem(walk_t *walk, bool warning, const char *format, ...)
+{
+    problem_list_t *list = &walk->worker->problems;
+    if (list->count == list->capacity)
+    {
+        size_t capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        problem_t *items = (problem_t *)realloc(list->items, capacity * sizeof(problem_t));
+        if (items == NULL)
+        {
+            return; // out of memory: keep what we have
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    problem_t *problem = &list->items[list->count++];
+    problem->inode = walk->inode;
+    problem->sequence = walk->sequence++;
+    problem->warning = warning;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(problem->message, sizeof(problem->message), format, args);
+    va_end(args);
+}
+
+// Helper function to locate a block: in the replayed commit, else at home
+static const uint8_t *block_at(image_t *img, uint32_t block_num)
+{
+    if (img->replayed != NULL && img->replayed[block_num] != NULL)
+    {
+        return img->replayed[block_num];
+    }
+    return img->base + (size_t)block_num * img->block_size;
+}
+
+// Helper function to checksum a commit (same as journal_checksum in fs.c)
+static uint32_t journal_checksum(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+    {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(uint32_t));
+        hash = (hash ^ word) * 16777619u;
+    }
+    return hash;
+}
+
+// Helper function to read a bit of the on-disk allocation bitmap
+static bool bitmap_bit(image_t *img, uint32_t block_num)
+{
+    uint32_t bits_per_block = img->block_size * 8;
+    const uint8_t *block = block_at(img, img->sb.bitmap_start + block_num / bits_per_block);
+    uint32_t bit = block_num % bits_per_block;
+    return (block[bit / 8] >> (bit % 8)) & 1;
+}
+
+
+/****************************************************************/
+/* Superblock & journal                                         */
+/****************************************************************/
+
+// Helper function to check the superblock and derive the geometry from it
+// -> false if the rest of the image cannot be trusted enough to be checked
+static bool check_superblock(image_t *img)
+{
+    // 1. Magic # & sizes (images formatted before the sizes could be chosen read as 0)
+    if (img->length < sizeof(superblock_t) || memcmp(img->base, MAGIC_NUMBER, 16) != 0)
+    {
+        image_problem(img, false, "bad magic number: not a disk image");
+        return false;
+    }
+    memcpy(&img->sb, img->base, sizeof(superblock_t));
+    superblock_t *sb = &img->sb;
+
+    img->block_size = sb->block_size ? sb->block_size : FS_DEFAULT_BLOCK_SIZE;
+    img->inode_size = sb->inode_size ? sb->inode_size : INODE_SIZE;
+    if (img->block_size < FS_MIN_BLOCK_SIZE || img->block_size > FS_MAX_BLOCK_SIZE ||
+        (img->block_size & (img->block_size - 1)) != 0 || img->inode_size < INODE_SIZE ||
+        img->inode_size > img->block_size || (img->inode_size & (img->inode_size - 1)) != 0)
+    {
+        image_problem(img, false, "bad geometry: %u-byte blocks, %u-byte inodes", img->block_size, img->inode_size);
+        return false;
+    }
+
+    // 2. Features
+    img->extents = (sb->flags & FS_FLAG_EXTENTS) != 0;
+    img->journal = (sb->flags & FS_FLAG_JOURNAL) != 0;
+    img->large_files = (sb->flags & FS_FLAG_LARGE_FILES) != 0;
+    img->inline_data = (sb->flags & FS_FLAG_INLINE_DATA) != 0;
+    if (sb->flags & ~(uint32_t)(FS_FLAG_EXTENTS | FS_FLAG_JOURNAL | FS_FLAG_LARGE_FILES | FS_FLAG_INLINE_DATA))
+    {
+        image_problem(img, true, "unknown feature flags 0x%x", sb->flags);
+    }
+    if (img->large_files && img->inode_size < LARGE_INODE_SIZE)
+    {
+        image_problem(img, false, "large files need inodes of %u+ bytes, not %u", LARGE_INODE_SIZE, img->inode_size);
+        return false;
+    }
+    if (sb->state > FS_STATE_DIRTY)
+    {
+        image_problem(img, true, "unknown state %u", sb->state);
+    }
+
+    // 3. Regions: superblock, inodes, bitmap, journal, data, all within the image
+    uint64_t image_blocks = img->length / img->block_size;
+    if (sb->num_blocks > image_blocks)
+    {
+        image_problem(img, false, "%u blocks, but the image only holds %llu", sb->num_blocks,
+                      (unsigned long long)image_blocks);
+        return false;
+    }
+    uint64_t journal_blocks = img->journal ? sb->num_journal_blocks : 0;
+    uint64_t first_data = 1 + (uint64_t)sb->num_inode_blocks + sb->num_bitmap_blocks + journal_blocks;
+    if (sb->num_inode_blocks == 0 || first_data >= sb->num_blocks)
+    {
+        image_problem(img, false, "no room for data: %u inode, %u bitmap & %llu journal blocks out of %u",
+                      sb->num_inode_blocks, sb->num_bitmap_blocks, (unsigned long long)journal_blocks, sb->num_blocks);
+        return false;
+    }
+    if (sb->bitmap_start != 0 &&
+        (sb->bitmap_start != 1 + sb->num_inode_blocks ||
+         (uint64_t)sb->num_bitmap_blocks * img->block_size * 8 < sb->num_blocks))
+    {
+        image_problem(img, false, "bitmap (%u blocks from %u) does not follow the inodes or cover the disk",
+                      sb->num_bitmap_blocks, sb->bitmap_start);
+        return false;
+    }
+    if (img->journal &&
+        (sb->bitmap_start == 0 || sb->journal_start != sb->bitmap_start + sb->num_bitmap_blocks ||
+         sb->num_journal_blocks < JOURNAL_MIN_BLOCKS))
+    {
+        image_problem(img, false, "journal (%u blocks from %u) does not follow the bitmap or is too small",
+                      sb->num_journal_blocks, sb->journal_start);
+        return false;
+    }
+    img->first_data = (uint32_t)first_data;
+
+    // 4. Derived geometry
+    img->inodes_per_block = img->block_size / img->inode_size;
+    img->num_inodes = sb->num_inode_blocks * img->inodes_per_block;
+    img->pointers_per_block = img->block_size / sizeof(uint32_t);
+    img->max_extents = INLINE_EXTENTS + img->block_size / sizeof(extent_t);
+    img->inode_bytes = img->large_files ? sizeof(inode_t) : INODE_SIZE;
+    img->inline_capacity = img->inline_data ? INLINE_DATA_BYTES + img->inode_size - img->inode_bytes : 0;
+
+    uint64_t pointers = img->pointers_per_block;
+    uint64_t max_blocks = 4 + pointers + pointers * pointers;
+    uint64_t max_size = UINT32_MAX;
+    if (img->large_files)
+    {
+        max_blocks += pointers * pointers * pointers;
+        max_size = UINT64_MAX;
+    }
+    if (img->extents || max_blocks > UINT32_MAX)
+    {
+        max_blocks = UINT32_MAX;
+    }
+    img->max_file_size = max_blocks * img->block_size;
+    if (img->max_file_size > max_size)
+    {
+        img->max_file_size = max_size;
+    }
+    return true;
+}
+
+// Helper function to find the commit in a journal slot (see read_commit in fs.c)
+// -> returns the # of blocks it logs (0 if there is no complete one)
+static uint32_t find_commit(image_t *img, uint32_t slot, uint32_t *sequence)
+{
+    uint32_t slot_blocks = img->sb.num_journal_blocks / 2;
+    uint32_t entries = JOURNAL_ENTRIES(img->block_size);
+    uint32_t capacity = (slot_blocks - 2 < entries) ? slot_blocks - 2 : entries;
+    uint32_t start = img->sb.journal_start + slot * slot_blocks;
+
+    journal_header_t descriptor;
+    memcpy(&descriptor, img->base + (size_t)start * img->block_size, sizeof(journal_header_t));
+    if (descriptor.magic != JOURNAL_DESCRIPTOR || descriptor.count == 0 || descriptor.count > capacity)
+    {
+        return 0;
+    }
+
+    // the log of a commit is contiguous: checksum it in place
+    journal_header_t commit;
+    size_t log_length = (size_t)(descriptor.count + 1) * img->block_size;
+    memcpy(&commit, img->base + (size_t)start * img->block_size + log_length, sizeof(journal_header_t));
+    if (commit.magic != JOURNAL_COMMIT || commit.sequence != descriptor.sequence || commit.count != descriptor.count ||
+        commit.checksum != journal_checksum(img->base + (size_t)start * img->block_size, log_length))
+    {
+        return 0;
+    }
+
+    *sequence = descriptor.sequence;
+    return descriptor.count;
+}
+
+// Helper function to check the journal and, if the fs was not cleanly
+// unmounted, apply its last complete commit (in memory, see block_at)
+static bool check_journal(image_t *img)
+{
+    if (!img->journal)
+    {
+        return true;
+    }
+
+    // 1. Find the latest complete commit
+    int latest = -1;
+    uint32_t latest_sequence = 0;
+    uint32_t latest_count = 0;
+    printf("journal:");
+    for (uint32_t slot = 0; slot < 2; slot++)
+    {
+        uint32_t sequence = 0;
+        uint32_t count = find_commit(img, slot, &sequence);
+        if (count == 0)
+        {
+            printf(" slot %u empty%s", slot, slot == 0 ? "," : "\n");
+            continue;
+        }
+        printf(" slot %u commit #%u (%u blocks)%s", slot, sequence, count, slot == 0 ? "," : "\n");
+        if (latest < 0 || sequence > latest_sequence)
+        {
+            latest = (int)slot;
+            latest_sequence = sequence;
+            latest_count = count;
+        }
+    }
+    if (latest < 0 || img->sb.state == FS_STATE_CLEAN)
+    {
+        return true; // nothing logged, or all of it checkpointed already
+    }
+
+    // 2. Replay it: every logged block is read from the log from now on
+    img->replayed = (const uint8_t **)calloc(img->sb.num_blocks, sizeof(const uint8_t *));
+    if (img->replayed == NULL)
+    {
+        image_problem(img, false, "out of memory");
+        return false;
+    }
+    uint32_t start = img->sb.journal_start + (uint32_t)latest * (img->sb.num_journal_blocks / 2);
+    const uint8_t *log = img->base + (size_t)start * img->block_size;
+    const uint32_t *blocks = (const uint32_t *)(log + sizeof(journal_header_t));
+    for (uint32_t i = 0; i < latest_count; i++)
+    {
+        if (blocks[i] >= img->sb.num_blocks || (blocks[i] >= img->sb.journal_start && blocks[i] < img->first_data))
+        {
+            image_problem(img, false, "journal commit #%u logs block %u, outside the disk or in the journal",
+                          latest_sequence, blocks[i]);
+            return false; // mount refuses it too
+        }
+        img->replayed[blocks[i]] = log + (size_t)(i + 1) * img->block_size;
+    }
+    printf("journal: not cleanly unmounted, commit #%u replayed (in memory)\n", latest_sequence);
+
+    // 3. The superblock may have been replayed too: only its state may differ
+    superblock_t replayed_sb;
+    memcpy(&replayed_sb, block_at(img, 0), sizeof(superblock_t));
+    if (memcmp(replayed_sb.magic, MAGIC_NUMBER, 16) != 0 || replayed_sb.num_blocks != img->sb.num_blocks ||
+        replayed_sb.flags != img->sb.flags || replayed_sb.block_size != img->sb.block_size ||
+        replayed_sb.inode_size != img->sb.inode_size)
+    {
+        image_problem(img, false, "journal commit #%u holds a different superblock", latest_sequence);
+        return false;
+    }
+    img->sb.state = replayed_sb.state;
+    return true;
+}
+
+
+/****************************************************************/
+/* Inode scan (threads)                                         */
+/****************************************************************/
+
+// Helper function to claim a block for the inode being walked
+// -> false if it is out of the data area or already taken: its content
+//    must not be followed then
+static bool claim_block(walk_t *walk, uint32_t block_num, const char *what)
+{
+    image_t *img = walk->worker->img;
+    if (block_num >= img->sb.num_blocks)
+    {
+        inode_problem(walk, false, "%s block %u beyond the end of the disk (%u blocks)", what, block_num,
+                      img->sb.num_blocks);
+        return false;
+    }
+    if (block_num < img->first_data)
+    {
+        inode_problem(walk, false, "%s block %u in the metadata area (data starts at %u)", what, block_num,
+                      img->first_data);
+        return false;
+    }
+
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&img->owners[block_num], &expected, walk->inode + 1, false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED))
+    {
+        return true;
+    }
+    if (expected == walk->inode + 1)
+    {
+        inode_problem(walk, false, "%s block %u referenced twice by the file", what, block_num);
+    }
+    else
+    {
+        inode_problem(walk, false, "%s block %u cross-linked with inode %u", what, block_num, expected - 1);
+    }
+    return false;
+}
+
+// Helper function to account for a data block at a given file block #
+static void add_data_block(walk_t *walk, uint32_t block_num, uint64_t file_block)
+{
+    if (!claim_block(walk, block_num, "data"))
+    {
+        return;
+    }
+
+    inode_report_t *report = walk->report;
+    report->data_blocks++;
+    if (file_block + 1 > walk->mapped_end)
+    {
+        walk->mapped_end = file_block + 1;
+    }
+
+    // 1. Same run as the previous block?
+    if (walk->last_block != 0 && block_num == walk->last_block + 1)
+    {
+        walk->last_block = block_num;
+        if (report->runs != NULL)
+        {
+            report->runs[report->num_runs - 1].length++;
+        }
+        return;
+    }
+
+    // 2. New fragment
+    walk->last_block = block_num;
+    report->fragments++;
+    image_t *img = walk->worker->img;
+    if (!img->dump_all && img->dump_inode != walk->inode)
+    {
+        return;
+    }
+    if (report->num_runs == report->runs_capacity)
+    {
+        uint32_t capacity = (report->runs_capacity == 0) ? 16 : report->runs_capacity * 2;
+        extent_t *runs = (extent_t *)realloc(report->runs, capacity * sizeof(extent_t));
+        if (runs == NULL)
+        {
+            return; // the layout printed will be incomplete
+        }
+        report->runs = runs;
+        report->runs_capacity = capacity;
+    }
+    report->runs[report->num_runs].start = block_num;
+    report->runs[report->num_runs].length = 1;
+    report->num_runs++;
+}
+
+// Helper function to walk a pointer block (depth 1: it points to data blocks)
+static void walk_pointer_tree(walk_t *walk, uint32_t block_num, uint32_t depth, uint64_t first_file_block)
+{
+    image_t *img = walk->worker->img;
+    if (!claim_block(walk, block_num, depth == 1 ? "indirect" : "pointer"))
+    {
+        return;
+    }
+    walk->report->meta_blocks++;
+
+    uint64_t span = 1; // file blocks per entry
+    for (uint32_t i = 1; i < depth; i++)
+    {
+        span *= img->pointers_per_block;
+    }
+
+    // copy the entries: the pointers of a replayed block live in the log
+    uint32_t pointers[img->pointers_per_block];
+    memcpy(pointers, block_at(img, block_num), img->block_size);
+    for (uint32_t i = 0; i < img->pointers_per_block; i++)
+    {
+        if (pointers[i] == 0)
+        {
+            continue; // hole
+        }
+        if (depth > 1)
+        {
+            walk_pointer_tree(walk, pointers[i], depth - 1, first_file_block + i * span);
+        }
+        else
+        {
+            add_data_block(walk, pointers[i], first_file_block + i);
+        }
+    }
+}
+
+// Helper function to walk the block map of a file in the default format
+static void walk_pointers(walk_t *walk, const inode_t *inode)
+{
+    image_t *img = walk->worker->img;
+    uint64_t pointers = img->pointers_per_block;
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        if (inode->direct_blocks[i] != 0)
+        {
+            add_data_block(walk, inode->direct_blocks[i], i);
+        }
+    }
+    if (inode->indirect_block != 0)
+    {
+        walk_pointer_tree(walk, inode->indirect_block, 1, 4);
+    }
+    if (inode->double_indirect_block != 0)
+    {
+        walk_pointer_tree(walk, inode->double_indirect_block, 2, 4 + pointers);
+    }
+    if (inode->triple_indirect_block != 0)
+    {
+        walk_pointer_tree(walk, inode->triple_indirect_block, 3, 4 + pointers + pointers * pointers);
+    }
+}
+
+// Helper function to walk the extents of a file (FS_FLAG_EXTENTS)
+static void walk_extents(walk_t *walk, const inode_t *inode)
+{
+    image_t *img = walk->worker->img;
+    uint32_t count = inode->extent_count;
+    if (count > img->max_extents)
+    {
+        inode_problem(walk, false, "%u extents, at most %u fit", count, img->max_extents);
+        count = img->max_extents;
+    }
+
+    // 1. Block holding the extents past the first INLINE_EXTENTS
+    const uint32_t *entries = NULL;
+    if (inode->extent_block != 0 && claim_block(walk, inode->extent_block, "extent"))
+    {
+        walk->report->meta_blocks++;
+        entries = (const uint32_t *)block_at(img, inode->extent_block);
+    }
+    if (count > INLINE_EXTENTS && entries == NULL)
+    {
+        inode_problem(walk, false, "%u extents, but no usable extent block", count);
+        count = INLINE_EXTENTS;
+    }
+
+    // 2. Every extent, in file order (a start of 0 is a hole)
+    uint64_t file_block = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        extent_t extent;
+        if (i < INLINE_EXTENTS)
+        {
+            extent = inode->extents[i];
+        }
+        else
+        {
+            memcpy(&extent, entries + (i - INLINE_EXTENTS) * 2, sizeof(extent_t));
+        }
+
+        if (extent.start != 0 && (uint64_t)extent.start + extent.length > img->sb.num_blocks)
+        {
+            inode_problem(walk, false, "extent %u (%u blocks from %u) beyond the end of the disk", i, extent.length,
+                          extent.start);
+        }
+        else if (extent.start != 0)
+        {
+            for (uint32_t k = 0; k < extent.length; k++)
+            {
+                add_data_block(walk, extent.start + k, file_block + k);
+            }
+        }
+        file_block += extent.length;
+    }
+}
+
+// Helper function to check one inode and walk its blocks
+static void check_inode(worker_t *worker, uint32_t inode_num)
+{
+    image_t *img = worker->img;
+    inode_report_t *report = &img->reports[inode_num];
+    walk_t walk = { .worker = worker, .inode = inode_num, .report = report };
+
+    // 1. Copy it out of its block (only the first inode_bytes are an inode_t)
+    inode_t inode;
+    memset(&inode, 0, sizeof(inode_t));
+    const uint8_t *block = block_at(img, 1 + inode_num / img->inodes_per_block);
+    memcpy(&inode, block + (size_t)(inode_num % img->inodes_per_block) * img->inode_size, img->inode_bytes);
+    if (inode.valid == 0)
+    {
+        return;
+    }
+    if (inode.valid != 1)
+    {
+        inode_problem(&walk, false, "valid byte is %u", inode.valid);
+    }
+
+    // 2. Size, flags, then the blocks
+    report->valid = true;
+    report->size = ((uint64_t)inode.size_high << 32) | inode.size;
+    if (report->size > img->max_file_size)
+    {
+        inode_problem(&walk, false, "size %llu over the max file size %llu", (unsigned long long)report->size,
+                      (unsigned long long)img->max_file_size);
+    }
+    if (inode.flags & ~INODE_INLINE)
+    {
+        inode_problem(&walk, true, "unknown flags 0x%x", inode.flags);
+    }
+
+    if (inode.flags & INODE_INLINE)
+    {
+        report->inline_data = true;
+        if (!img->inline_data)
+        {
+            inode_problem(&walk, false, "inline data on a disk formatted without");
+        }
+        else if (report->size > img->inline_capacity)
+        {
+            inode_problem(&walk, false, "inline file of %llu bytes, at most %u fit",
+                          (unsigned long long)report->size, img->inline_capacity);
+        }
+        return;
+    }
+
+    if (img->extents)
+    {
+        walk_extents(&walk, &inode);
+    }
+    else
+    {
+        walk_pointers(&walk, &inode);
+    }
+
+    // 3. Blocks past the end of the file
+    uint64_t size_blocks = (report->size + img->block_size - 1) / img->block_size;
+    if (walk.mapped_end > size_blocks)
+    {
+        inode_problem(&walk, true, "blocks mapped up to file block %llu, past its size (%llu bytes)",
+                      (unsigned long long)walk.mapped_end - 1, (unsigned long long)report->size);
+    }
+}
+
+// Thread: takes chunks of inodes off the queue until there are none left
+static void *scan_worker(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    image_t *img = worker->img;
+
+    for (;;)
+    {
+        uint32_t first = __atomic_fetch_add(&img->next_inode, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (first >= img->num_inodes)
+        {
+            break;
+        }
+        uint32_t last = (img->num_inodes - first < FSCK_CHUNK) ? img->num_inodes : first + FSCK_CHUNK;
+        for (uint32_t i = first; i < last; i++)
+        {
+            check_inode(worker, i);
+        }
+    }
+    return NULL;
+}
+
+static int compare_problems(const void *a, const void *b)
+{
+    const problem_t *x = (const problem_t *)a;
+    const problem_t *y = (const problem_t *)b;
+    if (x->inode != y->inode)
+    {
+        return (x->inode > y->inode) - (x->inode < y->inode);
+    }
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+// Helper function to scan every inode with `threads` threads, then print
+// what they found in inode order
+static bool scan_inodes(image_t *img, uint32_t threads)
+{
+    worker_t *workers = (worker_t *)calloc(threads, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        image_problem(img, false, "out of memory");
+        return false;
+    }
+
+    // 1. Scan (falls back to the calling thread if none can be started)
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        workers[i].img = img;
+        if (pthread_create(&workers[i].thread, NULL, scan_worker, &workers[i]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+    if (started == 0)
+    {
+        scan_worker(&workers[0]);
+        started = 1;
+    }
+    else
+    {
+        for (uint32_t i = 0; i < started; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    // 2. Merge the problems found
+    size_t total = 0;
+    for (uint32_t i = 0; i < started; i++)
+    {
+        total += workers[i].problems.count;
+    }
+    problem_t *all = (problem_t *)malloc((total ? total : 1) * sizeof(problem_t));
+    if (all != NULL)
+    {
+        size_t count = 0;
+        for (uint32_t i = 0; i < started; i++)
+        {
+            if (workers[i].problems.count > 0)
+            {
+                memcpy(all + count, workers[i].problems.items, workers[i].problems.count * sizeof(problem_t));
+                count += workers[i].problems.count;
+            }
+        }
+        qsort(all, total, sizeof(problem_t), compare_problems);
+        for (size_t i = 0; i < total; i++)
+        {
+            printf("%s: inode %u: %s\n", all[i].warning ? "warning" : "error", all[i].inode, all[i].message);
+            if (all[i].warning)
+            {
+                img->warnings++;
+            }
+            else
+            {
+                img->errors++;
+            }
+        }
+    }
+
+    bool merged = (all != NULL);
+    for (uint32_t i = 0; i < started; i++)
+    {
+        free(workers[i].problems.items);
+    }
+    free(workers);
+    free(all);
+    return merged;
+}
+
+
+/****************************************************************/
+/* Bitmap & report                                              */
+/****************************************************************/
+
+// Helper function to compare the on-disk bitmap with the blocks in use
+// -> only when it is meant to be up to date (see mount: it is rebuilt otherwise)
+static void check_bitmap(image_t *img)
+{
+    if (img->sb.bitmap_start == 0)
+    {
+        printf("bitmap: none (rebuilt at every mount)\n");
+        return;
+    }
+    if (img->sb.state != FS_STATE_CLEAN && !img->journal)
+    {
+        printf("bitmap: not checked, the fs was not cleanly unmounted (rebuilt at mount)\n");
+        return;
+    }
+
+    uint32_t marked_free = 0;
+    uint32_t leaked = 0;
+    for (uint32_t i = 0; i < img->sb.num_blocks; i++)
+    {
+        bool in_use = (i < img->first_data) || img->owners[i] != 0;
+        bool marked = bitmap_bit(img, i);
+        if (in_use && !marked)
+        {
+            if (marked_free++ < FSCK_MAX_EXAMPLES)
+            {
+                if (i < img->first_data)
+                {
+                    image_problem(img, false, "block %u (metadata) free in the bitmap", i);
+                }
+                else
+                {
+                    image_problem(img, false, "block %u (inode %u) free in the bitmap", i, img->owners[i] - 1);
+                }
+            }
+        }
+        else if (!in_use && marked)
+        {
+            leaked++;
+        }
+    }
+
+    if (marked_free > FSCK_MAX_EXAMPLES)
+    {
+        image_problem(img, false, "... %u blocks in use are free in the bitmap", marked_free);
+    }
+    if (leaked > 0)
+    {
+        image_problem(img, true, "%u blocks used in the bitmap but referenced by no file (lost)", leaked);
+    }
+}
+
+// Helper function to print the layout of one file
+static void print_inode(image_t *img, uint32_t inode_num)
+{
+    inode_report_t *report = &img->reports[inode_num];
+    if (!report->valid)
+    {
+        printf("inode %u: free\n", inode_num);
+        return;
+    }
+    if (report->inline_data)
+    {
+        printf("inode %u: %llu bytes, inline\n", inode_num, (unsigned long long)report->size);
+        return;
+    }
+
+    printf("inode %u: %llu bytes, %u data + %u %s blocks, %u fragment%s\n", inode_num,
+           (unsigned long long)report->size, report->data_blocks, report->meta_blocks,
+           img->extents ? "extent" : "pointer", report->fragments, report->fragments == 1 ? "" : "s");
+    for (uint32_t i = 0; i < report->num_runs; i++)
+    {
+        const extent_t *run = &report->runs[i];
+        if (run->length == 1)
+        {
+            printf("%s%u", (i % 8 == 0) ? "    " : " ", run->start);
+        }
+        else
+        {
+            printf("%s%u-%u", (i % 8 == 0) ? "    " : " ", run->start, run->start + run->length - 1);
+        }
+        if (i % 8 == 7 || i + 1 == report->num_runs)
+        {
+            printf("\n");
+        }
+    }
+}
+
+// Helper function to print the totals & fragmentation of the image
+static void print_summary(image_t *img)
+{
+    // 1. Files
+    uint32_t files = 0;
+    uint32_t inline_files = 0;
+    uint32_t fragmented = 0;
+    uint64_t data_blocks = 0;
+    uint64_t meta_blocks = 0;
+    uint64_t fragments = 0;
+    uint32_t max_fragments = 0;
+    uint32_t most_fragmented = 0;
+    for (uint32_t i = 0; i < img->num_inodes; i++)
+    {
+        inode_report_t *report = &img->reports[i];
+        if (!report->valid)
+        {
+            continue;
+        }
+        files++;
+        inline_files += report->inline_data;
+        data_blocks += report->data_blocks;
+        meta_blocks += report->meta_blocks;
+        fragments += report->fragments;
+        fragmented += (report->fragments > 1);
+        if (report->fragments > max_fragments)
+        {
+            max_fragments = report->fragments;
+            most_fragmented = i;
+        }
+    }
+    uint32_t block_files = files - inline_files;
+    printf("files: %u of %u inodes (%u inline), %llu data + %llu %s blocks\n", files, img->num_inodes, inline_files,
+           (unsigned long long)data_blocks, (unsigned long long)meta_blocks, img->extents ? "extent" : "pointer");
+    if (max_fragments > 0)
+    {
+        printf("fragmentation: %u of %u files in several pieces, %.2f fragments per file (max %u, inode %u)\n",
+               fragmented, block_files, block_files ? (double)fragments / block_files : 0.0, max_fragments,
+               most_fragmented);
+    }
+
+    // 2. Free space: runs of unreferenced data blocks
+    uint32_t free_blocks = 0;
+    uint32_t free_runs = 0;
+    uint32_t largest_run = 0;
+    uint32_t run = 0;
+    for (uint32_t i = img->first_data; i <= img->sb.num_blocks; i++)
+    {
+        if (i < img->sb.num_blocks && img->owners[i] == 0)
+        {
+            free_blocks++;
+            run++;
+            continue;
+        }
+        if (run > 0)
+        {
+            free_runs++;
+            largest_run = (run > largest_run) ? run : largest_run;
+        }
+        run = 0;
+    }
+    printf("free space: %u of %u data blocks, in %u run%s (largest %u blocks)\n", free_blocks,
+           img->sb.num_blocks - img->first_data, free_runs, free_runs == 1 ? "" : "s", largest_run);
+}
+
+
+/****************************************************************/
+/* Command line                                                 */
+/****************************************************************/
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-v] [-i inode] <image>\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    image_t img;
+    memset(&img, 0, sizeof(img));
+    img.dump_inode = -1;
+    const char *image_name = NULL;
+    int cpus = get_nprocs();
+    uint32_t threads = (cpus > 0) ? (uint32_t)cpus : 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(arg, "-v") == 0)
+        {
+            img.dump_all = true;
+        }
+        else if (arg[0] != '-' && image_name == NULL)
+        {
+            image_name = arg;
+        }
+        else if (value == NULL)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            threads = (uint32_t)atoi(value);
+            i++;
+        }
+        else if (strcmp(arg, "-i") == 0)
+        {
+            img.dump_inode = atoi(value);
+            i++;
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (image_name == NULL)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+    if (threads > FSCK_MAX_THREADS)
+    {
+        threads = FSCK_MAX_THREADS;
+    }
+
+    // 1. Map the image (read-only: nothing is ever written back)
+    //    -> through stdio: fs.h takes the names of read/write/stat
+    FILE *file = fopen(image_name, "rb");
+    off_t length = (file != NULL && fseeko(file, 0, SEEK_END) == 0) ? ftello(file) : 0;
+    if (length <= 0)
+    {
+        fprintf(stderr, "cannot open %s\n", image_name);
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return 2;
+    }
+    img.length = (size_t)length;
+    void *base = mmap(NULL, img.length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "cannot map %s\n", image_name);
+        return 2;
+    }
+    img.base = (const uint8_t *)base;
+
+    // 2. Superblock & journal
+    uint64_t start = now_ns();
+    if (!check_superblock(&img))
+    {
+        munmap(base, img.length);
+        return 2;
+    }
+    const char *state = (img.sb.state == FS_STATE_CLEAN) ? "clean" : (img.sb.state == FS_STATE_DIRTY) ? "dirty" : "none";
+    printf("image %s: %u blocks of %u B, %u inodes of %u B, state %s\n", image_name, img.sb.num_blocks,
+           img.block_size, img.num_inodes, img.inode_size, state);
+    printf("features:%s%s%s%s%s\n", img.extents ? " extents" : " block-pointers", img.journal ? " journal" : "",
+           img.large_files ? " large-files" : "", img.inline_data ? " inline-data" : "",
+           img.sb.bitmap_start ? " bitmap" : "");
+    printf("layout: inodes 1-%u", img.sb.num_inode_blocks);
+    if (img.sb.bitmap_start != 0)
+    {
+        printf(", bitmap %u-%u", img.sb.bitmap_start, img.sb.bitmap_start + img.sb.num_bitmap_blocks - 1);
+    }
+    if (img.journal)
+    {
+        printf(", journal %u-%u", img.sb.journal_start, img.sb.journal_start + img.sb.num_journal_blocks - 1);
+    }
+    printf(", data %u-%u\n", img.first_data, img.sb.num_blocks - 1);
+
+    if (!check_journal(&img))
+    {
+        free(img.replayed);
+        munmap(base, img.length);
+        return 2;
+    }
+
+    // 3. Inodes, in parallel
+    img.owners = (uint32_t *)calloc(img.sb.num_blocks, sizeof(uint32_t));
+    img.reports = (inode_report_t *)calloc(img.num_inodes, sizeof(inode_report_t));
+    if (img.owners == NULL || img.reports == NULL || !scan_inodes(&img, threads))
+    {
+        fprintf(stderr, "out of memory\n");
+        free(img.owners);
+        free(img.reports);
+        free(img.replayed);
+        munmap(base, img.length);
+        return 2;
+    }
+
+    // 4. Bitmap, then what was found
+    check_bitmap(&img);
+    uint64_t elapsed = now_ns() - start;
+    if (img.dump_all)
+    {
+        for (uint32_t i = 0; i < img.num_inodes; i++)
+        {
+            if (img.reports[i].valid)
+            {
+                print_inode(&img, i);
+            }
+        }
+    }
+    else if (img.dump_inode >= 0 && (uint64_t)img.dump_inode < img.num_inodes)
+    {
+        print_inode(&img, (uint32_t)img.dump_inode);
+    }
+    print_summary(&img);
+    printf("checked in %.3f ms with %u thread%s: ", elapsed / 1e6, threads, threads == 1 ? "" : "s");
+    if (img.errors == 0 && img.warnings == 0)
+    {
+        printf("clean\n");
+    }
+    else
+    {
+        printf("%u error%s, %u warning%s\n", img.errors, img.errors == 1 ? "" : "s", img.warnings,
+               img.warnings == 1 ? "" : "s");
+    }
+
+    for (uint32_t i = 0; i < img.num_inodes; i++)
+    {
+        free(img.reports[i].runs);
+    }
+    free(img.owners);
+    free(img.reports);
+    free(img.replayed);
+    munmap(base, img.length);
+    return img.errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// 1 bit per item (set = used), plus a summary level with 1 bit per 64-bit
+// word (set = word is full) so that free bits are found without walking
+// every word of a nearly-full map
+typedef struct {
+    uint64_t *words;
+    uint64_t *summary;
+    uint32_t num_bits;
+    uint32_t num_words;
+    uint32_t num_summary_words;
+    uint32_t num_free;
+    uint32_t hint; // next-fit: where the next search starts
+} BITMAP;
+
+int bitmap_init(BITMAP *bm, uint32_t num_bits);
+void bitmap_destroy(BITMAP *bm);
+void bitmap_set(BITMAP *bm, uint32_t bit);
+void bitmap_clear(BITMAP *bm, uint32_t bit);
+void bitmap_refresh(BITMAP *bm);
+bool bitmap_test(const BITMAP *bm, uint32_t bit);
+int64_t bitmap_find_free(BITMAP *bm);
+uint32_t bitmap_claim_run(BITMAP *bm, uint32_t start, uint32_t max_len);
+
+#endif
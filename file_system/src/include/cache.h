@@ -0,0 +1,64 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "vdisk.h"
+
+#define CACHE_DEFAULT_BLOCKS 1024 // 1 MiB worth of 1 KiB blocks
+#define CACHE_MAX_PREFETCH 64     // max # of blocks pulled in by one prefetch
+
+// Counters exposed to the user (see fs_cache_stats)
+typedef struct {
+    uint64_t hits;       // lookups served from memory
+    uint64_t misses;     // lookups that had to go to the disk
+    uint64_t evictions;  // blocks dropped to make room
+    uint64_t writebacks; // dirty blocks written back to the disk
+    uint64_t prefetches; // blocks read in ahead of use (readahead)
+} cache_stats_t;
+
+// One cached block (data lives in CACHE.data at idx * block_size)
+typedef struct {
+    uint32_t sector;
+    bool valid;
+    bool dirty;
+    int32_t hash_next; // next entry in the same hash bucket
+    int32_t lru_prev;  // towards the most recently used entry
+    int32_t lru_next;  // towards the least recently used entry
+} cache_entry_t;
+
+// Size-bounded LRU write-back cache sitting in front of a DISK
+// -> every call is serialized by `lock`, so it can be shared by threads
+typedef struct {
+    pthread_mutex_t lock;
+    bool shared;            // used by several threads: no cache_peek pointers
+    DISK *disk;
+    uint32_t capacity;      // max # of blocks held (0 = pass-through)
+    uint32_t block_size;
+    uint32_t used;          // # of entries handed out so far
+    cache_entry_t *entries;
+    uint8_t *data;
+    int32_t *buckets;       // hash table: sector -> first entry idx
+    uint32_t bucket_mask;
+    int32_t lru_head;       // most recently used
+    int32_t lru_tail;       // least recently used
+    cache_stats_t stats;
+} CACHE;
+
+int cache_on(CACHE *cache, DISK *diskp, uint32_t capacity);
+int cache_read(CACHE *cache, uint32_t sector, uint8_t *buffer);
+int cache_write(CACHE *cache, uint32_t sector, uint8_t *buffer);
+int cache_read_range(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer);
+int cache_write_range(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer);
+int cache_read_hits(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer, vdisk_run_t *misses);
+void cache_update(CACHE *cache, uint32_t sector, uint32_t count, uint8_t *buffer);
+const uint8_t *cache_peek(CACHE *cache, uint32_t sector);
+int cache_prefetch(CACHE *cache, uint32_t sector, uint32_t count);
+void cache_get_stats(CACHE *cache, cache_stats_t *stats);
+void cache_reset_stats(CACHE *cache);
+int cache_flush(CACHE *cache);
+int cache_sync(CACHE *cache);
+void cache_off(CACHE *cache);
+
+#endif
@@ -14,5 +14,6 @@ extern const int vdisk_ESECTOR ;
 #define E_OUT_OF_INODES         -104  // No free inodes
 #define E_CORRUPT_DISK          -105  // Corrupt disk image
 #define E_INVALID_OFFSET        -106  // Invalid offset
+#define E_INVALID_GEOMETRY      -107  // Unsupported block/inode size
 
 #endif
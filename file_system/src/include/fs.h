@@ -2,13 +2,109 @@
 #define FS_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "cache.h"
+#include "vdisk.h"
 
+#define FS_DEFAULT_READAHEAD 32     // max readahead window in blocks
+#define FS_DEFAULT_APPEND_BUFFER 16 // per-file append buffer in blocks
+#define FS_DEFAULT_JOURNAL 256      // suggested journal size in blocks (see fs_format_options_t)
+#define FS_DEFAULT_BLOCK_SIZE 1024  // block size in bytes: a power of 2 between the min & max
+#define FS_MIN_BLOCK_SIZE 1024
+#define FS_MAX_BLOCK_SIZE 65536
+#define FS_DEFAULT_INODE_SIZE 32    // inode size in bytes: a power of 2, up to the block size
+
+// Optional mount parameters (see fs_mount; NULL means defaults)
+typedef struct {
+    uint32_t cache_blocks;     // block cache capacity in blocks (0 disables caching)
+    int backend;               // VDISK_BACKEND_STDIO, _MMAP (no cache) or _DIRECT (no page cache)
+    uint32_t readahead_blocks; // max blocks prefetched on sequential reads (0 disables)
+    uint32_t append_blocks;    // small appends are buffered up to this many blocks (0 disables)
+    uint32_t threads;          // # of threads calling in at once: >1 shards the block allocator
+    uint32_t io_depth;         // async I/O queue depth (0: fs_*_async run synchronously)
+    int io_engine;             // VDISK_AIO_AUTO, VDISK_AIO_URING or VDISK_AIO_THREADS
+} fs_options_t;
+
+// Optional format parameters (see fs_format; NULL means defaults)
+typedef struct {
+    bool extents;            // map file data with extents instead of block pointers
+    uint32_t journal_blocks; // size of the metadata write-ahead journal (0: no journal)
+    uint32_t block_size;     // bytes per block, FS_MIN_BLOCK_SIZE..FS_MAX_BLOCK_SIZE
+    uint32_t inode_size;     // bytes per on-disk inode, >= FS_DEFAULT_INODE_SIZE
+    bool large_files;        // 64-bit file sizes & triple indirect blocks (inodes of 64+ bytes)
+    bool inline_data;        // files that fit are stored in their inode (more room in larger ones)
+} fs_format_options_t;
+
+// Operations counted by fs_get_stats (index of fs_stats_t.ops)
+#define FS_OP_CREATE 0
+#define FS_OP_DELETE 1
+#define FS_OP_STAT   2
+#define FS_OP_READ   3 // async reads/writes are timed up to their submission
+#define FS_OP_WRITE  4
+#define FS_OP_SYNC   5
+#define FS_NUM_OPS   6
+
+#define FS_LATENCY_BUCKETS 24 // bucket 0: < 1 us, bucket i: [2^(i-1), 2^i) us, the last one: longer
+
+// Counters of one kind of operation
+typedef struct {
+    uint64_t count;
+    uint64_t errors;   // calls that returned an error code
+    uint64_t bytes;    // data moved (reads/writes)
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t latency[FS_LATENCY_BUCKETS]; // # of calls per latency bucket
+} fs_op_stats_t;
+
+// Everything counted since mount or fs_reset_stats (see fs_get_stats)
+typedef struct {
+    fs_op_stats_t ops[FS_NUM_OPS];
+    vdisk_stats_t disk;       // vdisk calls & sectors they moved
+    uint64_t pointer_lookups; // pointer/extent block entries read to map file offsets
+    uint64_t allocations;     // free block searches
+    uint64_t alloc_goal_hits; // ... satisfied at the block asked for (no scan)
+    uint64_t alloc_scanned;   // bitmap bits skipped by the others
+    uint64_t alloc_max_scan;  // longest of those scans
+    cache_stats_t cache;
+} fs_stats_t;
+
+// Mounted image (opaque): one per fs_open(), any # of them at once
+typedef struct fs FS;
+
+// Asynchronous read/write in progress (opaque, see fs_read_async)
+typedef struct fs_aio fs_aio_t;
+
+// Offsets and sizes are 64-bit, a single read/write moves at most INT_MAX bytes
+// Every call can be made from several threads: calls on different files run
+// in parallel, reads of the same file too, writes/deletes of a file are serialized
+int fs_format(char *disk_name, int inodes, const fs_format_options_t *opts);
+void fs_default_format_options(fs_format_options_t *opts);
+void fs_default_options(fs_options_t *opts);
+int fs_open(char *disk_name, const fs_options_t *opts, FS **fsp);
+int fs_close(FS *fs);
+int fs_create(FS *fs);
+int fs_delete(FS *fs, int inode_num);
+int64_t fs_stat(FS *fs, int inode_num);
+int fs_read(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset);
+int fs_write(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset);
+int fs_read_async(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t **reqp);
+int fs_write_async(FS *fs, int inode_num, uint8_t *data, int len, int64_t offset, fs_aio_t **reqp);
+bool fs_aio_done(fs_aio_t *req);
+int fs_aio_wait(fs_aio_t *req);
+int fs_sync(FS *fs);
+int fs_cache_stats(FS *fs, cache_stats_t *stats);
+int fs_get_stats(FS *fs, fs_stats_t *stats);
+int fs_reset_stats(FS *fs);
+
+// Single-image API: same calls on a default instance (see fs_default)
 int format(char *disk_name, int inodes);
-int stat(int inode_num);
+int64_t stat(int inode_num);
 int mount(char *disk_name);
+int fs_mount(char *disk_name, const fs_options_t *opts);
 int unmount();
 int create();
 int delete(int inode_num);
-int read(int inode_num, uint8_t *data, int len, int offset);
-int write(int inode_num, uint8_t *data, int len, int offset);
+int read(int inode_num, uint8_t *data, int len, int64_t offset);
+int write(int inode_num, uint8_t *data, int len, int64_t offset);
+FS *fs_default(void);
 #endif
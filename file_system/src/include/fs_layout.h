@@ -0,0 +1,97 @@
+#ifndef FS_LAYOUT_H
+#define FS_LAYOUT_H
+
+#include <stdint.h>
+
+// On-disk format of an image, shared by fs.c and the fsck tool (fsck.c)
+
+// Block & inode sizes are chosen at format time (see fs_format_options_t),
+// the layout derived from them lives in the FS (see init_geometry)
+#define INODE_SIZE 32       // bytes of an inode_t w/o the large-file fields
+#define LARGE_INODE_SIZE 64 // smallest on-disk inode holding all of an inode_t
+#define MAGIC_NUMBER "\xf0\x55\x4c\x49\x45\x47\x45\x49\x4e\x46\x4f\x30\x39\x34\x30\x0f"
+
+// Superblock states (images formatted before the on-disk bitmap read as 0)
+#define FS_STATE_CLEAN 1 // cleanly unmounted: on-disk bitmap can be trusted
+#define FS_STATE_DIRTY 2 // mounted (or crashed while mounted): rebuild it
+
+// Superblock feature flags
+#define FS_FLAG_EXTENTS 0x1 // inodes map their data with extents
+#define FS_FLAG_JOURNAL 0x2 // metadata updates go through the journal first
+#define FS_FLAG_LARGE_FILES 0x4 // 64-bit file sizes & triple indirect blocks (inodes of 64+ bytes)
+#define FS_FLAG_INLINE_DATA 0x8 // small files live in their inode (see INODE_INLINE)
+
+// Inode flags
+#define INODE_INLINE 0x1 // the file data is stored in the inode, in place of the block map
+
+#define INLINE_DATA_BYTES 24 // inline data held by the block map bytes (more past inode_bytes)
+
+#define INLINE_EXTENTS 2 // extents stored in the inode itself
+
+// Journal records (first word of a log block)
+#define JOURNAL_DESCRIPTOR 0x4a524e4c // "JRNL": list of the logged blocks
+#define JOURNAL_COMMIT     0x434d4954 // "CMIT": the commit is complete
+#define JOURNAL_MIN_BLOCKS 36         // 2 slots of descriptor + 16 blocks + commit
+
+// Super block structure
+typedef struct {
+    uint8_t magic[16];         // Magic # for SSFS
+    uint32_t num_blocks;       // Total # of blocks
+    uint32_t num_inode_blocks; // Number of inode blocks
+    uint32_t block_size;       // Block size in bytes (FS_MIN_BLOCK_SIZE..FS_MAX_BLOCK_SIZE)
+    uint32_t bitmap_start;     // First block of the allocation bitmap (0 if none)
+    uint32_t num_bitmap_blocks;// Number of allocation bitmap blocks
+    uint32_t state;            // FS_STATE_CLEAN or FS_STATE_DIRTY
+    uint32_t flags;            // FS_FLAG_* features chosen at format time
+    uint32_t journal_start;    // First block of the journal (FS_FLAG_JOURNAL)
+    uint32_t num_journal_blocks;// Number of journal blocks
+    uint32_t inode_size;       // On-disk inode size in bytes (0: INODE_SIZE)
+} superblock_t;
+
+
+// Journal record header: a commit is [descriptor][logged blocks][commit]
+// written in one of the 2 halves of the journal (slot = sequence % 2)
+typedef struct {
+    uint32_t magic;    // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+    uint32_t sequence; // # of the commit, both records carry it
+    uint32_t count;    // # of logged blocks
+    uint32_t checksum; // commit record: of the descriptor & logged blocks
+} journal_header_t;
+
+// # of blocks a descriptor can list
+#define JOURNAL_ENTRIES(block_size) (((block_size) - sizeof(journal_header_t)) / sizeof(uint32_t))
+
+
+// Extent structure: `length` physically contiguous blocks from `start`
+typedef struct {
+    uint32_t start;  // First block of the run
+    uint32_t length; // # of blocks in the run
+} extent_t;
+
+
+// Inode structure (32 bytes, 40 with FS_FLAG_LARGE_FILES)
+// -> the block map depends on the format chosen for the whole disk
+// -> on disk, the large-file fields are only there if the flag is set, and
+//    the rest of a larger inode is spare
+typedef struct {
+    uint8_t valid;                  // 0 if free, 1 if allocated
+    uint8_t flags;                  // INODE_* (0 on images formatted before)
+    uint32_t size;                  // File size in bytes (low 32 bits, see get_size)
+    union {
+        struct { // Block pointers (default format)
+            uint32_t direct_blocks[4];      // Direct block pointers
+            uint32_t indirect_block;        // Single indirect block pointer
+            uint32_t double_indirect_block; // Double indirect block pointer
+        };
+        struct { // Extents (FS_FLAG_EXTENTS)
+            extent_t extents[INLINE_EXTENTS]; // First extents, in file order
+            uint32_t extent_count;            // Total # of extents in use
+            uint32_t extent_block;            // Block holding the other extents
+        };
+        uint8_t inline_data[INLINE_DATA_BYTES]; // First bytes of an INODE_INLINE file
+    };
+    uint32_t size_high;             // File size in bytes (high 32 bits)
+    uint32_t triple_indirect_block; // Triple indirect block pointer (block pointers)
+} inode_t;
+
+#endif
@@ -4,16 +4,86 @@
 #include <stdint.h>
 #include <stdio.h>
 
+// Ways of accessing the image file (see vdisk_open)
+#define VDISK_BACKEND_STDIO 0 // pread/pwrite on the FILE *'s descriptor
+#define VDISK_BACKEND_MMAP  1 // whole image mapped in memory
+#define VDISK_BACKEND_DIRECT 2 // O_DIRECT: no page cache, for use behind a block cache
+
+#define VDISK_BUFFER_ALIGN 4096 // alignment of vdisk_alloc_buffer buffers
+
+// Async I/O engines (see vdisk_aio_on)
+#define VDISK_AIO_AUTO    0 // io_uring if the kernel has it, else threads
+#define VDISK_AIO_URING   1 // io_uring only
+#define VDISK_AIO_THREADS 2 // pool of threads doing blocking pread/pwrite
+
+// I/O counters (see vdisk_get_stats): every call is counted once, async
+// requests included, however many pread/pwrite it took
+typedef struct {
+    uint64_t reads;           // vdisk_read/_range/v calls & async reads
+    uint64_t writes;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+} vdisk_stats_t;
+
 typedef struct {
     uint32_t sector_size;
     uint32_t size_in_sectors;
     char *name;
     FILE *fp;
+    int backend;
+    uint8_t *map; // mmap backend only
+    size_t map_length; // bytes mapped (whole sectors of the default size)
+    struct vdisk_aio *aio; // async engine (NULL = requests run inline)
+    int direct_fd;  // O_DIRECT descriptor (direct backend only, -1 otherwise)
+    uint32_t align; // direct I/O alignment of offsets, lengths & buffers
+    vdisk_stats_t stats; // updated atomically (calls may come from any thread)
 } DISK;
 
+// Identity of an image file: the same whatever path names it (see vdisk_file_id)
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} vdisk_id_t;
+
+// One entry of a scatter/gather list (see vdisk_readv/vdisk_writev)
+typedef struct {
+    uint32_t sector; // first sector of the run
+    uint32_t count;  // # of contiguous sectors
+    uint8_t *buffer; // count * sector_size bytes
+} vdisk_run_t;
+
 int vdisk_on(char *filename, DISK *diskp);
+int vdisk_open(char *filename, DISK *diskp, int backend);
+int vdisk_file_id(char *filename, vdisk_id_t *id);
+int vdisk_set_sector_size(DISK *diskp, uint32_t sector_size);
+uint8_t *vdisk_sector_ptr(DISK *diskp, uint32_t sector);
+void *vdisk_alloc_buffer(size_t length);
+void vdisk_free_buffer(void *buffer);
 int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer);
 int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer);
+int vdisk_read_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer);
+int vdisk_write_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer);
+// One asynchronous request: `done` is called once it has completed, from
+// whichever thread reaped it
+typedef struct vdisk_io {
+    uint32_t sector; // first sector
+    uint32_t count;  // # of contiguous sectors
+    uint8_t *buffer; // count * sector_size bytes, untouched until done
+    int write;       // 0 = read, 1 = write
+    int result;      // 0 or vdisk_E* once done
+    void (*done)(struct vdisk_io *io);
+    void *data;      // for `done`
+} vdisk_io_t;
+
+int vdisk_readv(DISK *diskp, const vdisk_run_t *runs, int nruns);
+int vdisk_writev(DISK *diskp, const vdisk_run_t *runs, int nruns);
+int vdisk_aio_on(DISK *diskp, uint32_t depth, int engine);
+int vdisk_aio_submit(DISK *diskp, vdisk_io_t *ios, int nios);
+int vdisk_aio_engine(DISK *diskp);
+void vdisk_aio_off(DISK *diskp);
+void vdisk_count_io(DISK *diskp, int write, uint32_t sectors);
+void vdisk_get_stats(DISK *diskp, vdisk_stats_t *stats);
+void vdisk_reset_stats(DISK *diskp);
 int vdisk_sync(DISK *diskp);
 void vdisk_off(DISK *diskp);
 
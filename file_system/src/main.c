@@ -4,6 +4,8 @@
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include "include/fs.h"
 #include "include/vdisk.h"
 #include "include/error.h"
@@ -129,11 +131,76 @@ void print_test_summary(TestResults results)
     printf("Success rate: %.1f%%\n", (results.passed * 100.0) / results.total);
 }
 
-// Run basic tests (original workflow)
-TestResults run_basic_tests()
+void print_cache_stats(void)
+{
+    cache_stats_t stats;
+    if (fs_cache_stats(fs_default(), &stats) != 0)
+    {
+        return;
+    }
+
+    uint64_t lookups = stats.hits + stats.misses;
+    printf("\n===== CACHE STATS =====\n");
+    printf("Hits: %llu, Misses: %llu (hit rate: %.1f%%)\n",
+           (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+           lookups ? (stats.hits * 100.0) / lookups : 0.0);
+    printf("Evictions: %llu, Write-backs: %llu, Prefetched: %llu\n",
+           (unsigned long long)stats.evictions, (unsigned long long)stats.writebacks,
+           (unsigned long long)stats.prefetches);
+}
+
+void print_fs_stats(void)
+{
+    static const char *op_names[FS_NUM_OPS] = {"create", "delete", "stat", "read", "write", "sync"};
+    fs_stats_t stats;
+    if (fs_get_stats(fs_default(), &stats) != 0)
+    {
+        return;
+    }
+
+    printf("\n===== I/O STATS =====\n");
+    for (int op = 0; op < FS_NUM_OPS; op++)
+    {
+        fs_op_stats_t *op_stats = &stats.ops[op];
+        if (op_stats->count == 0)
+        {
+            continue;
+        }
+        printf("%-6s: %llu calls (%llu errors), %llu bytes, avg %.1f us, max %.1f us\n",
+               op_names[op], (unsigned long long)op_stats->count, (unsigned long long)op_stats->errors,
+               (unsigned long long)op_stats->bytes, op_stats->total_ns / 1000.0 / op_stats->count,
+               op_stats->max_ns / 1000.0);
+
+        // Latency histogram: only the buckets in use
+        printf("        latency:");
+        for (int bucket = 0; bucket < FS_LATENCY_BUCKETS; bucket++)
+        {
+            if (op_stats->latency[bucket] > 0)
+            {
+                printf(" <%lluus:%llu", 1ULL << bucket, (unsigned long long)op_stats->latency[bucket]);
+            }
+        }
+        printf("\n");
+    }
+    printf("Disk: %llu reads (%llu sectors), %llu writes (%llu sectors)\n",
+           (unsigned long long)stats.disk.reads, (unsigned long long)stats.disk.sectors_read,
+           (unsigned long long)stats.disk.writes, (unsigned long long)stats.disk.sectors_written);
+    printf("Pointer lookups: %llu\n", (unsigned long long)stats.pointer_lookups);
+    printf("Allocations: %llu (%llu at the goal), bits scanned: %llu (max %llu)\n",
+           (unsigned long long)stats.allocations, (unsigned long long)stats.alloc_goal_hits,
+           (unsigned long long)stats.alloc_scanned, (unsigned long long)stats.alloc_max_scan);
+    uint64_t lookups = stats.cache.hits + stats.cache.misses;
+    printf("Cache hit rate: %.1f%%\n", lookups ? (stats.cache.hits * 100.0) / lookups : 0.0);
+}
+
+// Run basic tests (original workflow) on a disk backend
+TestResults run_basic_tests_on(int backend)
 {
     TestResults results = {0, 0, 0};
     const char *disk_name = "test_disk.img";
+    fs_options_t mount_opts;
+    fs_default_options(&mount_opts);
+    mount_opts.backend = backend;
     int num_inodes = 10;
     int result;
     int test_inode = -1;
@@ -169,7 +236,7 @@ TestResults run_basic_tests()
     // Test 2: Mount disk
     print_test_header("Mount");
     results.total++;
-    result = mount((char *)disk_name);
+    result = fs_mount((char *)disk_name, &mount_opts);
     if (result == 0)
     {
         printf("Disk '%s' mounted successfully\n", disk_name);
@@ -375,7 +442,7 @@ TestResults run_basic_tests()
     // Test 12: Remount and verify file persistence
     print_test_header("Remount and verify persistence");
     results.total++;
-    result = mount((char *)disk_name);
+    result = fs_mount((char *)disk_name, &mount_opts);
     if (result == 0)
     {
         printf("Disk '%s' remounted successfully\n", disk_name);
@@ -404,24 +471,860 @@ TestResults run_basic_tests()
     print_test_result("Remount and verify persistence", result == 0 && file_size > 0, result);
 
     // Final unmount
+    print_cache_stats();
+    print_fs_stats();
+    unmount();
+
+    return results;
+}
+
+// Run basic tests on the default (stdio) backend
+TestResults run_basic_tests()
+{
+    return run_basic_tests_on(VDISK_BACKEND_STDIO);
+}
+
+// Run basic tests on the mmap backend
+TestResults run_mmap_tests()
+{
+    return run_basic_tests_on(VDISK_BACKEND_MMAP);
+}
+
+// Run basic tests on the O_DIRECT backend
+TestResults run_direct_tests()
+{
+    return run_basic_tests_on(VDISK_BACKEND_DIRECT);
+}
+
+// Helper function to count a test result and print it
+void record_test_result(TestResults *results, const char *test_name, bool success, int result_code)
+{
+    results->total++;
+    if (success)
+    {
+        results->passed++;
+    }
+    else
+    {
+        results->failed++;
+    }
+    print_test_result(test_name, success, result_code);
+}
+
+// Helper function to fill a buffer with the bytes [pos, pos + len) of a
+// pattern that differs per seed
+void fill_pattern(uint8_t *buffer, int len, int64_t pos, int seed)
+{
+    for (int i = 0; i < len; i++)
+    {
+        buffer[i] = (uint8_t)(seed * 31 + (pos + i) * 7 + ((pos + i) >> 10));
+    }
+}
+
+// Helper function to check that a file holds bytes [offset, offset + len)
+// of the pattern (see fill_pattern)
+bool check_pattern(FS *fs, int inode_num, int len, int64_t offset, int seed)
+{
+    uint8_t expected[4096];
+    uint8_t actual[4096];
+    for (int done = 0; done < len; done += (int)sizeof(actual))
+    {
+        int chunk = (len - done < (int)sizeof(actual)) ? len - done : (int)sizeof(actual);
+        fill_pattern(expected, chunk, offset + done, seed);
+        if (fs_read(fs, inode_num, actual, chunk, offset + done) != chunk || memcmp(actual, expected, chunk) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function to write bytes [offset, offset + len) of the pattern to a
+// file (see fill_pattern), returns the # of bytes written or the error
+int write_pattern(FS *fs, int inode_num, int len, int64_t offset, int seed)
+{
+    uint8_t buffer[4096];
+    int done = 0;
+    while (done < len)
+    {
+        int chunk = (len - done < (int)sizeof(buffer)) ? len - done : (int)sizeof(buffer);
+        fill_pattern(buffer, chunk, offset + done, seed);
+        int result = fs_write(fs, inode_num, buffer, chunk, offset + done);
+        if (result <= 0)
+        {
+            return (done > 0) ? done : result;
+        }
+        done += result;
+    }
+    return done;
+}
+
+// Helper function to copy an image file (a snapshot of a mounted one is
+// what a crash would leave on the disk)
+int copy_image(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    uint8_t buffer[4096];
+    size_t length;
+    int result = (in != NULL && out != NULL) ? 0 : -1;
+    while (result == 0 && (length = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        if (fwrite(buffer, 1, length, out) != length)
+        {
+            result = -1;
+        }
+    }
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+    if (out != NULL && fclose(out) != 0)
+    {
+        result = -1;
+    }
+    return result;
+}
+
+// Run extent format tests (sparse files, out of space)
+TestResults run_extent_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    uint8_t data[1024], other[1024], read_buffer[1024];
+    int block_size = 1024;
+    int result;
+
+    log_test("Extent Format Tests");
+    memset(data, 'x', sizeof(data));
+    memset(other, 'y', sizeof(other));
+
+    // Test 1: Format & mount with extents
+    //  (append buffer off: the disk is really full when a write says so)
+    print_test_header("Format with extents");
+    fs_format_options_t format_opts;
+    fs_default_format_options(&format_opts);
+    format_opts.extents = true;
+    format_opts.block_size = block_size;
+    fs_options_t mount_opts;
+    fs_default_options(&mount_opts);
+    mount_opts.append_blocks = 0;
+    result = fs_format((char *)disk_name, 16, &format_opts);
+    if (result == 0)
+    {
+        result = fs_mount((char *)disk_name, &mount_opts);
+    }
+    record_test_result(&results, "Format & mount with extents", result == 0, result);
+    if (result != 0)
+    {
+        // Fatal error -> can't continue w/out mounting
+        return results;
+    }
+
+    // Test 2: Write past the end of a file, the gap reads as 0s
+    print_test_header("Sparse file");
+    int sparse_inode = create();
+    result = write(sparse_inode, data, block_size, 10 * block_size);
+    bool sparse_ok = (result == block_size && stat(sparse_inode) == 11 * block_size);
+    memset(read_buffer, 1, sizeof(read_buffer));
+    sparse_ok = sparse_ok && read(sparse_inode, read_buffer, block_size, 4 * block_size + 10) == block_size;
+    for (int i = 0; i < block_size; i++)
+    {
+        sparse_ok = sparse_ok && read_buffer[i] == 0;
+    }
+    printf("Wrote 1 block at block 10: size %lld bytes\n", (long long)stat(sparse_inode));
+    record_test_result(&results, "Hole reads as zeros", sparse_ok, result);
+
+    // Test 3: Filling a hole when the disk is full: ENOSPC, file unchanged
+    //  (one free block: room for the data block but not for the extent
+    //  block the split hole needs)
+    print_test_header("Out of space in a hole");
+    int spare_inode = create();
+    write(spare_inode, other, block_size, 0);
+    int fill_inode = create();
+    int64_t fill_size = 0;
+    while (write(fill_inode, other, block_size, fill_size) == block_size)
+    {
+        fill_size += block_size;
+    }
+    delete(spare_inode);
+    result = write(sparse_inode, data, block_size, 5 * block_size);
+    printf("Disk filled with %lld bytes, writing in the hole returned %d\n", (long long)fill_size, result);
+    record_test_result(&results, "Hole write fails with out of space", result == E_OUT_OF_SPACE, result);
+
+    // the freed block went back to the disk, the file still maps its data
+    int reuse_inode = create();
+    write(reuse_inode, other, block_size, 0);
+    memset(read_buffer, 0, sizeof(read_buffer));
+    result = read(sparse_inode, read_buffer, block_size, 10 * block_size);
+    bool intact = (result == block_size && memcmp(read_buffer, data, block_size) == 0 &&
+                   stat(sparse_inode) == 11 * block_size);
+    record_test_result(&results, "File intact after out of space", intact, result);
+
+    // past the end on the full disk: ENOSPC, and the size doesn't move
+    result = write(sparse_inode, data, 100, 20 * block_size);
+    record_test_result(&results, "Write past the end fails, size unchanged",
+                       result == E_OUT_OF_SPACE && stat(sparse_inode) == 11 * block_size, result);
+
+    // Test 4: ... and after a remount
+    print_test_header("Remount after out of space");
     unmount();
+    result = fs_mount((char *)disk_name, &mount_opts);
+    memset(read_buffer, 0, sizeof(read_buffer));
+    intact = (result == 0 && stat(sparse_inode) == 11 * block_size &&
+              read(sparse_inode, read_buffer, block_size, 10 * block_size) == block_size &&
+              memcmp(read_buffer, data, block_size) == 0);
+    memset(read_buffer, 1, sizeof(read_buffer));
+    intact = intact && read(reuse_inode, read_buffer, block_size, 0) == block_size &&
+             memcmp(read_buffer, other, block_size) == 0;
+    record_test_result(&results, "Data persists after remount", intact, result);
 
+    unmount();
     return results;
 }
 
+// Run append buffer tests (small appends until the disk is full)
+TestResults run_append_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const int num_files = 3;
+    const int chunk_size = 700; // not a multiple of the block size
+    int inodes[num_files];
+    int64_t sizes[num_files];
+    uint8_t chunk[chunk_size];
+    int result;
+
+    log_test("Append Buffer Tests");
+
+    // Test 1: Format & mount (default options: appends are buffered)
+    print_test_header("Format & mount");
+    result = format((char *)disk_name, 16);
+    if (result == 0)
+    {
+        result = mount((char *)disk_name);
+    }
+    record_test_result(&results, "Format & mount", result == 0, result);
+    if (result != 0)
+    {
+        // Fatal error -> can't continue w/out mounting
+        return results;
+    }
+
+    // Test 2: Interleaved small appends to a few files until the disk is
+    //  full: every write that succeeded must have got room on the disk
+    print_test_header("Appends on a full disk");
+    for (int i = 0; i < num_files; i++)
+    {
+        inodes[i] = create();
+        sizes[i] = 0;
+    }
+    int64_t total = 0;
+    int failures = 0;
+    for (int turn = 0; failures < num_files; turn++)
+    {
+        int i = turn % num_files;
+        memset(chunk, 'a' + i, chunk_size);
+        result = write(inodes[i], chunk, chunk_size, sizes[i]);
+        if (result > 0)
+        {
+            sizes[i] += result;
+            total += result;
+        }
+        else
+        {
+            failures++;
+        }
+    }
+    result = fs_sync(fs_default());
+    printf("Appended %lld bytes before running out of space\n", (long long)total);
+    record_test_result(&results, "Sync of the appends", result == 0, result);
+
+    // Test 3: Remount, every acknowledged byte is there
+    print_test_header("Appends persist");
+    unmount();
+    result = mount((char *)disk_name);
+    bool intact = (result == 0);
+    for (int i = 0; i < num_files && intact; i++)
+    {
+        intact = (stat(inodes[i]) == sizes[i]);
+        for (int64_t offset = 0; offset < sizes[i] && intact; offset += chunk_size)
+        {
+            int bytes_read = read(inodes[i], chunk, chunk_size, offset);
+            for (int k = 0; k < bytes_read; k++)
+            {
+                intact = intact && chunk[k] == 'a' + i;
+            }
+        }
+    }
+    record_test_result(&results, "Acknowledged appends persist after remount", intact, result);
+
+    unmount();
+    return results;
+}
+
+// Run multi-instance tests (an image is used by one instance at a time)
+TestResults run_instance_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const char *other_path = "./test_disk.img"; // same image, another path
+    FS *other = NULL;
+    int result;
+
+    log_test("Instance Tests");
+
+    // Test 1: Mount through the single-image API
+    print_test_header("Mount");
+    result = format((char *)disk_name, 16);
+    if (result == 0)
+    {
+        result = mount((char *)disk_name);
+    }
+    record_test_result(&results, "Format & mount", result == 0, result);
+    if (result != 0)
+    {
+        // Fatal error -> can't continue w/out mounting
+        return results;
+    }
+
+    // Test 2: Another path to the mounted image can't be opened or formatted
+    print_test_header("Same image, another path");
+    result = fs_open((char *)other_path, NULL, &other);
+    record_test_result(&results, "Open of a mounted image refused", result == E_DISK_ALREADY_MOUNTED, result);
+    if (result == 0)
+    {
+        fs_close(other);
+    }
+    result = fs_format((char *)other_path, 16, NULL);
+    record_test_result(&results, "Format of a mounted image refused", result == E_DISK_ALREADY_MOUNTED, result);
+
+    // Test 3: Free again once unmounted
+    print_test_header("Open after unmount");
+    unmount();
+    result = fs_open((char *)other_path, NULL, &other);
+    if (result == 0)
+    {
+        result = fs_close(other);
+    }
+    record_test_result(&results, "Open after unmount", result == 0, result);
+
+    return results;
+}
+
+// Format variants the option tests go through
+typedef struct
+{
+    const char *name;
+    uint32_t block_size;
+    uint32_t inode_size;
+    bool large_files;
+    bool inline_data;
+    bool extents;
+} format_case_t;
+
+// Run format option tests (block/inode sizes, large files, inline data)
+TestResults run_format_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const int64_t far_offset = 5LL << 30; // past 4 GiB: large files only
+    const format_case_t cases[] = {
+        {.name = "4 KB blocks", .block_size = 4096, .inode_size = 32},
+        {.name = "128-byte inodes", .block_size = 1024, .inode_size = 128},
+        {.name = "Extents, 4 KB blocks, 64-byte inodes", .block_size = 4096, .inode_size = 64, .extents = true},
+        {.name = "Large files", .block_size = 1024, .inode_size = 64, .large_files = true},
+        {.name = "128-byte inodes with inline data", .block_size = 1024, .inode_size = 128, .inline_data = true},
+        {.name = "Extents with inline data", .block_size = 4096, .inode_size = 64, .inline_data = true, .extents = true},
+    };
+    int result;
+
+    log_test("Format Option Tests");
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const format_case_t *test_case = &cases[c];
+        char test_name[128];
+        print_test_header(test_case->name);
+
+        // 1. Format & mount
+        fs_format_options_t format_opts;
+        fs_default_format_options(&format_opts);
+        format_opts.block_size = test_case->block_size;
+        format_opts.inode_size = test_case->inode_size;
+        format_opts.large_files = test_case->large_files;
+        format_opts.inline_data = test_case->inline_data;
+        format_opts.extents = test_case->extents;
+        result = fs_format((char *)disk_name, 16, &format_opts);
+        if (result == 0)
+        {
+            result = mount((char *)disk_name);
+        }
+        snprintf(test_name, sizeof(test_name), "%s: format & mount", test_case->name);
+        record_test_result(&results, test_name, result == 0, result);
+        if (result != 0)
+        {
+            continue;
+        }
+
+        // 2. A tiny file (inline if enabled), a medium one, a sparse one,
+        //    and one far past 4 GiB
+        FS *fs = fs_default();
+        int tiny = create(), medium = create(), sparse = create(), far = create();
+        bool written = write_pattern(fs, tiny, 50, 0, 1) == 50 &&
+                       write_pattern(fs, medium, 70000, 0, 2) == 70000 &&
+                       write_pattern(fs, sparse, 5000, 300000, 3) == 5000;
+        snprintf(test_name, sizeof(test_name), "%s: writes", test_case->name);
+        record_test_result(&results, test_name, written, 0);
+        result = write_pattern(fs, far, 1000, far_offset, 4);
+        bool far_ok = test_case->large_files ? (result == 1000) : (result == E_INVALID_OFFSET);
+        snprintf(test_name, sizeof(test_name), "%s: %s", test_case->name,
+                 test_case->large_files ? "write past 4 GiB" : "write past 4 GiB refused");
+        record_test_result(&results, test_name, far_ok, result);
+
+        // 3. All there after a remount
+        unmount();
+        result = mount((char *)disk_name);
+        uint8_t zeros[4096];
+        bool intact = (result == 0 && stat(tiny) == 50 && stat(medium) == 70000 && stat(sparse) == 305000 &&
+                       check_pattern(fs, tiny, 50, 0, 1) && check_pattern(fs, medium, 70000, 0, 2) &&
+                       check_pattern(fs, sparse, 5000, 300000, 3) &&
+                       read(sparse, zeros, sizeof(zeros), 100000) == (int)sizeof(zeros));
+        for (size_t i = 0; i < sizeof(zeros) && intact; i++)
+        {
+            intact = (zeros[i] == 0);
+        }
+        if (test_case->large_files)
+        {
+            intact = intact && stat(far) == far_offset + 1000 && check_pattern(fs, far, 1000, far_offset, 4);
+        }
+        snprintf(test_name, sizeof(test_name), "%s: data persists after remount", test_case->name);
+        record_test_result(&results, test_name, intact, result);
+        unmount();
+    }
+
+    return results;
+}
+
+// Run journal tests (recovery of an image left by a crash)
+TestResults run_journal_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const char *crash_name = "test_crash.img"; // what the disk held at the "crash"
+    const int num_files = 8;
+    int inodes[num_files];
+    int result;
+
+    log_test("Journal Tests");
+
+    // Test 1: Format with a small journal (commits often) & mount
+    print_test_header("Format with a journal");
+    fs_format_options_t format_opts;
+    fs_default_format_options(&format_opts);
+    format_opts.journal_blocks = 16;
+    result = fs_format((char *)disk_name, 16, &format_opts);
+    if (result == 0)
+    {
+        result = mount((char *)disk_name);
+    }
+    record_test_result(&results, "Format & mount with a journal", result == 0, result);
+    if (result != 0)
+    {
+        return results;
+    }
+
+    // Test 2: Synced files, then more updates left in flight, and a copy of
+    //  the image taken while mounted (the state a crash would leave)
+    print_test_header("Crash after sync");
+    FS *fs = fs_default();
+    bool written = true;
+    for (int i = 0; i < num_files; i++)
+    {
+        inodes[i] = create();
+        written = written && write_pattern(fs, inodes[i], 20000 + i * 3000, 0, i) == 20000 + i * 3000;
+    }
+    result = fs_sync(fs);
+    for (int i = 0; i < 20; i++)
+    {
+        int scratch = create();
+        write_pattern(fs, scratch, 9000, 0, 100 + i);
+        delete(scratch);
+    }
+    result = (result == 0) ? copy_image(disk_name, crash_name) : result;
+    record_test_result(&results, "Synced writes, crash image taken", written && result == 0, result);
+    unmount();
+
+    // Test 3: The crash image mounts (journal replayed), the synced files
+    //  are intact, and new files don't clobber them
+    print_test_header("Recovery");
+    result = mount((char *)crash_name);
+    bool intact = (result == 0);
+    for (int i = 0; i < num_files && intact; i++)
+    {
+        intact = stat(inodes[i]) == 20000 + i * 3000 && check_pattern(fs, inodes[i], 20000 + i * 3000, 0, i);
+    }
+    record_test_result(&results, "Synced data intact after recovery", intact, result);
+
+    int new_files = 0;
+    while (true)
+    {
+        int inode_num = create();
+        if (inode_num < 0 || write_pattern(fs, inode_num, 50000, 0, 200) <= 0)
+        {
+            break;
+        }
+        new_files++;
+    }
+    for (int i = 0; i < num_files && intact; i++)
+    {
+        intact = check_pattern(fs, inodes[i], 20000 + i * 3000, 0, i);
+    }
+    printf("Filled the recovered disk with %d new files\n", new_files);
+    record_test_result(&results, "Recovered block bitmap: no block given twice", intact && new_files > 0, new_files);
+    unmount();
+    remove(crash_name);
+
+    return results;
+}
+
+// Run async I/O tests (a batch of requests in flight at once)
+TestResults run_async_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const int num_requests = 8;
+    const int request_size = 16384;
+    static uint8_t buffers[8][16384];
+    fs_aio_t *requests[num_requests];
+    FS *fs = NULL;
+    int result;
+
+    log_test("Async I/O Tests");
+
+    // Test 1: Open an instance with an I/O queue
+    print_test_header("Open with an I/O queue");
+    fs_options_t mount_opts;
+    fs_default_options(&mount_opts);
+    mount_opts.io_depth = 16;
+    result = format((char *)disk_name, 16);
+    if (result == 0)
+    {
+        result = fs_open((char *)disk_name, &mount_opts, &fs);
+    }
+    record_test_result(&results, "Open with io_depth 16", result == 0, result);
+    if (result != 0)
+    {
+        return results;
+    }
+
+    // Test 2: Writes submitted together, then waited for
+    print_test_header("Async writes");
+    int inode_num = fs_create(fs);
+    bool ok = true;
+    for (int i = 0; i < num_requests; i++)
+    {
+        fill_pattern(buffers[i], request_size, (int64_t)i * request_size, 5);
+        result = fs_write_async(fs, inode_num, buffers[i], request_size, (int64_t)i * request_size, &requests[i]);
+        ok = ok && result == 0;
+    }
+    for (int i = 0; i < num_requests && ok; i++)
+    {
+        result = fs_aio_wait(requests[i]);
+        ok = (result == request_size);
+    }
+    ok = ok && fs_stat(fs, inode_num) == (int64_t)num_requests * request_size &&
+         check_pattern(fs, inode_num, num_requests * request_size, 0, 5);
+    record_test_result(&results, "Async writes land in order", ok, result);
+
+    // Test 3: Reads submitted together, in reverse order
+    print_test_header("Async reads");
+    ok = true;
+    for (int i = num_requests - 1; i >= 0; i--)
+    {
+        memset(buffers[i], 0, request_size);
+        result = fs_read_async(fs, inode_num, buffers[i], request_size, (int64_t)i * request_size, &requests[i]);
+        ok = ok && result == 0;
+    }
+    for (int i = 0; i < num_requests && ok; i++)
+    {
+        uint8_t expected[request_size];
+        result = fs_aio_wait(requests[i]);
+        fill_pattern(expected, request_size, (int64_t)i * request_size, 5);
+        ok = (result == request_size && memcmp(buffers[i], expected, request_size) == 0);
+    }
+    record_test_result(&results, "Async reads return the data", ok, result);
+
+    fs_close(fs);
+    return results;
+}
+
+// One thread of the multi-thread test: writes, then checks, its own file
+typedef struct
+{
+    FS *fs;
+    int inode_num;
+    int seed;
+    bool ok;
+} thread_test_t;
+
+void *thread_test_worker(void *arg)
+{
+    thread_test_t *test = (thread_test_t *)arg;
+    test->ok = true;
+    for (int round = 0; round < 20 && test->ok; round++)
+    {
+        // appends of odd sizes, then a rewrite in the middle
+        test->ok = write_pattern(test->fs, test->inode_num, 1500, (int64_t)round * 1500, test->seed) == 1500;
+    }
+    test->ok = test->ok && write_pattern(test->fs, test->inode_num, 4000, 7000, test->seed) == 4000 &&
+               fs_stat(test->fs, test->inode_num) == 30000 &&
+               check_pattern(test->fs, test->inode_num, 30000, 0, test->seed);
+    return NULL;
+}
+
+// Run multi-thread tests (calls on different files at once)
+TestResults run_thread_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *disk_name = "test_disk.img";
+    const int num_threads = 4;
+    thread_test_t tests[num_threads];
+    pthread_t threads[num_threads];
+    FS *fs = NULL;
+    int result;
+
+    log_test("Multi-thread Tests");
+
+    // Test 1: Open an instance with a sharded allocator
+    print_test_header("Open for 4 threads");
+    fs_options_t mount_opts;
+    fs_default_options(&mount_opts);
+    mount_opts.threads = num_threads;
+    result = format((char *)disk_name, 16);
+    if (result == 0)
+    {
+        result = fs_open((char *)disk_name, &mount_opts, &fs);
+    }
+    record_test_result(&results, "Open with 4 threads", result == 0, result);
+    if (result != 0)
+    {
+        return results;
+    }
+
+    // Test 2: Each thread grows & checks its own file, all at once
+    print_test_header("Concurrent writers");
+    for (int i = 0; i < num_threads; i++)
+    {
+        tests[i].fs = fs;
+        tests[i].inode_num = fs_create(fs);
+        tests[i].seed = 10 + i;
+        pthread_create(&threads[i], NULL, thread_test_worker, &tests[i]);
+    }
+    bool ok = true;
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ok = ok && tests[i].ok;
+    }
+    record_test_result(&results, "Concurrent writers to different files", ok, 0);
+
+    // Test 3: ... and nothing got mixed up on the disk
+    print_test_header("Remount after concurrent writes");
+    fs_close(fs);
+    result = fs_open((char *)disk_name, NULL, &fs);
+    ok = (result == 0);
+    for (int i = 0; i < num_threads && ok; i++)
+    {
+        ok = check_pattern(fs, tests[i].inode_num, 30000, 0, tests[i].seed);
+    }
+    record_test_result(&results, "Files intact after remount", ok, result);
+    if (result == 0)
+    {
+        fs_close(fs);
+    }
+
+    return results;
+}
+
+// Helper function to read (or overwrite, if `write`) `size` bytes of an
+// image file at `offset`
+int access_image(const char *path, long offset, void *buffer, size_t size, bool write)
+{
+    FILE *image = fopen(path, write ? "r+b" : "rb");
+    if (image == NULL)
+    {
+        return -1;
+    }
+    int result = 0;
+    if (fseek(image, offset, SEEK_SET) != 0)
+    {
+        result = -1;
+    }
+    else if (write)
+    {
+        result = (fwrite(buffer, 1, size, image) == size) ? 0 : -1;
+    }
+    else
+    {
+        result = (fread(buffer, 1, size, image) == size) ? 0 : -1;
+    }
+    if (fclose(image) != 0)
+    {
+        result = -1;
+    }
+    return result;
+}
+
+// Helper function to run the checker on an image, returns its exit status
+// (-1 if it could not run) and leaves what it printed in `output`
+int run_fsck(const char *image_name, char *output, size_t size)
+{
+    char command[256];
+    snprintf(command, sizeof(command), "./fs_fsck -t 1 %s 2>&1", image_name);
+    FILE *checker = popen(command, "r");
+    if (checker == NULL)
+    {
+        return -1;
+    }
+    size_t length = fread(output, 1, size - 1, checker);
+    output[length] = '\0';
+    int status = pclose(checker);
+    return (status != -1 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+}
+
+// Run checker tests (fs_fsck on a clean image, then on corrupted copies)
+TestResults run_fsck_tests()
+{
+    TestResults results = {0, 0, 0};
+    const char *fixture = "../disk_images/disk_img.2"; // 1 KB blocks, 32-byte inodes, no bitmap
+    const char *disk_name = "test_disk.img";
+    const char *copy_name = "test_fsck.img";
+    const long block_size = 1024;
+    const long inode_size = 32;
+    char output[8192];
+    uint32_t block_num;
+    int result;
+
+    log_test("Checker Tests");
+    FILE *checker = fopen("./fs_fsck", "rb");
+    if (checker == NULL)
+    {
+        printf("./fs_fsck not found, build it first (make fsck): checker tests skipped\n");
+        return results;
+    }
+    fclose(checker);
+
+    // Test 1: The fixture image is clean
+    print_test_header("Clean image");
+    result = run_fsck(fixture, output, sizeof(output));
+    record_test_result(&results, "Fixture image is clean", result == 0 && strstr(output, ": clean") != NULL, result);
+
+    // Test 2: A block of inode 1 also mapped by inode 2
+    //  (inode n at block 1 + n * 32 bytes, direct_blocks[k] at byte 8 + 4k)
+    print_test_header("Cross-linked block");
+    long inode1 = block_size + 1 * inode_size, inode2 = block_size + 2 * inode_size;
+    result = copy_image(fixture, copy_name);
+    result = (result == 0) ? access_image(copy_name, inode1 + 8, &block_num, sizeof(block_num), false) : result;
+    result = (result == 0) ? access_image(copy_name, inode2 + 8, &block_num, sizeof(block_num), true) : result;
+    result = (result == 0) ? run_fsck(copy_name, output, sizeof(output)) : result;
+    printf("%s", output);
+    char expected[80];
+    snprintf(expected, sizeof(expected), "error: inode 2: data block %u cross-linked with inode 1", block_num);
+    record_test_result(&results, "Cross-link found", result == 1 && strstr(output, expected) != NULL, result);
+
+    // Test 3: A block pointer past the end of the disk
+    print_test_header("Block out of range");
+    uint32_t num_blocks;
+    result = copy_image(fixture, copy_name);
+    result = (result == 0) ? access_image(copy_name, 16, &num_blocks, sizeof(num_blocks), false) : result;
+    block_num = num_blocks + 100;
+    result = (result == 0) ? access_image(copy_name, inode1 + 12, &block_num, sizeof(block_num), true) : result;
+    result = (result == 0) ? run_fsck(copy_name, output, sizeof(output)) : result;
+    printf("%s", output);
+    snprintf(expected, sizeof(expected), "error: inode 1: data block %u beyond the end of the disk", block_num);
+    record_test_result(&results, "Out of range pointer found", result == 1 && strstr(output, expected) != NULL, result);
+
+    // Test 4: A block in use marked free in the bitmap (the fixture has no
+    // bitmap: on a fresh image, cleanly unmounted so the bitmap is checked)
+    print_test_header("Bitmap mismatch");
+    result = format((char *)disk_name, 16);
+    result = (result == 0) ? mount((char *)disk_name) : result;
+    int inode_num = (result == 0) ? create() : result;
+    uint8_t data[3000];
+    memset(data, 'b', sizeof(data));
+    result = (inode_num >= 0) ? write(inode_num, data, sizeof(data), 0) : inode_num;
+    unmount();
+    result = (result == (int)sizeof(data)) ? run_fsck(disk_name, output, sizeof(output)) : result;
+    bool clean = (result == 0 && strstr(output, ": clean") != NULL);
+    uint32_t bitmap_start;
+    uint8_t bitmap_byte;
+    long inode_offset = block_size + inode_num * inode_size;
+    result = copy_image(disk_name, copy_name);
+    result = (result == 0) ? access_image(copy_name, 28, &bitmap_start, sizeof(bitmap_start), false) : result;
+    result = (result == 0) ? access_image(copy_name, inode_offset + 8, &block_num, sizeof(block_num), false) : result;
+    long bitmap_offset = bitmap_start * block_size + block_num / 8;
+    result = (result == 0) ? access_image(copy_name, bitmap_offset, &bitmap_byte, 1, false) : result;
+    bitmap_byte &= ~(1 << (block_num % 8));
+    result = (result == 0) ? access_image(copy_name, bitmap_offset, &bitmap_byte, 1, true) : result;
+    result = (result == 0) ? run_fsck(copy_name, output, sizeof(output)) : result;
+    printf("%s", output);
+    snprintf(expected, sizeof(expected), "error: block %u (inode %d) free in the bitmap", block_num, inode_num);
+    record_test_result(&results, "Bitmap mismatch found", clean && result == 1 && strstr(output, expected) != NULL,
+                       result);
+
+    remove(copy_name);
+    return results;
+}
+
+// Helper function to print the line of a test suite in the final summary
+void print_suite_summary(const char *suite_name, TestResults results)
+{
+    printf("%s: %d/%d passed (%.1f%%)\n", suite_name, results.passed, results.total,
+           results.total ? (results.passed * 100.0) / results.total : 0.0);
+}
+
 int main(void)
 {
     printf("File System Testing Suite\n");
     printf("=======================\n\n");
 
-    TestResults basic_results = run_basic_tests();
+    // The suites, run one after the other in this order
+    const struct
+    {
+        const char *name;
+        TestResults (*run)(void);
+    } suites[] = {
+        {"Basic Tests", run_basic_tests},
+        {"Basic Tests (mmap)", run_mmap_tests},
+        {"Basic Tests (O_DIRECT)", run_direct_tests},
+        {"Extent Tests", run_extent_tests},
+        {"Append Tests", run_append_tests},
+        {"Instance Tests", run_instance_tests},
+        {"Format Tests", run_format_tests},
+        {"Journal Tests", run_journal_tests},
+        {"Async Tests", run_async_tests},
+        {"Thread Tests", run_thread_tests},
+        {"Checker Tests", run_fsck_tests},
+    };
+    const size_t num_suites = sizeof(suites) / sizeof(suites[0]);
+    TestResults suite_results[num_suites];
+    for (size_t i = 0; i < num_suites; i++)
+    {
+        suite_results[i] = suites[i].run();
+    }
 
     // Print final summary
+    TestResults all_results = {0, 0, 0};
     printf("\n\n==== FINAL TEST SUMMARY ====\n");
-    printf("Basic Tests: %d/%d passed (%.1f%%)\n",
-           basic_results.passed, basic_results.total,
-           (basic_results.passed * 100.0) / basic_results.total);
-    print_test_summary(basic_results);
+    for (size_t i = 0; i < num_suites; i++)
+    {
+        print_suite_summary(suites[i].name, suite_results[i]);
+        all_results.total += suite_results[i].total;
+        all_results.passed += suite_results[i].passed;
+        all_results.failed += suite_results[i].failed;
+    }
+    print_test_summary(all_results);
 
-    return basic_results.failed > 0 ? 1 : 0;
+    return all_results.failed > 0 ? 1 : 0;
 }
@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include "../include/error.h"
+#include "../include/vdisk.h"
+
+#define AIO_WORKERS 4 // threads of the fallback engine
+
+// Async engine state (one per DISK, see vdisk_aio_on)
+struct vdisk_aio {
+    DISK *disk;
+    int engine;            // VDISK_AIO_URING or VDISK_AIO_THREADS
+    uint32_t depth;        // max # of requests in flight
+    pthread_mutex_t lock;
+    pthread_cond_t cond;   // queue or in-flight count changed
+    uint32_t inflight;     // submitted, not completed yet
+
+    // Thread pool: ring of queued requests
+    vdisk_io_t **queue;
+    uint32_t head;
+    uint32_t queued;
+    int stopping;
+    pthread_t workers[AIO_WORKERS];
+    int num_workers;
+
+#ifdef HAVE_IO_URING
+    // io_uring: rings shared with the kernel, completions reaped by a thread
+    int ring_fd;
+    pthread_t reaper;
+    uint8_t *sq_ring;
+    uint8_t *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+// Runs a request right away, on the calling thread
+static void run_io(DISK *diskp, vdisk_io_t *io) {
+    io->result = io->write ? vdisk_write_range(diskp, io->sector, io->count, io->buffer)
+                           : vdisk_read_range(diskp, io->sector, io->count, io->buffer);
+}
+
+// Hands a finished request back, then lets a waiting submitter/stop go on
+// NB: `io` belongs to the caller again once `done` is called
+static void complete_io(struct vdisk_aio *aio, vdisk_io_t *io) {
+    if (io->done != NULL) {
+        io->done(io);
+    }
+    pthread_mutex_lock(&aio->lock);
+    aio->inflight--;
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+
+/* Thread pool engine */
+
+static void *worker_main(void *arg) {
+    struct vdisk_aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->queued == 0 && !aio->stopping) {
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        }
+        if (aio->queued == 0) {
+            break; // stopping, and everything queued was run
+        }
+        vdisk_io_t *io = aio->queue[aio->head];
+        aio->head = (aio->head + 1) % aio->depth;
+        aio->queued--;
+        pthread_cond_broadcast(&aio->cond); // room in the queue
+        pthread_mutex_unlock(&aio->lock);
+
+        run_io(aio->disk, io);
+        complete_io(aio, io);
+        pthread_mutex_lock(&aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int pool_start(struct vdisk_aio *aio) {
+    aio->queue = malloc(aio->depth * sizeof(vdisk_io_t *));
+    if (aio->queue == NULL) {
+        return E_OUT_OF_SPACE;
+    }
+    for (int i = 0; i < AIO_WORKERS; i++) {
+        if (pthread_create(&aio->workers[i], NULL, worker_main, aio) != 0) {
+            break;
+        }
+        aio->num_workers++;
+    }
+    if (aio->num_workers == 0) {
+        free(aio->queue);
+        aio->queue = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void pool_submit(struct vdisk_aio *aio, vdisk_io_t *ios, int nios) {
+    pthread_mutex_lock(&aio->lock);
+    for (int i = 0; i < nios; i++) {
+        while (aio->queued == aio->depth) {
+            pthread_cond_broadcast(&aio->cond); // workers may still be asleep
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        }
+        aio->queue[(aio->head + aio->queued) % aio->depth] = &ios[i];
+        aio->queued++;
+        aio->inflight++;
+    }
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+static void pool_stop(struct vdisk_aio *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio->stopping = 1;
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+    for (int i = 0; i < aio->num_workers; i++) {
+        pthread_join(aio->workers[i], NULL);
+    }
+    free(aio->queue);
+}
+
+
+/* io_uring engine (raw syscalls, no liburing) */
+
+#ifdef HAVE_IO_URING
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Fills the next SQE, the caller holds the lock and made sure there is room
+static void ring_queue(struct vdisk_aio *aio, int opcode, vdisk_io_t *io) {
+    unsigned tail = *aio->sq_tail;
+    unsigned idx = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fileno(aio->disk->fp);
+    if (io != NULL) {
+        sqe->addr = (uint64_t)(uintptr_t)io->buffer;
+        sqe->len = io->count * aio->disk->sector_size;
+        sqe->off = (uint64_t)io->sector * aio->disk->sector_size;
+        // Direct backend: bypass the page cache unless the buffer isn't
+        // aligned (a read/write on the buffered descriptor is still coherent)
+        if (aio->disk->direct_fd >= 0 && (sqe->addr | sqe->len | sqe->off) % aio->disk->align == 0) {
+            sqe->fd = aio->disk->direct_fd;
+        }
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)io; // NULL: stop the reaper
+    aio->sq_array[idx] = idx;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *reaper_main(void *arg) {
+    struct vdisk_aio *aio = arg;
+    int stop = 0;
+    while (!stop) {
+        ring_enter(aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+        unsigned head = *aio->cq_head;
+        unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+            vdisk_io_t *io = (vdisk_io_t *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+            if (io == NULL) {
+                stop = 1;
+                continue;
+            }
+
+            // Short transfer or error (old kernel without IORING_OP_READ,
+            // EAGAIN, ...): redo it the blocking way
+            if (res < 0 || (uint32_t)res != io->count * aio->disk->sector_size) {
+                run_io(aio->disk, io);
+            } else {
+                io->result = 0;
+            }
+            complete_io(aio, io);
+        }
+    }
+    return NULL;
+}
+
+static int ring_start(struct vdisk_aio *aio) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    aio->ring_fd = syscall(__NR_io_uring_setup, aio->depth, &p);
+    if (aio->ring_fd < 0) {
+        return -1;
+    }
+
+    aio->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cq_ring_size > aio->sq_ring_size) {
+            aio->sq_ring_size = aio->cq_ring_size;
+        }
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+    aio->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *sq = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    aio->ring_fd, IORING_OFF_SQ_RING);
+    void *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  aio->ring_fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    aio->ring_fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        if (cq != MAP_FAILED && cq != sq) {
+            munmap(cq, aio->cq_ring_size);
+        }
+        if (sq != MAP_FAILED) {
+            munmap(sq, aio->sq_ring_size);
+        }
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    aio->sq_ring = sq;
+    aio->cq_ring = cq;
+    aio->sqes = sqes;
+    aio->sq_tail = (unsigned *)(aio->sq_ring + p.sq_off.tail);
+    aio->sq_mask = (unsigned *)(aio->sq_ring + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)(aio->sq_ring + p.sq_off.array);
+    aio->cq_head = (unsigned *)(aio->cq_ring + p.cq_off.head);
+    aio->cq_tail = (unsigned *)(aio->cq_ring + p.cq_off.tail);
+    aio->cq_mask = (unsigned *)(aio->cq_ring + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(aio->cq_ring + p.cq_off.cqes);
+
+    if (pthread_create(&aio->reaper, NULL, reaper_main, aio) != 0) {
+        munmap(aio->sqes, aio->sqes_size);
+        if (aio->cq_ring != aio->sq_ring) {
+            munmap(aio->cq_ring, aio->cq_ring_size);
+        }
+        munmap(aio->sq_ring, aio->sq_ring_size);
+        close(aio->ring_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// All the requests go into the SQ ring, one io_uring_enter for the batch
+// (less when the queue depth is reached and we have to wait for room)
+static void ring_submit(struct vdisk_aio *aio, vdisk_io_t *ios, int nios) {
+    unsigned to_submit = 0;
+    pthread_mutex_lock(&aio->lock);
+    for (int i = 0; i < nios; i++) {
+        while (aio->inflight == aio->depth) {
+            if (to_submit > 0) {
+                ring_enter(aio->ring_fd, to_submit, 0, 0);
+                to_submit = 0;
+            }
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        }
+        ring_queue(aio, ios[i].write ? IORING_OP_WRITE : IORING_OP_READ, &ios[i]);
+        aio->inflight++;
+        to_submit++;
+    }
+    if (to_submit > 0) {
+        ring_enter(aio->ring_fd, to_submit, 0, 0);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+static void ring_stop(struct vdisk_aio *aio) {
+    pthread_mutex_lock(&aio->lock);
+    while (aio->inflight > 0) {
+        pthread_cond_wait(&aio->cond, &aio->lock);
+    }
+    ring_queue(aio, IORING_OP_NOP, NULL);
+    ring_enter(aio->ring_fd, 1, 0, 0);
+    pthread_mutex_unlock(&aio->lock);
+
+    pthread_join(aio->reaper, NULL);
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring != aio->sq_ring) {
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);
+}
+#endif
+
+
+/* Public interface */
+
+// Starts an async engine keeping up to `depth` requests in flight.
+// A mapped disk keeps running requests inline: a memcpy doesn't wait.
+int vdisk_aio_on(DISK *diskp, uint32_t depth, int engine) {
+    if (diskp->fp == NULL) {
+        return vdisk_ENODISK;
+    }
+    if (diskp->aio != NULL || depth == 0 || diskp->map != NULL) {
+        return 0;
+    }
+
+    struct vdisk_aio *aio = calloc(1, sizeof(struct vdisk_aio));
+    if (aio == NULL) {
+        return E_OUT_OF_SPACE;
+    }
+    aio->disk = diskp;
+    aio->depth = depth;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->cond, NULL);
+
+    int err = -1;
+#ifdef HAVE_IO_URING
+    if (engine != VDISK_AIO_THREADS) {
+        err = ring_start(aio);
+        aio->engine = VDISK_AIO_URING;
+    }
+#endif
+    if (err != 0 && engine != VDISK_AIO_URING) {
+        err = pool_start(aio);
+        aio->engine = VDISK_AIO_THREADS;
+    }
+    if (err != 0) {
+        pthread_mutex_destroy(&aio->lock);
+        pthread_cond_destroy(&aio->cond);
+        free(aio);
+        return (err == E_OUT_OF_SPACE) ? err : vdisk_EACCESS;
+    }
+
+    diskp->aio = aio;
+    return 0;
+}
+
+// Queues `nios` requests; each one's `done` is called when it completes.
+// Without an engine they simply run before this returns.
+int vdisk_aio_submit(DISK *diskp, vdisk_io_t *ios, int nios) {
+    struct vdisk_aio *aio = diskp->aio;
+    if (aio == NULL) {
+        for (int i = 0; i < nios; i++) {
+            run_io(diskp, &ios[i]);
+            if (ios[i].done != NULL) {
+                ios[i].done(&ios[i]);
+            }
+        }
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    if (aio->engine == VDISK_AIO_URING) {
+        // (the other paths go through vdisk_*_range, which count them)
+        for (int i = 0; i < nios; i++) {
+            vdisk_count_io(diskp, ios[i].write, ios[i].count);
+        }
+        ring_submit(aio, ios, nios);
+        return 0;
+    }
+#endif
+    pool_submit(aio, ios, nios);
+    return 0;
+}
+
+// Engine in use (VDISK_AIO_URING / VDISK_AIO_THREADS), -1 if none
+int vdisk_aio_engine(DISK *diskp) {
+    return (diskp->aio != NULL) ? diskp->aio->engine : -1;
+}
+
+// Waits for the requests in flight, then stops the engine
+void vdisk_aio_off(DISK *diskp) {
+    struct vdisk_aio *aio = diskp->aio;
+    if (aio == NULL) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (aio->engine == VDISK_AIO_URING) {
+        ring_stop(aio);
+    }
+#endif
+    if (aio->engine == VDISK_AIO_THREADS) {
+        pool_stop(aio);
+    }
+
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->cond);
+    free(aio);
+    diskp->aio = NULL;
+}
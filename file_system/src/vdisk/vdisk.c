@@ -1,9 +1,15 @@
+#define _GNU_SOURCE // O_DIRECT, statx
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <bsd/string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #ifndef __APPLE__
 #include <stdio_ext.h>
@@ -15,9 +21,24 @@
 
 const int VDISK_SECTOR_SIZE = 1024;
 
+#define VDISK_MAX_IOV 64 // max # of runs merged into one preadv/pwritev
+#define VDISK_DIRECT_ALIGN 512 // O_DIRECT alignment when the kernel can't tell us
+#define TRY_BUFFERED 1 // transfer_direct: not possible, use the buffered descriptor
+
 int vdisk_on(char *filename, DISK *diskp) {
+    return vdisk_open(filename, diskp, VDISK_BACKEND_STDIO);
+}
+
+int vdisk_open(char *filename, DISK *diskp, int backend) {
     FILE *vdisk = fopen(filename, "r+b");
     diskp->fp = vdisk;
+    diskp->backend = VDISK_BACKEND_STDIO;
+    diskp->map = NULL;
+    diskp->map_length = 0;
+    diskp->aio = NULL;
+    diskp->direct_fd = -1;
+    diskp->align = 1;
+    memset(&diskp->stats, 0, sizeof(diskp->stats));
     if (vdisk == NULL) {
         if (errno == EACCES) {
             return vdisk_EACCESS;
@@ -39,9 +60,98 @@ int vdisk_on(char *filename, DISK *diskp) {
         return vdisk_ENODISK;
     }
     diskp->sector_size = VDISK_SECTOR_SIZE;
+
+    if (backend == VDISK_BACKEND_MMAP) {
+        size_t length = (size_t)diskp->size_in_sectors * VDISK_SECTOR_SIZE;
+        void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(vdisk), 0);
+        if (map == MAP_FAILED) {
+            vdisk_off(diskp);
+            return vdisk_EACCESS;
+        }
+        diskp->map = (uint8_t *)map;
+        diskp->map_length = length;
+        diskp->backend = VDISK_BACKEND_MMAP;
+    }
+
+    // Direct I/O: a second descriptor opened with O_DIRECT, used for every
+    // suitably aligned transfer so the page cache is bypassed
+    if (backend == VDISK_BACKEND_DIRECT) {
+        int fd = open(filename, O_RDWR | O_DIRECT);
+        if (fd < 0) {
+            vdisk_off(diskp);
+            return vdisk_EACCESS; // e.g. file system without O_DIRECT support
+        }
+        diskp->direct_fd = fd;
+        diskp->align = VDISK_DIRECT_ALIGN;
+#ifdef STATX_DIOALIGN
+        struct statx sx;
+        if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 && (sx.stx_mask & STATX_DIOALIGN) &&
+            sx.stx_dio_offset_align != 0) {
+            diskp->align = sx.stx_dio_offset_align > sx.stx_dio_mem_align ? sx.stx_dio_offset_align
+                                                                          : sx.stx_dio_mem_align;
+        }
+#endif
+        diskp->backend = VDISK_BACKEND_DIRECT;
+    }
     return 0;
 }
 
+// Identity of an image file (device & inode #): tells whether 2 paths name
+// the same image
+int vdisk_file_id(char *filename, vdisk_id_t *id) {
+    struct stat st;
+    // (not stat(): the fs single-image API has a stat() of its own)
+    if (fstatat(AT_FDCWD, filename, &st, 0) != 0) {
+        if (errno == EACCES) {
+            return vdisk_EACCESS;
+        }
+        if (errno == ENOENT) {
+            return vdisk_ENOEXIST;
+        } else {
+            return -1; // unknown error
+        }
+    }
+    id->dev = (uint64_t)st.st_dev;
+    id->ino = (uint64_t)st.st_ino;
+    return 0;
+}
+
+// Change the unit of sector #s and counts (a multiple of the default one),
+// e.g. to the block size of the file system on the image
+int vdisk_set_sector_size(DISK *diskp, uint32_t sector_size) {
+    if (diskp->fp == NULL) {
+        return vdisk_ENODISK;
+    }
+    if (sector_size == 0 || sector_size % VDISK_SECTOR_SIZE != 0) {
+        return vdisk_ESECTOR;
+    }
+    fseek(diskp->fp, 0L, SEEK_END);
+    uint32_t size_in_sectors = ftell(diskp->fp) / sector_size;
+    if (size_in_sectors == 0) {
+        return vdisk_ENODISK;
+    }
+    diskp->sector_size = sector_size;
+    diskp->size_in_sectors = size_in_sectors;
+    return 0;
+}
+
+// Buffers that direct I/O can use as they are (no bounce copy), also fine
+// for the other backends
+void *vdisk_alloc_buffer(size_t length) {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, VDISK_BUFFER_ALIGN, length ? length : 1) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+void vdisk_free_buffer(void *buffer) {
+    free(buffer);
+}
+
+// NB: all I/O is positional (pread/pwrite), there is no shared file position
+// to move, so this only validates the sector and several threads can use the
+// same DISK at once
 int seek_sector(DISK *diskp, uint32_t sector) {
     FILE *vdisk = diskp->fp;
     if (vdisk == NULL) {
@@ -50,39 +160,256 @@ int seek_sector(DISK *diskp, uint32_t sector) {
     if (sector >= diskp->size_in_sectors) {
         return vdisk_EEXCEED;
     }
-    fseek(vdisk, sector * diskp->sector_size, SEEK_SET);
     return 0;
 }
 
+static int is_aligned(DISK *diskp, off_t pos, const void *buffer, size_t length) {
+    return pos % diskp->align == 0 && length % diskp->align == 0 && (uintptr_t)buffer % diskp->align == 0;
+}
+
+// O_DIRECT transfer, through an aligned bounce buffer if the caller's isn't
+// -> TRY_BUFFERED if the kernel refuses it (EINVAL: alignment it didn't report)
+static int transfer_direct(DISK *diskp, off_t pos, uint8_t *buffer, size_t length, int write) {
+    uint8_t *io_buffer = buffer;
+    if ((uintptr_t)buffer % diskp->align != 0) {
+        io_buffer = vdisk_alloc_buffer(length);
+        if (io_buffer == NULL) {
+            return TRY_BUFFERED;
+        }
+        if (write) {
+            memcpy(io_buffer, buffer, length);
+        }
+    }
+
+    int err = 0;
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write ? pwrite(diskp->direct_fd, io_buffer + done, length - done, pos + done)
+                          : pread(diskp->direct_fd, io_buffer + done, length - done, pos + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EINVAL && done == 0) {
+            err = TRY_BUFFERED;
+            break;
+        }
+        if (n <= 0 || (size_t)n % diskp->align != 0) {
+            err = (n > 0) ? TRY_BUFFERED : vdisk_ESECTOR; // odd short transfer: redo it buffered
+            break;
+        }
+        done += n;
+    }
+
+    if (io_buffer != buffer) {
+        if (!write && err == 0) {
+            memcpy(buffer, io_buffer, length);
+        }
+        vdisk_free_buffer(io_buffer);
+    }
+    return err;
+}
+
+// pread/pwrite the whole `length` bytes, retrying on short transfers
+static int transfer_at(DISK *diskp, off_t pos, uint8_t *buffer, size_t length, int write) {
+    if (diskp->direct_fd >= 0 && pos % diskp->align == 0 && length % diskp->align == 0) {
+        int err = transfer_direct(diskp, pos, buffer, length, write);
+        if (err != TRY_BUFFERED) {
+            return err;
+        }
+    }
+
+    int fd = fileno(diskp->fp);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write ? pwrite(fd, buffer + done, length - done, pos + done)
+                          : pread(fd, buffer + done, length - done, pos + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return vdisk_ESECTOR;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Zero-copy access to a sector (mmap backend only, NULL otherwise)
+uint8_t *vdisk_sector_ptr(DISK *diskp, uint32_t sector) {
+    if (diskp->map == NULL || sector >= diskp->size_in_sectors) {
+        return NULL;
+    }
+    return diskp->map + (size_t)sector * diskp->sector_size;
+}
+
+// Counts one call moving `sectors` sectors (see vdisk_stats_t)
+void vdisk_count_io(DISK *diskp, int write, uint32_t sectors) {
+    if (write) {
+        __atomic_fetch_add(&diskp->stats.writes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&diskp->stats.sectors_written, sectors, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&diskp->stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&diskp->stats.sectors_read, sectors, __ATOMIC_RELAXED);
+    }
+}
+
+void vdisk_get_stats(DISK *diskp, vdisk_stats_t *stats) {
+    stats->reads = __atomic_load_n(&diskp->stats.reads, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&diskp->stats.writes, __ATOMIC_RELAXED);
+    stats->sectors_read = __atomic_load_n(&diskp->stats.sectors_read, __ATOMIC_RELAXED);
+    stats->sectors_written = __atomic_load_n(&diskp->stats.sectors_written, __ATOMIC_RELAXED);
+}
+
+void vdisk_reset_stats(DISK *diskp) {
+    __atomic_store_n(&diskp->stats.reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&diskp->stats.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&diskp->stats.sectors_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&diskp->stats.sectors_written, 0, __ATOMIC_RELAXED);
+}
+
 inline int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    vdisk_count_io(diskp, 0, 1);
     int err = seek_sector(diskp, sector);
     if (err) {
         return err;
     }
-    if (fread(buffer, 1, diskp->sector_size, diskp->fp) != diskp->sector_size) {
-        return vdisk_ESECTOR;
+    if (diskp->map != NULL) {
+        memcpy(buffer, diskp->map + (size_t)sector * diskp->sector_size, diskp->sector_size);
+        return 0;
     }
-    return 0;
+    return transfer_at(diskp, (off_t)sector * diskp->sector_size, buffer, diskp->sector_size, 0);
 }
 
 inline int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    vdisk_count_io(diskp, 1, 1);
     int err = seek_sector(diskp, sector);
     if (err) {
         return err;
     }
-    if (fwrite(buffer, 1, diskp->sector_size, diskp->fp) != diskp->sector_size) {
-        return vdisk_ESECTOR;
+    if (diskp->map != NULL) {
+        memcpy(diskp->map + (size_t)sector * diskp->sector_size, buffer, diskp->sector_size);
+        return 0;
+    }
+    return transfer_at(diskp, (off_t)sector * diskp->sector_size, buffer, diskp->sector_size, 1);
+}
+
+// Moves `count` contiguous sectors starting at `sector` in a single call
+static int transfer_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer, int write) {
+    if (diskp->fp == NULL) {
+        return vdisk_ENODISK;
+    }
+    if (count > diskp->size_in_sectors || sector > diskp->size_in_sectors - count) {
+        return vdisk_EEXCEED;
+    }
+
+    size_t length = (size_t)count * diskp->sector_size;
+    if (diskp->map != NULL) {
+        uint8_t *mapped = diskp->map + (size_t)sector * diskp->sector_size;
+        if (write) {
+            memcpy(mapped, buffer, length);
+        } else {
+            memcpy(buffer, mapped, length);
+        }
+        return 0;
+    }
+
+    return transfer_at(diskp, (off_t)sector * diskp->sector_size, buffer, length, write);
+}
+
+int vdisk_read_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer) {
+    vdisk_count_io(diskp, 0, count);
+    return transfer_range(diskp, sector, count, buffer, 0);
+}
+
+int vdisk_write_range(DISK *diskp, uint32_t sector, uint32_t count, uint8_t *buffer) {
+    vdisk_count_io(diskp, 1, count);
+    return transfer_range(diskp, sector, count, buffer, 1);
+}
+
+// Scatter/gather variants: a list of sector runs, each with its own buffer.
+// Runs that pick up where the previous one ended share one preadv/pwritev.
+static int transfer_runs(DISK *diskp, const vdisk_run_t *runs, int nruns, int write) {
+    uint32_t sectors = 0;
+    for (int j = 0; j < nruns; j++) {
+        sectors += runs[j].count;
+    }
+    vdisk_count_io(diskp, write, sectors);
+
+    int i = 0;
+    while (i < nruns) {
+        // Gather the runs that continue each other
+        struct iovec iov[VDISK_MAX_IOV];
+        uint32_t end = runs[i].sector;
+        size_t length = 0;
+        int n = 0;
+        while (i + n < nruns && n < VDISK_MAX_IOV && runs[i + n].sector == end) {
+            iov[n].iov_base = runs[i + n].buffer;
+            iov[n].iov_len = (size_t)runs[i + n].count * diskp->sector_size;
+            length += iov[n].iov_len;
+            end += runs[i + n].count;
+            n++;
+        }
+
+        // Direct I/O: only if every buffer is aligned, else run by run
+        // (through the bounce buffers of transfer_direct)
+        off_t pos = (off_t)runs[i].sector * diskp->sector_size;
+        int fd = (diskp->fp != NULL) ? fileno(diskp->fp) : -1;
+        if (diskp->direct_fd >= 0) {
+            fd = diskp->direct_fd;
+            for (int j = 0; j < n; j++) {
+                if (!is_aligned(diskp, pos, iov[j].iov_base, iov[j].iov_len)) {
+                    fd = -1;
+                }
+            }
+        }
+
+        int vectored = 0;
+        if (n > 1 && diskp->map == NULL && fd >= 0 && end <= diskp->size_in_sectors) {
+            ssize_t done = write ? pwritev(fd, iov, n, pos) : preadv(fd, iov, n, pos);
+            vectored = (done >= 0 && (size_t)done == length);
+        }
+
+        // One at a time (mapped disk, single run, or short/failed transfer)
+        for (int j = 0; !vectored && j < n; j++) {
+            int err = transfer_range(diskp, runs[i + j].sector, runs[i + j].count, runs[i + j].buffer, write);
+            if (err) {
+                return err;
+            }
+        }
+        i += n;
     }
     return 0;
 }
 
+int vdisk_readv(DISK *diskp, const vdisk_run_t *runs, int nruns) {
+    return transfer_runs(diskp, runs, nruns, 0);
+}
+
+int vdisk_writev(DISK *diskp, const vdisk_run_t *runs, int nruns) {
+    return transfer_runs(diskp, runs, nruns, 1);
+}
+
 int vdisk_sync(DISK *diskp) {
     FILE *vdisk = diskp->fp;
     if (vdisk == NULL){
         return vdisk_ENODISK;
     }
-    fflush(vdisk);
-    fsync(fileno(vdisk));
+    if (diskp->map != NULL) {
+        if (msync(diskp->map, diskp->map_length, MS_SYNC) != 0) {
+            return vdisk_ESECTOR;
+        }
+        return 0;
+    }
+    if (diskp->direct_fd >= 0) {
+        // nothing sits in the stdio buffer or page cache
+        if (fsync(diskp->direct_fd) != 0) {
+            return vdisk_ESECTOR;
+        }
+        return 0;
+    }
+    if (fflush(vdisk) != 0 || fsync(fileno(vdisk)) != 0) {
+        return vdisk_ESECTOR; // a write the OS had accepted didn't make it
+    }
     return 0;
 }
 
@@ -91,6 +418,15 @@ void vdisk_off(DISK *diskp) {
     if (vdisk == NULL) {
         return;
     }
+    vdisk_aio_off(diskp);
+    if (diskp->direct_fd >= 0) {
+        close(diskp->direct_fd);
+        diskp->direct_fd = -1;
+    }
+    if (diskp->map != NULL) {
+        munmap(diskp->map, diskp->map_length);
+        diskp->map = NULL;
+    }
     fpurge(vdisk);
     fclose(vdisk);
     free(diskp->name);